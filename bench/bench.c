@@ -0,0 +1,367 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <time.h>
+
+/*
+ * benchmark harness driving sshell through its stdin like a user would.
+ * every command is timed from the moment its line is written until its
+ * "+ completed" line shows up on stderr, which covers reading, parsing,
+ * launching, waiting and reporting. VmRSS of the shell is sampled while
+ * each workload runs.
+ *
+ * usage: bench [-s sshell] [-n commands] [-p max_stages] [-j] [-o file]
+ *   -s  shell to drive, ./sshell by default
+ *   -n  commands per workload
+ *   -p  longest pipeline, pipelines of 2..p stages are measured
+ *   -j  JSON output instead of CSV
+ *   -o  write the results to a file instead of stdout
+ */
+
+#define RSS_SAMPLES 16  // samples of VmRSS per workload
+
+// running shell under test
+typedef struct {
+    pid_t pid;
+    int in_fd;   // its stdin
+    int err_fd;  // its stderr, where completion lines arrive
+    char buf[65536];
+    size_t len;
+} Shell;
+
+// results of one workload
+typedef struct {
+    char name[32];
+    int commands;
+    double p50_us;
+    double p99_us;
+    double per_sec;
+    long rss_kb[RSS_SAMPLES];
+    int rss_count;
+} Result;
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/**
+ * @brief starts the shell with its stdin and stderr connected to pipes, stdout is discarded
+ */
+static void shell_start(Shell *sh, const char *path) {
+    int in_pipe[2], err_pipe[2];
+    if (pipe(in_pipe) < 0 || pipe(err_pipe) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+
+    sh->pid = fork();
+    if (sh->pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (sh->pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(in_pipe[0], STDIN_FILENO);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(err_pipe[1], STDERR_FILENO);
+        close(in_pipe[0]);
+        close(in_pipe[1]);
+        close(err_pipe[0]);
+        close(err_pipe[1]);
+        close(devnull);
+        execl(path, path, (char *)NULL);
+        _exit(127);
+    }
+
+    close(in_pipe[0]);
+    close(err_pipe[1]);
+    sh->in_fd = in_pipe[1];
+    sh->err_fd = err_pipe[0];
+    sh->len = 0;
+}
+
+
+static void shell_send(Shell *sh, const char *line) {
+    size_t len = strlen(line);
+    if (write(sh->in_fd, line, len) != (ssize_t)len || write(sh->in_fd, "\n", 1) != 1) {
+        perror("write");
+        exit(1);
+    }
+}
+
+/**
+ * @brief reads stderr until the next completion line and returns it
+ *
+ * @param sh the shell
+ * @param line buffer for the completion line
+ * @param size size of the buffer
+ */
+static void shell_next_completion(Shell *sh, char *line, size_t size) {
+    while (1) {
+        char *nl;
+        while ((nl = memchr(sh->buf, '\n', sh->len)) != NULL) {
+            size_t n = nl - sh->buf;
+            int is_completion = !strncmp(sh->buf, "+ completed", 11);
+            if (is_completion) {
+                size_t copy = n < size - 1 ? n : size - 1;
+                memcpy(line, sh->buf, copy);
+                line[copy] = '\0';
+            }
+            memmove(sh->buf, nl + 1, sh->len - n - 1);
+            sh->len -= n + 1;
+            if (is_completion) {
+                return;
+            }
+        }
+
+        ssize_t got = read(sh->err_fd, sh->buf + sh->len, sizeof(sh->buf) - sh->len);
+        if (got <= 0) {
+            fprintf(stderr, "bench: shell exited early\n");
+            exit(1);
+        }
+        sh->len += got;
+    }
+}
+
+/**
+ * @brief one round trip before measuring, so the shell has exec'd and set up
+ */
+static void shell_warm_up(Shell *sh) {
+    char line[256];
+    shell_send(sh, "true");
+    shell_next_completion(sh, line, sizeof(line));
+}
+
+static void shell_stop(Shell *sh) {
+    char line[256];
+    shell_send(sh, "exit");
+    shell_next_completion(sh, line, sizeof(line));
+    close(sh->in_fd);
+    close(sh->err_fd);
+    waitpid(sh->pid, NULL, 0);
+}
+
+static long rss_kb(pid_t pid) {
+    char path[64], line[256];
+    long kb = -1;
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmRSS: %ld", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void finish_result(Result *res, double *lat, int n, double elapsed_us) {
+    qsort(lat, n, sizeof(double), cmp_double);
+    res->commands = n;
+    res->p50_us = lat[n / 2];
+    res->p99_us = lat[(int)(n * 0.99) < n ? (int)(n * 0.99) : n - 1];
+    res->per_sec = n / (elapsed_us / 1e6);
+}
+
+static void sample_rss(Result *res, Shell *sh, int i, int n) {
+    if (res->rss_count < RSS_SAMPLES && i % (n / RSS_SAMPLES > 0 ? n / RSS_SAMPLES : 1) == 0) {
+        res->rss_kb[res->rss_count++] = rss_kb(sh->pid);
+    }
+}
+
+/**
+ * @brief runs one foreground command line n times, one at a time
+ */
+static void run_serial(Result *res, const char *shell, const char *name, const char *line, int n) {
+    Shell sh;
+    char done[4096];
+    double *lat = malloc(n * sizeof(double));
+
+    memset(res, 0, sizeof(*res));
+    snprintf(res->name, sizeof(res->name), "%s", name);
+    shell_start(&sh, shell);
+    shell_warm_up(&sh);
+
+    double start = now_us();
+    for (int i = 0; i < n; i++) {
+        double t0 = now_us();
+        shell_send(&sh, line);
+        shell_next_completion(&sh, done, sizeof(done));
+        lat[i] = now_us() - t0;
+        sample_rss(res, &sh, i, n);
+    }
+    finish_result(res, lat, n, now_us() - start);
+
+    shell_stop(&sh);
+    free(lat);
+}
+
+/**
+ * @brief launches n background jobs back to back, each job is timed from its
+ *        line to its own completion line, told apart by a job number argument
+ */
+static void run_bg_storm(Result *res, const char *shell, int n) {
+    Shell sh;
+    char line[64], done[256];
+    double *sent = malloc(n * sizeof(double));
+    double *lat = malloc(n * sizeof(double));
+
+    memset(res, 0, sizeof(*res));
+    snprintf(res->name, sizeof(res->name), "bg_storm");
+    shell_start(&sh, shell);
+    shell_warm_up(&sh);
+
+    double start = now_us();
+    for (int i = 0; i < n; i++) {
+        snprintf(line, sizeof(line), "true %d &", i);
+        sent[i] = now_us();
+        shell_send(&sh, line);
+        sample_rss(res, &sh, i, n);
+    }
+    // an empty foreground command makes the shell report jobs that are still pending
+    for (int got = 0; got < n; ) {
+        shell_send(&sh, "true");
+        while (1) {
+            int job;
+            shell_next_completion(&sh, done, sizeof(done));
+            if (sscanf(done, "+ completed 'true %d &'", &job) == 1 && job >= 0 && job < n) {
+                lat[got++] = now_us() - sent[job];
+            } else {
+                break;  // completion of the foreground true
+            }
+        }
+    }
+    finish_result(res, lat, n, now_us() - start);
+
+    shell_stop(&sh);
+    free(sent);
+    free(lat);
+}
+
+static void print_csv(FILE *out, Result *res, int count) {
+    fprintf(out, "workload,commands,p50_us,p99_us,per_sec,rss_kb_first,rss_kb_max,rss_kb_last\n");
+    for (int i = 0; i < count; i++) {
+        long max = 0;
+        for (int j = 0; j < res[i].rss_count; j++) {
+            max = res[i].rss_kb[j] > max ? res[i].rss_kb[j] : max;
+        }
+        fprintf(out, "%s,%d,%.1f,%.1f,%.0f,%ld,%ld,%ld\n", res[i].name, res[i].commands,
+                res[i].p50_us, res[i].p99_us, res[i].per_sec,
+                res[i].rss_kb[0], max, res[i].rss_kb[res[i].rss_count - 1]);
+    }
+}
+
+static void print_json(FILE *out, Result *res, int count) {
+    fprintf(out, "[\n");
+    for (int i = 0; i < count; i++) {
+        fprintf(out, "  {\"workload\": \"%s\", \"commands\": %d, \"p50_us\": %.1f, "
+                "\"p99_us\": %.1f, \"per_sec\": %.0f, \"rss_kb\": [",
+                res[i].name, res[i].commands, res[i].p50_us, res[i].p99_us, res[i].per_sec);
+        for (int j = 0; j < res[i].rss_count; j++) {
+            fprintf(out, "%s%ld", j ? ", " : "", res[i].rss_kb[j]);
+        }
+        fprintf(out, "]}%s\n", i < count - 1 ? "," : "");
+    }
+    fprintf(out, "]\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *shell = "./sshell";
+    const char *out_path = NULL;
+    int n = 500;
+    int max_stages = 8;
+    int json = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:n:p:jo:")) != -1) {
+        switch (opt) {
+        case 's':
+            shell = optarg;
+            break;
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 'p':
+            max_stages = atoi(optarg);
+            break;
+        case 'j':
+            json = 1;
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: bench [-s sshell] [-n commands] [-p max_stages] [-j] [-o file]\n");
+            return 1;
+        }
+    }
+    if (n < 1 || max_stages < 2) {
+        fprintf(stderr, "bench: need at least 1 command and 2 stages\n");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // scratch files for the redirection workload
+    char dir[] = "/tmp/sshell_bench_XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    char in_path[64], out_file[64], line[4096];
+    snprintf(in_path, sizeof(in_path), "%s/in", dir);
+    snprintf(out_file, sizeof(out_file), "%s/out", dir);
+    FILE *f = fopen(in_path, "w");
+    fprintf(f, "some input for the redirection workload\n");
+    fclose(f);
+
+    Result *res = calloc(max_stages + 2, sizeof(Result));
+    int count = 0;
+
+    run_serial(&res[count++], shell, "true", "true", n);
+    for (int stages = 2; stages <= max_stages; stages++) {
+        char name[32];
+        line[0] = '\0';
+        for (int i = 0; i < stages; i++) {
+            strcat(line, i ? " | true" : "true");
+        }
+        snprintf(name, sizeof(name), "pipeline_%d", stages);
+        run_serial(&res[count++], shell, name, line, n);
+    }
+    snprintf(line, sizeof(line), "cat < %s | cat | cat > %s", in_path, out_file);
+    run_serial(&res[count++], shell, "redirect", line, n);
+    run_bg_storm(&res[count++], shell, n);
+
+    unlink(in_path);
+    unlink(out_file);
+    rmdir(dir);
+
+    FILE *out = out_path ? fopen(out_path, "w") : stdout;
+    if (!out) {
+        perror("fopen");
+        return 1;
+    }
+    if (json) {
+        print_json(out, res, count);
+    } else {
+        print_csv(out, res, count);
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+    free(res);
+    return 0;
+}
@@ -0,0 +1,25 @@
+#!/bin/bash
+
+# Launches per second of sshell itself with the vfork and fork launch paths
+# usage: launch.sh [sshell_path] [launches]
+
+SSHELL_EXEC="${1:-./sshell}"
+LAUNCHES="${2:-2000}"
+
+script=$(mktemp)
+for ((i = 0; i < LAUNCHES; i++)); do
+    echo "true"
+done > "${script}"
+
+rate() {
+    # 1: launch mode
+    local start=$(date +%s%N)
+    SSHELL_LAUNCH="${1}" "${SSHELL_EXEC}" "${script}" 2>/dev/null
+    local end=$(date +%s%N)
+    echo $(( LAUNCHES * 1000000000 / (end - start) ))
+}
+
+echo "launches,fork_per_sec,vfork_per_sec"
+echo "${LAUNCHES},$(rate fork),$(rate vfork)"
+
+rm -f "${script}"
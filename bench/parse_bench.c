@@ -0,0 +1,269 @@
+#define SSHELL_NO_MAIN
+#include "../sshell.c"
+
+#include <ctype.h>
+#include <time.h>
+
+/*
+ * lines parsed per second by the single pass lexer in sshell.c versus the
+ * previous pad_spaces_if_missing + strtok + trim_spaces parser kept below.
+ *
+ * usage: parse_bench [-n iterations]
+ */
+
+// previous parser, kept verbatim apart from the names and its fixed size Command
+
+#define LEGACY_MAX_COMMANDS 4
+#define LEGACY_MAX_ARGS 16
+
+typedef struct {
+    char *args[LEGACY_MAX_ARGS + 1];
+    char *input_f;
+    char *output_f;
+    int background;
+} LegacyCommand;
+
+
+/**
+ * @brief pads | < > chars with spaces so that it makes splitting using strtok easier
+ * 
+ * @param line whole line
+ */
+static void legacy_pad_spaces(char *line) {
+    char temp[CMDLINE_MAX];
+    int temp_index = 0;
+
+    for (int i = 0; line[i] != '\0'; i++) {
+        // for: | < >
+        if (line[i] == '<' || line[i] == '>' || line[i] == '|') {
+            // add space before if not there
+            if (temp_index > 0 && temp[temp_index - 1] != ' ') {
+                temp[temp_index] = ' ';
+                temp_index++;
+            }
+
+            temp[temp_index] = line[i];
+            temp_index++;
+
+            if (line[i + 1] != '\0' && line[i + 1] != ' ') {
+                temp[temp_index] = ' ';
+                temp_index++;
+            }
+        } else {
+            temp[temp_index] = line[i];
+            temp_index++;
+        }
+    }
+
+    temp[temp_index] = '\0';
+    strcpy(line, temp);
+}
+
+/**
+ * @brief trims leading and trailing spaces
+ * 
+ * @param str 
+ */
+static void legacy_trim_spaces(char *str) {
+    // leading spaces
+    while (isspace(*str)) {
+        str++;
+    }
+    
+    // trailing spaces
+    char *end = str + strlen(str) - 1;
+    while (end > str && isspace(*end)) {
+        end--;
+    }
+
+    *(end + 1) = '\0';
+}
+
+/**
+ * @brief parses command line and returns number of commands. commands are stored in array of Command structs
+ * 
+ * @param line line to process
+ * @param commands commands struct list
+ * @param arena storage for the parsed tokens
+ * @return int num commands or -1 if invalid
+ */
+static int legacy_parse_command(char *line, LegacyCommand commands[], Arena *arena) {
+    char *sub_commands_by_pipe[LEGACY_MAX_COMMANDS];
+    int num_commands = 0;
+    int background = 0;
+
+    legacy_trim_spaces(line);
+    
+    // check if the command ends with &, indicating a background job
+    int len = strlen(line);
+    if (len > 0 && line[len-1] == '&') {
+        background = 1;
+        line[len-1] = '\0';  // remove the & character
+        legacy_trim_spaces(line);   // trim any spaces before the &
+        
+        if (strlen(line) == 0) {
+            fprintf(stderr, "Error: missing command\n");
+            return -1;
+        }
+    }
+
+    // check if command has a & that's not in the end
+    char *ampersand = strchr(line, '&');
+    if (ampersand != NULL && ampersand != line + strlen(line) - 1) {
+        fprintf(stderr, "Error: mislocated background sign\n");
+        return -1;
+    }
+
+    if (line[0] == '|' || line[strlen(line) - 1] == '|') {
+        fprintf(stderr, "Error: missing command\n");
+        return -1;
+    }
+
+    // split when | symbol
+    char *sub_command = strtok(line, "|");
+    while (sub_command != NULL && num_commands < LEGACY_MAX_COMMANDS) {
+        sub_commands_by_pipe[num_commands] = sub_command;
+        num_commands++;
+        sub_command = strtok(NULL, "|");
+    }
+
+    // parse each command looking for < or > and managing args
+    for (int i = 0; i < num_commands; i++) {
+        legacy_trim_spaces(sub_commands_by_pipe[i]);
+
+        if (sub_commands_by_pipe[i][0] == '\0' || 
+            (sub_commands_by_pipe[i][0] == '>' || sub_commands_by_pipe[i][0] == '<')) {
+            fprintf(stderr, "Error: missing command\n");
+            return -1;
+        }
+
+        LegacyCommand *cmd = &commands[i];
+        cmd->input_f = NULL;
+        cmd->output_f = NULL;
+        cmd->background = 0;
+        
+        // only the last command can be a background job
+        if (i == num_commands - 1 && background) {
+            cmd->background = 1;
+        }
+
+        int num_args = 0;
+        char *arg_split_space = strtok(sub_commands_by_pipe[i], " ");
+        while (arg_split_space != NULL) {
+            if (strcmp(arg_split_space, "<") == 0) {
+                if (i > 0) {
+                    fprintf(stderr, "Error: mislocated input redirection\n");
+                    return -1;
+                }
+                arg_split_space = strtok(NULL, " ");
+                if (arg_split_space) {
+                    cmd->input_f = arena_strdup(arena, arg_split_space); // modified later so must use copy
+                    int input_fd = open(arg_split_space, O_RDONLY);
+                    if (input_fd == -1) {
+                        fprintf(stderr, "Error: cannot open input file\n");
+                        close(input_fd);
+                        return -1;
+                    }
+                    close(input_fd);
+                } else {
+                    fprintf(stderr, "Error: no input file\n");
+                    return -1;
+                }
+            } else if (strcmp(arg_split_space, ">") == 0) {
+                if (i < num_commands - 1) {
+                    fprintf(stderr, "Error: mislocated output redirection\n");
+                    return -1;
+                }
+                arg_split_space = strtok(NULL, " ");
+                if (arg_split_space) {
+                    cmd->output_f = arena_strdup(arena, arg_split_space);
+                    int output_fd = open(arg_split_space, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                    if (output_fd == -1) {
+                        fprintf(stderr, "Error: cannot open output file\n");
+                        close(output_fd);
+                        return -1;
+                    }
+                    close(output_fd);
+                } else {
+                    fprintf(stderr, "Error: no output file\n");
+                    return -1;
+                }
+            } else { // normal non < or >
+                cmd->args[num_args] = arena_strdup(arena, arg_split_space);
+                num_args++;
+            }
+            arg_split_space = strtok(NULL, " "); // next one
+        }
+        if (num_args > LEGACY_MAX_ARGS) {
+            fprintf(stderr, "Error: too many process arguments\n");
+            return -1;
+        }
+        cmd->args[num_args] = NULL; // null terminate
+    }
+
+    return num_commands;
+}
+
+static const char *bench_lines[] = {
+    "ls -l",
+    "echo a b c d e f g h i j k l m n o",
+    "cat file.txt|grep -v foo|sort -u|wc -l",
+    "   grep   -i   pattern   some_file   ",
+    "sort < /dev/null > /dev/null",
+    "sleep 1&",
+};
+
+#define NUM_BENCH_LINES (sizeof(bench_lines) / sizeof(bench_lines[0]))
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = 200000;
+    LegacyCommand legacy_commands[LEGACY_MAX_COMMANDS];
+    Command *commands;
+    char buf[CMDLINE_MAX];
+    Arena arena;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt == 'n') {
+            iterations = atol(optarg);
+        } else {
+            fprintf(stderr, "usage: parse_bench [-n iterations]\n");
+            return 1;
+        }
+    }
+
+    arena_init(&arena, LINE_ARENA_SIZE);
+
+    double start = now_sec();
+    for (long i = 0; i < iterations; i++) {
+        // the old parser writes into the line so it gets a fresh copy each time
+        strcpy(buf, bench_lines[i % NUM_BENCH_LINES]);
+        arena_reset(&arena);
+        legacy_pad_spaces(buf);
+        if (legacy_parse_command(buf, legacy_commands, &arena) <= 0) {
+            return 1;
+        }
+    }
+    double old_rate = iterations / (now_sec() - start);
+
+    start = now_sec();
+    for (long i = 0; i < iterations; i++) {
+        arena_reset(&arena);
+        int num_commands = parse_command(bench_lines[i % NUM_BENCH_LINES], &commands, &arena);
+        if (num_commands <= 0) {
+            return 1;
+        }
+        close_command_fds(commands, num_commands);  // the legacy parser closes its files too
+    }
+    double new_rate = iterations / (now_sec() - start);
+
+    printf("lines,old_per_sec,new_per_sec,speedup\n");
+    printf("%ld,%.0f,%.0f,%.2f\n", iterations, old_rate, new_rate, new_rate / old_rate);
+    return 0;
+}
@@ -0,0 +1,88 @@
+#!/bin/bash
+
+# Fails when parse throughput, launch latency or startup time is more than PERF_TOLERANCE
+# percent worse than the baseline recorded on this machine. every metric is
+# the best of RUNS runs, so a noisy run doesn't fail the gate.
+# usage: perf_gate.sh [-r] [sshell_path]
+#   -r  record the baseline instead of checking against it
+
+BASELINE="${PERF_BASELINE:-bench/baseline.csv}"
+TOLERANCE="${PERF_TOLERANCE:-10}"
+RUNS="${PERF_RUNS:-3}"
+
+record=0
+if [ "${1}" == "-r" ]; then
+    record=1
+    shift
+fi
+SSHELL_EXEC="${1:-./sshell}"
+
+# metric name, then higher or lower for the better direction. true runs in the
+# shell, redirect launches three real processes. startup is exec to exit of sshell -c true
+METRICS=("parse_per_sec higher" "true_p50_us lower" "pipeline_2_p50_us lower" "redirect_p50_us lower"
+         "startup_p50_us lower")
+
+measure() {
+    local parse=$(./bench/parse_bench -n 200000 | awk -F, 'NR == 2 { print $3 }')
+    local latency=$(./bench/bench -s "${SSHELL_EXEC}" -n 300 -p 2)
+    local startup=$(./bench/startup_bench -s "${SSHELL_EXEC}" -n 300)
+    echo "parse_per_sec,${parse}"
+    echo "${latency}" | awk -F, '$1 == "true" { print "true_p50_us," $3 }'
+    echo "${latency}" | awk -F, '$1 == "pipeline_2" { print "pipeline_2_p50_us," $3 }'
+    echo "${latency}" | awk -F, '$1 == "redirect" { print "redirect_p50_us," $3 }'
+    echo "${startup}" | awk -F, '$1 == "c_true" { print "startup_p50_us," $3 }'
+}
+
+# best value of every metric over the runs
+results=$(mktemp)
+for ((run = 0; run < RUNS; run++)); do
+    measure
+done > "${results}"
+
+best() {
+    # 1: metric, 2: higher or lower
+    awk -F, -v m="${1}" -v dir="${2}" '
+        $1 == m && (best == "" || (dir == "higher" ? $2 > best : $2 < best)) { best = $2 }
+        END { print best }' "${results}"
+}
+
+if [ ${record} -eq 1 ] || [ ! -f "${BASELINE}" ]; then
+    for metric in "${METRICS[@]}"; do
+        set -- ${metric}
+        echo "${1},$(best "${1}" "${2}")"
+    done > "${BASELINE}"
+    echo "perf_gate: baseline recorded in ${BASELINE}"
+    cat "${BASELINE}"
+    rm -f "${results}"
+    exit 0
+fi
+
+failed=0
+echo "metric,baseline,now,change_pct,limit_pct"
+for metric in "${METRICS[@]}"; do
+    set -- ${metric}
+    base=$(awk -F, -v m="${1}" '$1 == m { print $2 }' "${BASELINE}")
+    now=$(best "${1}" "${2}")
+    # a baseline from before a metric existed gets it added instead of failing
+    if [ -z "${base}" ] && [ -n "${now}" ]; then
+        echo "${1},${now}" >> "${BASELINE}"
+        echo "perf_gate: ${1} added to ${BASELINE}"
+        continue
+    fi
+    if [ -z "${now}" ]; then
+        echo "perf_gate: no value for ${1}" >&2
+        failed=1
+        continue
+    fi
+    # change in the bad direction, in percent of the baseline
+    worse=$(awk -v b="${base}" -v n="${now}" -v dir="${2}" \
+        'BEGIN { printf "%.1f", (dir == "higher" ? b - n : n - b) * 100 / b }')
+    echo "${1},${base},${now},${worse},${TOLERANCE}"
+    if awk -v w="${worse}" -v t="${TOLERANCE}" 'BEGIN { exit !(w > t) }'; then
+        echo "perf_gate: ${1} regressed by ${worse}%" >&2
+        failed=1
+    fi
+done
+
+rm -f "${results}"
+exit ${failed}
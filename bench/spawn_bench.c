@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <time.h>
+
+/*
+ * launches/second of fork+exec versus vfork+exec, the two launch paths of
+ * sshell. -m touches that many MiB first so the cost of copying page tables
+ * in fork() shows up the way it does for a large shell process.
+ *
+ * usage: spawn_bench [-n launches] [-m MiB] [program]
+ */
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief launches prog n times and waits for each one
+ *
+ * @param use_vfork 1 for vfork, 0 for fork
+ * @param n number of launches
+ * @param prog program to exec
+ * @return double launches per second
+ */
+static double run(int use_vfork, int n, char *prog) {
+    char *argv[] = {prog, NULL};
+    double start = now_sec();
+
+    for (int i = 0; i < n; i++) {
+        pid_t pid = use_vfork ? vfork() : fork();
+        if (pid == 0) {
+            execv(prog, argv);
+            _exit(127);
+        } else if (pid < 0) {
+            perror("fork");
+            exit(1);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+            fprintf(stderr, "cannot exec %s\n", prog);
+            exit(1);
+        }
+    }
+
+    return n / (now_sec() - start);
+}
+
+int main(int argc, char *argv[]) {
+    int n = 2000;
+    size_t mib = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:m:")) != -1) {
+        if (opt == 'n') {
+            n = atoi(optarg);
+        } else if (opt == 'm') {
+            mib = strtoul(optarg, NULL, 10);
+        } else {
+            fprintf(stderr, "usage: spawn_bench [-n launches] [-m MiB] [program]\n");
+            return 1;
+        }
+    }
+    char *prog = optind < argc ? argv[optind] : "/bin/true";
+
+    // resident memory to make fork() copy page tables like a big shell would
+    char *ballast = NULL;
+    if (mib > 0) {
+        ballast = malloc(mib << 20);
+        if (!ballast) {
+            perror("malloc");
+            return 1;
+        }
+        memset(ballast, 1, mib << 20);
+    }
+
+    double fork_rate = run(0, n, prog);
+    double vfork_rate = run(1, n, prog);
+
+    printf("rss_mib,launches,fork_per_sec,vfork_per_sec,speedup\n");
+    printf("%zu,%d,%.0f,%.0f,%.2f\n", mib, n, fork_rate, vfork_rate, vfork_rate / fork_rate);
+
+    free(ballast);
+    return 0;
+}
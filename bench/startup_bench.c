@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+
+/*
+ * startup time of sshell, the way a cron-like runner pays for it: each run
+ * execs a fresh shell, lets it run one -c command and waits for it to exit.
+ * /bin/true is timed the same way as the floor of exec and wait alone, and
+ * the peak RSS of every shell is taken from wait4.
+ *
+ * usage: startup_bench [-s sshell] [-n runs] [-o file]
+ *   -s  shell to measure, ./sshell by default
+ *   -n  runs per workload
+ *   -o  write the results to a file instead of stdout
+ */
+
+// results of one workload
+typedef struct {
+    const char *name;
+    double p50_us;
+    double p99_us;
+    double per_sec;
+    long max_rss_kb;
+} Result;
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief execs argv n times with its stdio on /dev/null, one run at a time
+ *
+ * @param res filled with the latency from vfork until the run was reaped
+ * @param name workload name in the results
+ * @param argv program and arguments
+ * @param n number of runs
+ * @param devnull open /dev/null, the stdio of every run
+ */
+static void run(Result *res, const char *name, char *const argv[], int n, int devnull) {
+    double *lat = malloc(n * sizeof(double));
+    res->name = name;
+    res->max_rss_kb = 0;
+
+    double start = now_us();
+    for (int i = 0; i < n; i++) {
+        double t0 = now_us();
+        pid_t pid = vfork();
+        if (pid == 0) {
+            dup2(devnull, STDIN_FILENO);
+            dup2(devnull, STDOUT_FILENO);
+            dup2(devnull, STDERR_FILENO);
+            execv(argv[0], argv);
+            _exit(127);
+        } else if (pid < 0) {
+            perror("vfork");
+            exit(1);
+        }
+        int status;
+        struct rusage usage;
+        wait4(pid, &status, 0, &usage);
+        lat[i] = now_us() - t0;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "startup_bench: %s failed\n", argv[0]);
+            exit(1);
+        }
+        res->max_rss_kb = usage.ru_maxrss > res->max_rss_kb ? usage.ru_maxrss : res->max_rss_kb;
+    }
+    double elapsed = now_us() - start;
+
+    qsort(lat, n, sizeof(double), cmp_double);
+    res->p50_us = lat[n / 2];
+    res->p99_us = lat[(int)(n * 0.99) < n ? (int)(n * 0.99) : n - 1];
+    res->per_sec = n / (elapsed / 1e6);
+    free(lat);
+}
+
+int main(int argc, char *argv[]) {
+    char *shell = "./sshell";
+    const char *out_path = NULL;
+    int n = 1000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:n:o:")) != -1) {
+        switch (opt) {
+        case 's':
+            shell = optarg;
+            break;
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: startup_bench [-s sshell] [-n runs] [-o file]\n");
+            return 1;
+        }
+    }
+    if (n < 1) {
+        fprintf(stderr, "startup_bench: need at least 1 run\n");
+        return 1;
+    }
+
+    // the completion lines of sshell go nowhere
+    int devnull = open("/dev/null", O_RDWR | O_CLOEXEC);
+    if (devnull < 0) {
+        perror("open");
+        return 1;
+    }
+    setenv("SSHELL_HISTFILE", "", 1);
+
+    char *floor_argv[] = { "/bin/true", NULL };
+    char *true_argv[] = { shell, "-c", "true", NULL };
+    char *builtin_argv[] = { shell, "-c", "pwd", NULL };
+    char *pipeline_argv[] = { shell, "-c", "true | true", NULL };
+    char *stdin_argv[] = { shell, NULL };  // empty batch on stdin, startup and exit only
+
+    Result res[5];
+    int count = 0;
+    run(&res[count++], "exec_floor", floor_argv, n, devnull);
+    run(&res[count++], "c_true", true_argv, n, devnull);
+    run(&res[count++], "c_builtin", builtin_argv, n, devnull);
+    run(&res[count++], "c_pipeline_2", pipeline_argv, n, devnull);
+    run(&res[count++], "empty_stdin", stdin_argv, n, devnull);
+
+    close(devnull);
+
+    FILE *out = out_path ? fopen(out_path, "w") : stdout;
+    if (!out) {
+        perror("fopen");
+        return 1;
+    }
+    fprintf(out, "workload,runs,p50_us,p99_us,per_sec,max_rss_kb\n");
+    for (int i = 0; i < count; i++) {
+        fprintf(out, "%s,%d,%.1f,%.1f,%.0f,%ld\n", res[i].name, n,
+                res[i].p50_us, res[i].p99_us, res[i].per_sec, res[i].max_rss_kb);
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+    return 0;
+}
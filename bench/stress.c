@@ -0,0 +1,358 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/wait.h>
+#include <time.h>
+
+/*
+ * stress driver for the job queue. thousands of background jobs with
+ * overlapping lifetimes are sent to one sshell, a foreground command now and
+ * then, and the shell is checked once they are all done: every job reported
+ * once with the statuses it should have, no fd kept open and no zombie left.
+ * the launch to completion latency of the jobs is printed like bench does.
+ *
+ * usage: stress [-s sshell] [-n jobs] [-j limit] [-o file]
+ *   -s  shell to drive, ./sshell by default
+ *   -n  background jobs to launch
+ *   -j  SSHELL_JOBS of the shell, jobs over the limit wait in its queue
+ *   -o  write the results to a file instead of stdout
+ */
+
+#define FG_EVERY 64  // a foreground command after this many jobs
+
+// running shell under test
+typedef struct {
+    pid_t pid;
+    int in_fd;
+    int err_fd;  // non blocking, completion lines are drained between writes
+    char buf[65536];
+    size_t len;
+} Shell;
+
+// what a job runs before its tagged | true and the status of its first stage.
+// none of them writes, the stderr of a stage that got EPIPE would land among
+// the completion lines
+static const struct {
+    const char *head;
+    int status;
+} kinds[] = {
+    { "true", 0 },
+    { "false", 1 },
+    { "sleep 0.01", 0 },
+    { "sleep 0.05", 0 },
+    { "true | sleep 0.01", 0 },
+};
+
+#define NUM_KINDS (sizeof(kinds) / sizeof(kinds[0]))
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void shell_start(Shell *sh, const char *path, const char *limit) {
+    int in_pipe[2], err_pipe[2];
+    if (pipe(in_pipe) < 0 || pipe(err_pipe) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+
+    sh->pid = fork();
+    if (sh->pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (sh->pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(in_pipe[0], STDIN_FILENO);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(err_pipe[1], STDERR_FILENO);
+        close(in_pipe[0]);
+        close(in_pipe[1]);
+        close(err_pipe[0]);
+        close(err_pipe[1]);
+        close(devnull);
+        setenv("SSHELL_JOBS", limit, 1);
+        setenv("SSHELL_HISTFILE", "", 1);
+        execl(path, path, (char *)NULL);
+        _exit(127);
+    }
+
+    close(in_pipe[0]);
+    close(err_pipe[1]);
+    sh->in_fd = in_pipe[1];
+    sh->err_fd = err_pipe[0];
+    sh->len = 0;
+    fcntl(sh->err_fd, F_SETFL, O_NONBLOCK);
+}
+
+static void shell_send(Shell *sh, const char *line) {
+    size_t len = strlen(line);
+    if (write(sh->in_fd, line, len) != (ssize_t)len || write(sh->in_fd, "\n", 1) != 1) {
+        perror("write");
+        exit(1);
+    }
+}
+
+/**
+ * @brief hands every complete line read so far from stderr to a callback
+ *
+ * @param wait block until at least one more line arrived
+ * @return int 0, or -1 once the shell closed its stderr
+ */
+static int shell_drain(Shell *sh, int wait, void (*on_line)(const char *line, void *arg), void *arg) {
+    while (1) {
+        char *nl;
+        int got_line = 0;
+        while ((nl = memchr(sh->buf, '\n', sh->len)) != NULL) {
+            *nl = '\0';
+            on_line(sh->buf, arg);
+            size_t n = nl - sh->buf + 1;
+            memmove(sh->buf, nl + 1, sh->len - n);
+            sh->len -= n;
+            got_line = 1;
+        }
+        if (got_line && wait) {
+            return 0;
+        }
+
+        ssize_t got = read(sh->err_fd, sh->buf + sh->len, sizeof(sh->buf) - sh->len);
+        if (got == 0) {
+            return -1;
+        }
+        if (got < 0) {
+            if (!wait) {
+                return 0;
+            }
+            usleep(1000);
+            continue;
+        }
+        sh->len += got;
+    }
+}
+
+// completions seen so far
+typedef struct {
+    int num_jobs;
+    int *seen;  // completion lines of each job
+    int *bad_status;  // its statuses were wrong
+    int *kind;
+    double *sent;
+    double *lat;
+    int fg_done;  // completion of the last foreground command arrived
+    const char *fg_line;
+} Tally;
+
+static void on_completion(const char *line, void *arg) {
+    Tally *t = arg;
+    const char *tag = strstr(line, "| true ");
+    if (strncmp(line, "+ completed '", 13)) {
+        return;
+    }
+    if (!tag) {
+        size_t n = t->fg_line ? strlen(t->fg_line) : 0;
+        if (n && !strncmp(line + 13, t->fg_line, n) && line[13 + n] == '\'') {
+            t->fg_done = 1;
+        }
+        return;
+    }
+
+    int job = atoi(tag + 7);
+    if (job < 0 || job >= t->num_jobs) {
+        return;
+    }
+    // the statuses follow the quoted command, the head stages then the tagged true
+    const char *status = strstr(tag, "' [");
+    int expected = kinds[t->kind[job]].status;
+    int last = -1, head = -1;
+    for (const char *p = status ? status + 2 : ""; *p == '['; p = strchr(p, ']') + 1) {
+        head = head < 0 ? atoi(p + 1) : head;
+        last = atoi(p + 1);
+    }
+    if (t->seen[job]++ == 0) {
+        t->lat[job] = now_us() - t->sent[job];
+    }
+    if (head != expected || last != 0) {
+        t->bad_status[job] = 1;
+    }
+}
+
+static int count_fds(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/fd", (int)pid);
+    DIR *d = opendir(path);
+    if (!d) {
+        return -1;
+    }
+    int count = 0;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        count += ent->d_name[0] != '.';
+    }
+    closedir(d);
+    return count;
+}
+
+/**
+ * @brief counts the children of pid that are zombies, exited but never reaped
+ */
+static int count_zombies(pid_t pid) {
+    DIR *d = opendir("/proc");
+    if (!d) {
+        return -1;
+    }
+    int count = 0;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        char path[300], stat[512];
+        snprintf(path, sizeof(path), "/proc/%s/stat", ent->d_name);
+        FILE *f = fopen(path, "r");
+        if (!f) {
+            continue;
+        }
+        if (fgets(stat, sizeof(stat), f)) {
+            // the name in parentheses may hold spaces, the fields after it don't
+            char state;
+            int ppid;
+            char *end = strrchr(stat, ')');
+            if (end && sscanf(end + 1, " %c %d", &state, &ppid) == 2 && ppid == pid && state == 'Z') {
+                count++;
+            }
+        }
+        fclose(f);
+    }
+    closedir(d);
+    return count;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief sends a foreground command and waits for its completion, which comes
+ *        after the background completions the shell had pending
+ */
+static void run_foreground(Shell *sh, Tally *t, const char *line) {
+    t->fg_line = line;
+    t->fg_done = 0;
+    shell_send(sh, line);
+    while (!t->fg_done) {
+        if (shell_drain(sh, 1, on_completion, t) < 0) {
+            fprintf(stderr, "stress: shell exited early\n");
+            exit(1);
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *shell = "./sshell";
+    const char *limit = "32";
+    const char *out_path = NULL;
+    int n = 2000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:n:j:o:")) != -1) {
+        switch (opt) {
+        case 's':
+            shell = optarg;
+            break;
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 'j':
+            limit = optarg;
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: stress [-s sshell] [-n jobs] [-j limit] [-o file]\n");
+            return 1;
+        }
+    }
+    if (n < 1 || atoi(limit) < 1) {
+        fprintf(stderr, "stress: need at least 1 job and a job limit of 1\n");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    Tally t;
+    memset(&t, 0, sizeof(t));
+    t.num_jobs = n;
+    t.seen = calloc(n, sizeof(int));
+    t.bad_status = calloc(n, sizeof(int));
+    t.kind = calloc(n, sizeof(int));
+    t.sent = calloc(n, sizeof(double));
+    t.lat = calloc(n, sizeof(double));
+
+    Shell sh;
+    shell_start(&sh, shell, limit);
+    run_foreground(&sh, &t, "true");
+    int fds_before = count_fds(sh.pid);
+
+    char line[128];
+    double start = now_us();
+    for (int i = 0; i < n; i++) {
+        t.kind[i] = (i * 7 + i / NUM_KINDS) % NUM_KINDS;
+        snprintf(line, sizeof(line), "%s | true %d &", kinds[t.kind[i]].head, i);
+        t.sent[i] = now_us();
+        shell_send(&sh, line);
+        shell_drain(&sh, 0, on_completion, &t);
+        if (i % FG_EVERY == FG_EVERY - 1) {
+            run_foreground(&sh, &t, "jobs");
+        }
+    }
+    // wait returns once every job is done, their completions come before its own
+    run_foreground(&sh, &t, "wait");
+    double elapsed = now_us() - start;
+
+    int fds_after = count_fds(sh.pid);
+    int zombies = count_zombies(sh.pid);
+    shell_send(&sh, "exit");
+    close(sh.in_fd);
+    while (shell_drain(&sh, 1, on_completion, &t) == 0) {
+    }
+    close(sh.err_fd);
+    int status;
+    waitpid(sh.pid, &status, 0);
+
+    int lost = 0, doubled = 0, wrong = 0;
+    for (int i = 0; i < n; i++) {
+        lost += t.seen[i] == 0;
+        doubled += t.seen[i] > 1;
+        wrong += t.bad_status[i];
+    }
+    qsort(t.lat, n, sizeof(double), cmp_double);
+
+    FILE *out = out_path ? fopen(out_path, "w") : stdout;
+    if (!out) {
+        perror("fopen");
+        return 1;
+    }
+    fprintf(out, "jobs,limit,per_sec,p50_us,p99_us,lost,doubled,wrong_status,leaked_fds,zombies\n");
+    fprintf(out, "%d,%s,%.0f,%.1f,%.1f,%d,%d,%d,%d,%d\n", n, limit, n / (elapsed / 1e6),
+            t.lat[n / 2], t.lat[(int)(n * 0.99) < n ? (int)(n * 0.99) : n - 1],
+            lost, doubled, wrong, fds_after - fds_before, zombies);
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    int failed = lost || doubled || wrong || fds_after != fds_before || zombies
+                 || !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    if (failed) {
+        fprintf(stderr, "stress: the shell lost track of its jobs\n");
+    }
+    free(t.seen);
+    free(t.bad_status);
+    free(t.kind);
+    free(t.sent);
+    free(t.lat);
+    return failed;
+}
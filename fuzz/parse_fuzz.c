@@ -0,0 +1,371 @@
+#define SSHELL_NO_MAIN
+#include "../sshell.c"
+
+#include <stdint.h>
+
+/*
+ * fuzz target for the parser. every input is parsed as one command line,
+ * straight with parse_command and twice through the parse cache, and what
+ * comes out is checked: well formed stages, list operators and text spans
+ * inside the line, and a cache hit identical to a fresh parse.
+ *
+ * it links with libFuzzer (clang -fsanitize=fuzzer) or, built with
+ * -DFUZZ_STANDALONE, runs the inputs given on the command line followed by
+ * random mutations of them. with no inputs and no -r it runs one input read
+ * from stdin, which is how AFL drives it.
+ *
+ * usage: parse_fuzz [-r runs] [-s seed] [input...]
+ *   -r  mutated inputs to run after the seeds
+ *   -s  seed of the mutations
+ *
+ * the parser opens redirections, so the fuzzer works in a scratch directory
+ * of its own with an environment holding no path. inputs with a / are
+ * skipped, they could name any file on the machine.
+ */
+
+#define FUZZ_MAX_LINE 8192  // mutations stop growing a line here, well past CMDLINE_MAX
+#define FUZZ_RESET_INPUTS 256  // the files redirections created are removed this often
+
+static Arena arena;
+static int report_fd = STDERR_FILENO;  // failures go here, stderr itself may be silenced
+static char scratch[] = "/tmp/sshell_fuzz_XXXXXX";
+
+#define FUZZ_CHECK(line, cond)                                                       \
+    do {                                                                             \
+        if (!(cond)) {                                                               \
+            dprintf(report_fd, "parse_fuzz: %s failed for '%s'\n", #cond, (line));   \
+            abort();                                                                 \
+        }                                                                            \
+    } while (0)
+
+/**
+ * @brief empties the scratch directory, which is the current one
+ */
+static void fuzz_empty(void) {
+    DIR *d = opendir(".");
+    struct dirent *ent;
+    while (d && (ent = readdir(d)) != NULL) {
+        unlink(ent->d_name);
+    }
+    if (d) {
+        closedir(d);
+    }
+    unlink("dir/x.txt");
+    rmdir("dir");
+}
+
+/**
+ * @brief fills the scratch directory with a few files for globs to match
+ */
+static void fuzz_fixtures(void) {
+    const char *files[] = { "a.txt", "b.txt", ".hidden", "dir/x.txt" };
+    mkdir("dir", 0755);
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        int fd = open(files[i], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+static void fuzz_cleanup(void) {
+    if (chdir(scratch) == 0) {
+        fuzz_empty();
+    }
+    if (chdir("/") == 0) {
+        rmdir(scratch);
+    }
+}
+
+/**
+ * @brief moves into a scratch directory of fixtures and replaces the
+ *        environment with variables that expand to plain names
+ */
+static void fuzz_setup(void) {
+    if (!mkdtemp(scratch) || chdir(scratch) < 0) {
+        perror("scratch directory");
+        exit(1);
+    }
+    atexit(fuzz_cleanup);
+    fuzz_fixtures();
+
+    clearenv();
+    setenv("FILE", "a.txt", 1);
+    setenv("EMPTY", "", 1);
+    setenv("WORDS", "one two", 1);
+
+    arena_init(&arena, LINE_ARENA_SIZE);
+}
+
+/**
+ * @brief checks the stages parse_command made of a line
+ */
+static void check_commands(const char *line, const Command *commands, int num_commands) {
+    size_t len = strlen(line);
+    for (int i = 0; i < num_commands; i++) {
+        const Command *cmd = &commands[i];
+        FUZZ_CHECK(line, cmd->num_args > 0 && cmd->num_args < cmd->args_cap);
+        FUZZ_CHECK(line, cmd->args[cmd->num_args] == NULL);
+        for (int j = 0; j < cmd->num_args; j++) {
+            FUZZ_CHECK(line, cmd->args[j] != NULL);
+        }
+        FUZZ_CHECK(line, cmd->list_op >= LIST_NONE && cmd->list_op <= LIST_OR);
+        FUZZ_CHECK(line, i > 0 || cmd->list_op == LIST_SEQ);
+        if (cmd->list_op != LIST_NONE) {
+            FUZZ_CHECK(line, cmd->text_start >= 0 && cmd->text_len > 0);
+            FUZZ_CHECK(line, (size_t)cmd->text_start + cmd->text_len <= len);
+        }
+        FUZZ_CHECK(line, !cmd->background || i == num_commands - 1);
+        FUZZ_CHECK(line, cmd->input_fd < 0 || cmd->input_f);
+        FUZZ_CHECK(line, cmd->output_fd < 0 || cmd->output_f);
+    }
+}
+
+static int same_string(const char *a, const char *b) {
+    return (!a && !b) || (a && b && !strcmp(a, b));
+}
+
+/**
+ * @brief checks that a line given by the parse cache is the one parse_command made
+ */
+static void check_same(const char *line, const Command *a, const Command *b, int num_commands) {
+    for (int i = 0; i < num_commands; i++) {
+        FUZZ_CHECK(line, a[i].num_args == b[i].num_args);
+        for (int j = 0; j < a[i].num_args; j++) {
+            FUZZ_CHECK(line, !strcmp(a[i].args[j], b[i].args[j]));
+        }
+        FUZZ_CHECK(line, same_string(a[i].input_f, b[i].input_f));
+        FUZZ_CHECK(line, same_string(a[i].output_f, b[i].output_f));
+        FUZZ_CHECK(line, a[i].list_op == b[i].list_op && a[i].background == b[i].background);
+        FUZZ_CHECK(line, a[i].branch == b[i].branch && a[i].append == b[i].append);
+        FUZZ_CHECK(line, a[i].text_start == b[i].text_start && a[i].text_len == b[i].text_len);
+    }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    static long inputs = 0;
+    if (!inputs) {
+        fuzz_setup();
+    }
+    // every > creates a file, globs would get slower with each input otherwise
+    if (++inputs % FUZZ_RESET_INPUTS == 0) {
+        fuzz_empty();
+        fuzz_fixtures();
+    }
+
+    // the shell only ever parses one line, without its newline
+    char *line = malloc(size + 1);
+    size_t len = 0;
+    while (len < size && data[len] != '\0' && data[len] != '\n') {
+        line[len] = data[len];
+        len++;
+    }
+    line[len] = '\0';
+    if (memchr(line, '/', len)) {
+        free(line);
+        return 0;
+    }
+
+    Command *direct, *cached;
+    arena_reset(&arena);
+    int num_commands = parse_command(line, &direct, &arena);
+    int volatile_line = parse_expansion == EXPAND_VOLATILE;
+    check_commands(line, direct, num_commands);
+    if (num_commands > 0) {
+        close_command_fds(direct, num_commands);
+    }
+
+    // the first pass may store the line, the second one hits it. globs see the
+    // files the first parse created, so only lines the cache keeps are compared
+    for (int pass = 0; pass < 2; pass++) {
+        int got = parse_cached(line, &cached, &arena);
+        if (volatile_line) {
+            check_commands(line, cached, got);
+        } else {
+            FUZZ_CHECK(line, got == num_commands);
+            check_same(line, direct, cached, got);
+        }
+        if (got > 0) {
+            close_command_fds(cached, got);
+        }
+    }
+
+    free(line);
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+
+// sanitizer hook, present when built with -fsanitize
+extern void __sanitizer_set_report_fd(void *fd) __attribute__((weak));
+
+// seeds used when no input is given, one per feature of the parser
+static const char *default_seeds[] = {
+    "ls -l",
+    "cat < a.txt | grep -v foo | sort -u | wc -l > out.txt",
+    "echo a >> out.txt &",
+    "cat a.txt | { wc -l , tr a b | cat > b.txt }",
+    "echo $FILE ${FILE}x $EMPTY $? $$ $",
+    "ls *.txt ?.txt [ab].txt .h* d*",
+    "false && echo no || echo yes ; echo done ;",
+    "export X=$WORDS ; echo $X | cat",
+};
+
+// what mutations insert: operators, expansions and plain words
+static const char *tokens[] = {
+    " ", "\t", "|", "||", "&", "&&", ";", "<", ">", ">>", "{", ",", "}",
+    "$", "$?", "$$", "${", "}", "$FILE", "${EMPTY}", "*", "?", "[", "]", "[ab]",
+    "a.txt", "dir", "echo", "x",
+};
+
+#define NUM_TOKENS (sizeof(tokens) / sizeof(tokens[0]))
+
+/**
+ * @brief reads a whole file into a malloc'd string
+ */
+static char *read_file(FILE *f, size_t *len) {
+    size_t cap = 4096;
+    char *buf = malloc(cap);
+    if (!buf) {
+        perror("malloc");
+        exit(1);
+    }
+    *len = 0;
+    size_t got;
+    while ((got = fread(buf + *len, 1, cap - *len, f)) > 0) {
+        *len += got;
+        if (*len == cap) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+            if (!buf) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+    }
+    return buf;
+}
+
+/**
+ * @brief applies a few random edits to a line: a token inserted, a span
+ *        deleted or the tail repeated, which grows lines past any fixed buffer
+ */
+static size_t mutate(char *buf, size_t len) {
+    int edits = 1 + rand() % 4;
+    for (int e = 0; e < edits; e++) {
+        size_t at = len ? (size_t)rand() % (len + 1) : 0;
+        switch (rand() % 3) {
+        case 0: {
+            const char *tok = tokens[rand() % NUM_TOKENS];
+            size_t n = strlen(tok);
+            if (len + n < FUZZ_MAX_LINE) {
+                memmove(buf + at + n, buf + at, len - at);
+                memcpy(buf + at, tok, n);
+                len += n;
+            }
+            break;
+        }
+        case 1: {
+            size_t n = at < len ? 1 + (size_t)rand() % (len - at) : 0;
+            n = n > 8 ? 8 : n;
+            memmove(buf + at, buf + at + n, len - at - n);
+            len -= n;
+            break;
+        }
+        default: {
+            // the tail from at is repeated
+            size_t n = len - at;
+            if (len + n < FUZZ_MAX_LINE) {
+                memcpy(buf + len, buf + at, n);
+                len += n;
+            }
+            break;
+        }
+        }
+    }
+    return len;
+}
+
+int main(int argc, char *argv[]) {
+    long runs = 0;
+    unsigned int seed = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:s:")) != -1) {
+        if (opt == 'r') {
+            runs = atol(optarg);
+        } else if (opt == 's') {
+            seed = strtoul(optarg, NULL, 10);
+        } else {
+            fprintf(stderr, "usage: parse_fuzz [-r runs] [-s seed] [input...]\n");
+            return 1;
+        }
+    }
+
+    // one input from stdin, the way AFL runs a target
+    if (optind == argc && runs == 0) {
+        size_t len;
+        char *input = read_file(stdin, &len);
+        LLVMFuzzerTestOneInput((const uint8_t *)input, len);
+        free(input);
+        return 0;
+    }
+
+    // parse errors are expected by the thousand, failures and sanitizers report on a copy of stderr
+    report_fd = dup(STDERR_FILENO);
+    if (__sanitizer_set_report_fd) {
+        __sanitizer_set_report_fd((void *)(intptr_t)report_fd);
+    }
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDERR_FILENO);
+    close(devnull);
+
+    int num_seeds = argc - optind;
+    int num_defaults = sizeof(default_seeds) / sizeof(default_seeds[0]);
+    char **seeds = malloc((num_seeds ? num_seeds : num_defaults) * sizeof(char *));
+    size_t *seed_len = malloc((num_seeds ? num_seeds : num_defaults) * sizeof(size_t));
+    for (int i = 0; i < num_seeds; i++) {
+        FILE *f = fopen(argv[optind + i], "r");
+        if (!f) {
+            dprintf(report_fd, "parse_fuzz: cannot open %s\n", argv[optind + i]);
+            return 1;
+        }
+        seeds[i] = read_file(f, &seed_len[i]);
+        fclose(f);
+    }
+    if (!num_seeds) {
+        num_seeds = num_defaults;
+        for (int i = 0; i < num_seeds; i++) {
+            seeds[i] = strdup(default_seeds[i]);
+            seed_len[i] = strlen(default_seeds[i]);
+        }
+    }
+
+    for (int i = 0; i < num_seeds; i++) {
+        LLVMFuzzerTestOneInput((const uint8_t *)seeds[i], seed_len[i]);
+    }
+
+    // each run mutates a seed, or the previous input to reach further from the seeds
+    static char buf[FUZZ_MAX_LINE];
+    size_t len = 0;
+    srand(seed);
+    for (long r = 0; r < runs; r++) {
+        if (r % 8 == 0) {
+            int s = rand() % num_seeds;
+            len = seed_len[s] < FUZZ_MAX_LINE ? seed_len[s] : FUZZ_MAX_LINE - 1;
+            memcpy(buf, seeds[s], len);
+        }
+        len = mutate(buf, len);
+        LLVMFuzzerTestOneInput((const uint8_t *)buf, len);
+    }
+
+    dprintf(report_fd, "parse_fuzz: %d seeds and %ld mutations parsed without a failure\n", num_seeds, runs);
+    for (int i = 0; i < num_seeds; i++) {
+        free(seeds[i]);
+    }
+    free(seeds);
+    free(seed_len);
+    return 0;
+}
+
+#endif  // FUZZ_STANDALONE
@@ -1,577 +1,6433 @@
+#define _GNU_SOURCE  // splice, tee, vmsplice and F_SETPIPE_SZ for the relay
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/resource.h> // rusage of reaped stages
 #include <fcntl.h> // for open stuff
-#include <ctype.h> // isspace
 #include <signal.h> // for sigchld handling
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h> // stat for the command hash
+#include <sys/epoll.h> // event loop over the input and SIGCHLD
+#include <sys/signalfd.h>
+#include <stdarg.h> // printf builtin
+#include <sys/mman.h> // pages handed to pipes by the relay
+#include <sys/uio.h>
+#include <sys/socket.h> // telemetry sink
+#include <sys/un.h>
+#include <sched.h> // placement of pipeline stages
+#include <stdint.h> // fixed-size history records
+#include <stddef.h> // offsetof for telemetry ring slots
+#include <time.h>
+#include <dirent.h> // glob expansion
+#include <fnmatch.h>
 
-#define MAX_BG_JOBS 16
-#define MAX_COMMANDS 4
-#define MAX_ARGS_PER_CMD 16
-#define CMDLINE_MAX 512
+#define PID_MAP_INITIAL 32  // slots in the pid to job map, doubled at half load
+#define CMDLINE_MAX 512  // initial line buffer and job slab slot size, longer lines still work
+#define INITIAL_COMMANDS 4  // arena vectors start this big and double as needed
+#define INITIAL_ARGS 8
+#define HASH_BUCKETS 64
+#define ENV_BUCKETS 256
+#define GLOB_CACHE_DIRS 16  // directories whose names are kept for glob expansion
+#define PARSE_CACHE_BUCKETS 64
+#define PARSE_CACHE_SIZE 32  // parsed lines kept, the least recently used one goes first
+#define LINE_ARENA_SIZE 4096  // first block of the per-line arena, enough for any line
+#define SLAB_SLOTS_PER_CHUNK 16
+#define BATCH_READ_BUF 65536   // read size for scripts in batch mode
+#define INTERACTIVE_READ_BUF 4096  // read size otherwise
+#define STATUS_BUF_SIZE 65536  // completion lines are coalesced up to this size in batch mode
+#define RELAY_CHUNK 65536  // most bytes moved by one splice, tee or read of the relay
+#define RELAY_PIPE_SIZE (1 << 20)  // capacity asked for pipes the shell relays, fewer wakeups per byte
+#define PIPE_MIN_CAPACITY 4096
+#define OUTBUF_MMAP_MIN 65536  // native builtin output this big gets its own pages to vmsplice
+#define OUTPUT_STAGE_SIZE (1 << 20)  // writes of large output mode
+#define DIRECT_ALIGN 4096  // O_DIRECT offset and length alignment
+#define HIST_MAGIC 0x31485353u  // "SSH1", marks a valid history record
+#define TELEMETRY_MAGIC 0x4d4c4554u  // "TELM"
+#define TELEMETRY_STAGES 8  // stages detailed in a telemetry record
+#define TELEMETRY_COMMAND 592
+#define TELEMETRY_BACKGROUND 1
+#define TELEMETRY_BATCH 64  // records buffered before they are written
+#define TELEMETRY_BUFFER 128  // records held while the sink is full, newer ones are dropped
+#define TELEMETRY_RING_SLOTS 4096
+#define WORKERS_MAX 64  // most pre-forked workers SSHELL_WORKERS can ask for
+#define WORKER_MSG_MAX 65536  // largest request to a worker, longer stages are forked as usual
+#define SESSION_HELLO_MAX 4096  // first read of a session, commands if no fds came with it
 
-// flag set by sigchld handler to indicate background job completion
-static sig_atomic_t sigchld_flag = 0;
+// SIGCHLD stays blocked and is read from this signalfd, children get the original mask back
+static int sigchld_fd = -1;
+static sigset_t child_sigmask;
 
-// signal handler to catch child termination and report background job completion
-static void sigchld_handler(int signum) {
-    (void)signum;
-    sigchld_flag = 1;
-}
+// epoll instance waiting on the command input and sigchld_fd, -1 if the input can't be polled
+static int event_fd = -1;
+
+// one block of a bump allocator, blocks are chained when a block runs out
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+// bump allocator owning everything parsed out of one command line
+typedef struct {
+    ArenaBlock *head;
+    ArenaBlock *cur;
+} Arena;
+
+// fixed-size slot pool for strings that outlive a command line
+typedef struct SlabSlot {
+    struct SlabSlot *next_free;
+} SlabSlot;
+
+typedef struct {
+    SlabSlot *free_list;
+    size_t slot_size;
+} Slab;
+
+// list operator a pipeline follows: ; runs it anyway, && if the previous one
+// succeeded and || if it failed. LIST_NONE marks the stages after the first
+enum { LIST_NONE, LIST_SEQ, LIST_AND, LIST_OR };
 
 typedef struct {
-    char *args[MAX_ARGS_PER_CMD];
+    char **args;  // NULL terminated, grown in the line arena
+    int num_args;
+    int args_cap;
     char *input_f;
     char *output_f;
+    int input_fd;  // opened by the parser with O_CLOEXEC and handed to the child, -1 if none
+    int output_fd;
+    const char *exec_path;  // resolved through the command hash before launch
+    cpu_set_t *cpus;  // affinity of the stage, NULL leaves it to the scheduler
+    int branch;  // fan-out branch the stage belongs to, 0 for the trunk
+    int append;  // output file opened with >> instead of >
+    pid_t pgid;  // process group the stage joins, 0 makes it the leader of a new one
+    int take_tty;  // a group leader puts its group in the foreground of the terminal
+    int list_op;  // how a pipeline follows the previous one, on its first stage only
+    int text_start;  // offset and length of the pipeline in its line, on its first stage only
+    int text_len;
     int background;  // flag to indicate if command should run in background
 } Command;
 
-// background job structure
+// resource use of one pipeline stage as reported by wait4, kept with SSHELL_RUSAGE
 typedef struct {
-    pid_t pids[MAX_COMMANDS];
+    struct rusage ru;
+    unsigned long long wall_ns;  // from the launch of the job to the reap of the stage
+} StageUsage;
+
+// life cycle of a background job
+typedef enum {
+    JOB_QUEUED,  // waiting for a slot under the concurrency limit
+    JOB_RUNNING,
+    JOB_STOPPED,  // every process left is stopped, the job doesn't count against the limit
+    JOB_DONE  // finished, not reported yet
+} JobState;
+
+// background job structure
+typedef struct BackgroundJob {
+    pid_t *pids;
+    int *exit_status;
     int pid_count;           
+    int remaining;  // processes not reaped yet
+    int foreground;  // waited for by the prompt loop, never queued or reported here
     char* command;
-    int active;              
+    unsigned long seq;  // launch order, completions are reported in this order
+    struct BackgroundJob *prev;  // fifo list of jobs in the queue
+    struct BackgroundJob *next;
+    struct BackgroundJob *done_next;  // finished jobs waiting to be reported
+    JobState state;
+    Command *commands;  // private copy of the pipeline while the job is queued
+    struct BackgroundJob *wait_next;  // queued jobs, oldest first
+    StageUsage *usage;  // per stage, NULL unless SSHELL_RUSAGE is set
+    unsigned long long start_ns;  // launch time
+    pid_t pgid;  // process group of the pipeline, 0 until a stage is launched
+    int stopped;  // processes stopped by a signal and not continued yet
 } BackgroundJob;
 
-// queue for background jobs
-typedef struct {
-    BackgroundJob jobs[MAX_BG_JOBS];
-    int num_jobs;
-} BgJobQueue;
+// slot of the pid to job map
+typedef struct {
+    pid_t pid;  // 0 for an empty slot
+    int stage;  // -1 for a helper process of the job, see start_helpers
+    int stopped;  // stopped by a signal and not continued yet
+    BackgroundJob *job;
+} PidSlot;
+
+// open addressing map from the pid of a running process to its job
+typedef struct {
+    PidSlot *slots;
+    size_t cap;
+    size_t count;
+} PidMap;
+
+// buffered reader handing out one command line at a time
+typedef struct {
+    int fd;
+    char *buf;
+    size_t cap;
+    size_t len;  // bytes in buf
+    size_t pos;  // start of the next line
+    size_t read_size;
+    int eof;
+} LineReader;
+
+// queue for background jobs
+typedef struct {
+    BackgroundJob *head;  // oldest job
+    BackgroundJob *tail;
+    BackgroundJob *done;  // finished jobs sorted by seq, not reported yet
+    int num_jobs;
+    unsigned long next_seq;
+    PidMap pid_map;
+    BackgroundJob *waiting;  // queued jobs in submission order
+    BackgroundJob *waiting_tail;
+    int running;  // launched jobs that aren't done
+    int limit;  // most background jobs running at once
+} BgJobQueue;
+
+// the shell's background jobs, global so the builtins (jobs, fg, bg, wait, exit)
+// can reach them alongside the main loop that reaps them through the signalfd
+static BgJobQueue bg_queue;
+
+// storage for the tokens of the current command line, reset after each line
+static Arena line_arena;
+
+// command strings of background jobs, which outlive their line
+static Slab job_slab = { NULL, CMDLINE_MAX };
+
+// set when running a script non-interactively: no prompt, no echo, buffered status lines
+static int batch_mode = 0;
+static char status_buf[STATUS_BUF_SIZE];
+
+// status of the last line, for $?
+static int last_status = 0;
+
+// one variable of the environment, name=value in a single allocation
+typedef struct EnvVar {
+    char *entry;
+    size_t name_len;
+    size_t index;  // slot of entry in envp
+    struct EnvVar *next;
+} EnvVar;
+
+// the environment of the shell, imported from environ on first use. envp
+// points at the entries and is environ from then on: export and unset fix up
+// one slot each, so a launch never rebuilds anything and every exec, worker
+// and execvp sees the current variables
+typedef struct {
+    EnvVar *buckets[ENV_BUCKETS];
+    char **envp;  // NULL terminated
+    EnvVar **vars;  // variable of each envp slot
+    size_t count;
+    size_t cap;
+    unsigned long gen;  // bumped by every change, parsed lines remember it
+} ShellEnv;
+static ShellEnv shell_env = { .gen = 1 };
+extern char **environ;
+
+// what the expansions of the line being parsed depend on, see parse_cached
+enum { EXPAND_NONE, EXPAND_ENV, EXPAND_VOLATILE };
+static int parse_expansion = EXPAND_NONE;
+
+// how pipeline stages are started, SSHELL_LAUNCH=fork selects the fork path
+enum { LAUNCH_VFORK, LAUNCH_FORK };
+static int launch_mode = LAUNCH_VFORK;
+
+// pre-forked processes stages are handed to instead of forking them, kept
+// with SSHELL_WORKERS=N. each one waits on its end of a control socket
+typedef struct {
+    pid_t pids[WORKERS_MAX];
+    int fds[WORKERS_MAX];  // shell end of the control socket of each idle worker
+    int count;  // idle workers, the last one is handed out first
+    int size;  // idle workers kept, 0 without a pool
+} WorkerPool;
+static WorkerPool worker_pool;
+
+// what a worker is told to run. the exec path and the arguments follow as NUL
+// terminated strings, the fds of the stage travel as SCM_RIGHTS
+typedef struct {
+    pid_t pgid;
+    int take_tty;
+    int num_args;
+    int has_stdin;  // an fd for stdin is attached, first if there are two
+    int has_stdout;
+    int has_cpus;
+    cpu_set_t cpus;
+} WorkerRequest;
+
+// every line runs in a process group of its own. an interactive shell hands
+// the terminal to the foreground group and takes it back once that is done
+static int job_tty = 0;
+static pid_t shell_pgid = 0;
+
+// capacity of the pipes between stages, 0 keeps the kernel default. set by
+// SSHELL_PIPE_SIZE or the pipesize builtin, packet mode opens them with O_DIRECT
+static int pipe_size = 0;
+static int pipe_packet = 0;
+static int pipe_max = 0;  // fs.pipe-max-size, read on first use
+
+// placement of pipeline stages, set by SSHELL_AFFINITY or the affinity builtin
+enum { AFFINITY_OFF, AFFINITY_NODE, AFFINITY_L3 };
+static const char *affinity_names[] = { "off", "node", "l3" };
+static int affinity_policy = AFFINITY_OFF;
+static unsigned int affinity_next = 0;  // round robin position of background jobs
+
+// cpus of the NUMA nodes and L3 domains, read from sysfs on first use
+typedef struct {
+    cpu_set_t *nodes;
+    int num_nodes;
+    cpu_set_t *l3;
+    int num_l3;
+    int loaded;
+} Topology;
+
+static Topology topology;
+
+// large output mode, set by SSHELL_OUTPUT_HINT and SSHELL_OUTPUT_DIRECT: output
+// files are preallocated by output_hint bytes and written by a helper process
+// that keeps them out of the page cache, or writes them with O_DIRECT
+static long output_hint = 0;
+static int output_direct = 0;
+
+// SSHELL_CAPTURE names a file that also gets the output and completion line of
+// every foreground pipeline, relayed by the shell
+static int capture_fd = -1;
+
+// connection of a daemon session whose client passed its stdio, the exit
+// status of the session goes back over it
+static int session_conn = -1;
+static pid_t session_pid = 0;
+
+// one entry of the history index. records are fixed-size and each is appended
+// with a single O_APPEND write, so concurrent shells never tear one apart
+typedef struct {
+    uint64_t offset;  // of the line in the data file
+    uint32_t length;  // without the newline
+    int32_t status;  // exit status of the last stage, as in the completion line
+    int64_t time;  // completion time, seconds since the epoch
+    uint32_t pid;  // shell that appended it
+    uint32_t magic;
+} HistRecord;
+
+// persistent history: command lines in an append-only data file plus an index
+// of HistRecords next to it. nothing is opened until the first entry is written
+// or read, and nothing is ever parsed on load
+typedef struct {
+    char *path;  // data file, the index is path.idx, NULL when history is off
+    int data_fd;
+    int index_fd;
+} History;
+
+static History history = { NULL, -1, -1 };
+
+// SSHELL_RUSAGE prints the resource use of every stage after its completion
+// line, to stderr or as JSON lines appended to a log file
+static FILE *usage_log = NULL;
+static int usage_json = 0;
+static int track_usage = 0;  // stage usage is recorded, for SSHELL_RUSAGE or telemetry
+
+// one completion in the telemetry stream. the layout is fixed so a collector
+// can read records straight into this struct, whatever the pipeline was
+typedef struct {
+    int32_t pid;  // 0 for a native builtin or a stage that never started
+    int32_t status;
+    int64_t wall_ns;
+    int64_t user_us;
+    int64_t sys_us;
+    int64_t maxrss_kb;
+    uint32_t nvcsw;
+    uint32_t nivcsw;
+} TelemetryStage;
+
+typedef struct {
+    uint32_t magic;
+    uint16_t size;  // sizeof(TelemetryRecord), changes with the layout
+    uint16_t num_stages;  // of the pipeline, only the first TELEMETRY_STAGES are detailed
+    uint64_t seq;  // per shell, or per ring file. 0 in a ring slot being written
+    int64_t start_ns;  // CLOCK_REALTIME of the launch
+    int64_t end_ns;  // and of the completion
+    uint32_t shell_pid;
+    uint16_t flags;  // TELEMETRY_BACKGROUND
+    uint16_t reserved;
+    uint32_t dropped;  // records this shell dropped so far, its sink was full
+    uint32_t reserved2;
+    TelemetryStage stages[TELEMETRY_STAGES];
+    char command[TELEMETRY_COMMAND];  // truncated, NUL padded
+} TelemetryRecord;
+
+_Static_assert(sizeof(TelemetryRecord) == 1024, "telemetry records are 1 KiB");
+
+// first record-sized block of a ring file, slot i follows at (i + 1) * record_size.
+// each slot is a seqlock: a writer zeroes seq, writes the rest and sets seq last,
+// so a reader that sees the same nonzero seq before and after its copy got it whole
+typedef struct {
+    uint32_t magic;
+    uint32_t record_size;
+    uint64_t slots;
+    uint64_t next;  // sequence number the next writer claims, shared by all shells
+} TelemetryRingHeader;
+
+// SSHELL_TELEMETRY sink: fd:N, unix:path or ring:path. stream records are batched
+// and written without blocking, a ring is written in place through shared memory
+enum { TELEMETRY_OFF, TELEMETRY_FD, TELEMETRY_SOCKET, TELEMETRY_RING };
+
+typedef struct {
+    int kind;
+    int fd;
+    int shared;  // fd came from fd:N as it is, so it is never closed here
+    char *buf;  // pending records, bytes [head, len) are not written yet
+    size_t head;
+    size_t len;
+    TelemetryRingHeader *ring;
+    uint64_t seq;
+    uint32_t dropped;
+} Telemetry;
+
+static Telemetry telemetry = { TELEMETRY_OFF, -1, 0, NULL, 0, 0, NULL, 0, 0 };
+
+// errno of a failed exec, written by a vfork child which shares our memory
+static volatile int vfork_exec_errno = 0;
+
+// command hash entry mapping a command name to its absolute path
+typedef struct HashEntry {
+    char *name;
+    char *path;
+    unsigned long hits;
+    struct HashEntry *next;
+} HashEntry;
+
+// command hash table, filled on first lookup and flushed when PATH changes
+static HashEntry *cmd_hash[HASH_BUCKETS];
+static char *cmd_hash_path = NULL;  // PATH value the table was filled with
+
+// names of one directory kept for glob expansion, so globbing the same
+// directory line after line reads it once. dev and ino identify it whatever
+// the path or cwd, the names are valid while its mtime stays the same
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    int racy;  // listed in the same tick it was last changed, the next glob lists it again
+    char *names;  // NUL separated, NULL for an unused slot
+    char **sorted;  // pointers into names
+    size_t count;
+    unsigned long used;  // glob_tick of the last use, the oldest slot is reused
+} GlobDir;
+
+static GlobDir glob_cache[GLOB_CACHE_DIRS];
+static unsigned long glob_tick = 0;
+
+// parsed command line kept by the parse cache, never modified once stored
+typedef struct ParseEntry {
+    char *line;
+    unsigned int hash;
+    Command *commands;  // one copy_commands block, without open fds
+    int num_commands;
+    unsigned long env_gen;  // shell_env.gen its variables were expanded with, 0 if it has none
+    struct ParseEntry *hash_next;
+    struct ParseEntry *lru_prev;  // more recently used
+    struct ParseEntry *lru_next;  // less recently used
+} ParseEntry;
+
+// LRU cache of parsed command lines keyed by the raw line, so a line run over
+// and over is only lexed once
+typedef struct {
+    ParseEntry *buckets[PARSE_CACHE_BUCKETS];
+    ParseEntry *lru_head;
+    ParseEntry *lru_tail;
+    int count;
+} ParseCache;
+
+static ParseCache parse_cache;
+
+static inline unsigned long long monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// per-phase timing and syscall counters, -DSSHELL_NO_STATS compiles them out entirely
+#ifndef SSHELL_NO_STATS
+
+// phases of one command line, open is the validation opens inside parse
+typedef enum {
+    PHASE_READ,
+    PHASE_PARSE,
+    PHASE_OPEN,
+    PHASE_LOOKUP,
+    PHASE_PIPE,
+    PHASE_SPAWN,
+    PHASE_NATIVE,
+    PHASE_WAIT,
+    PHASE_REPORT,
+    NUM_PHASES
+} StatPhase;
+
+// syscalls made by the shell itself, not by its children
+typedef enum {
+    SYS_FORK,
+    SYS_PIPE,
+    SYS_OPEN,
+    SYS_WAITPID,
+    NUM_SYSCALLS
+} StatSyscall;
+
+static const char *phase_names[NUM_PHASES] = {
+    "read", "parse", "open", "lookup", "pipe", "spawn", "native", "wait", "report"
+};
+static const char *syscall_names[NUM_SYSCALLS] = { "fork", "pipe", "open", "waitpid" };
+
+typedef struct {
+    unsigned long long phase_ns[NUM_PHASES];
+    unsigned long phase_calls[NUM_PHASES];
+    unsigned long syscalls[NUM_SYSCALLS];
+    int pipe_capacity;  // capacity of the last resized pipe between stages, 0 for the kernel default
+    unsigned long cache_hits;  // command lines found in the parse cache
+    unsigned long cache_misses;
+} Stats;
+
+static Stats stats;
+
+/**
+ * @brief prints the counters as tab separated tables
+ * 
+ * @param out stream to print to
+ */
+static void stats_print(FILE *out) {
+    fprintf(out, "phase\tcalls\ttotal_us\tavg_us\n");
+    for (int i = 0; i < NUM_PHASES; i++) {
+        unsigned long calls = stats.phase_calls[i];
+        double total_us = stats.phase_ns[i] / 1e3;
+        fprintf(out, "%s\t%lu\t%.0f\t%.2f\n", phase_names[i], calls, total_us,
+                calls ? total_us / calls : 0.0);
+    }
+    fprintf(out, "syscall\tcalls\n");
+    for (int i = 0; i < NUM_SYSCALLS; i++) {
+        fprintf(out, "%s\t%lu\n", syscall_names[i], stats.syscalls[i]);
+    }
+    if (stats.pipe_capacity) {
+        fprintf(out, "pipe_size\t%d\n", stats.pipe_capacity);
+    } else {
+        fprintf(out, "pipe_size\tdefault\n");
+    }
+    fprintf(out, "cache\thits\tmisses\n");
+    fprintf(out, "parse\t%lu\t%lu\n", stats.cache_hits, stats.cache_misses);
+}
+
+// atexit hook installed when SSHELL_STATS is set
+static void stats_dump(void) {
+    stats_print(stderr);
+}
+
+#define STAT_START(t) unsigned long long t = monotonic_ns()
+#define STAT_STOP(phase, t) \
+    (stats.phase_ns[phase] += monotonic_ns() - (t), stats.phase_calls[phase]++)
+#define STAT_SYSCALL(sys) (stats.syscalls[sys]++)
+#define STAT_PIPE_CAPACITY(size) (stats.pipe_capacity = (size))
+#define STAT_PARSE_CACHE(hit) ((hit) ? stats.cache_hits++ : stats.cache_misses++)
+#else
+#define STAT_START(t)
+#define STAT_STOP(phase, t) ((void)0)
+#define STAT_SYSCALL(sys) ((void)0)
+#define STAT_PIPE_CAPACITY(size) ((void)(size))
+#define STAT_PARSE_CACHE(hit) ((void)0)
+#endif
+
+/**
+ * @brief allocates a new arena block of at least size bytes
+ */
+static ArenaBlock *arena_new_block(size_t size) {
+    ArenaBlock *block = malloc(sizeof(ArenaBlock) + size);
+    if (!block) {
+        perror("malloc");
+        exit(1);
+    }
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+/**
+ * @brief initialize an arena with one block
+ * 
+ * @param arena the arena to initialize
+ * @param size size of the first block
+ */
+void arena_init(Arena *arena, size_t size) {
+    arena->head = arena_new_block(size);
+    arena->cur = arena->head;
+}
+
+/**
+ * @brief bump allocates n bytes, pointer aligned. blocks stay around across
+ *        resets so a steady workload stops calling malloc after warming up
+ * 
+ * @param arena the arena to allocate from
+ * @param n number of bytes
+ * @return void* the allocation, never NULL
+ */
+void *arena_alloc(Arena *arena, size_t n) {
+    n = (n + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    while (arena->cur->used + n > arena->cur->size) {
+        if (!arena->cur->next) {
+            size_t size = arena->cur->size * 2;
+            arena->cur->next = arena_new_block(size > n ? size : n);
+        }
+        arena->cur = arena->cur->next;
+        arena->cur->used = 0;
+    }
+
+    void *ptr = arena->cur->data + arena->cur->used;
+    arena->cur->used += n;
+    return ptr;
+}
+
+/**
+ * @brief copies the first n chars of str into the arena
+ */
+char *arena_strndup(Arena *arena, const char *str, size_t n) {
+    char *copy = arena_alloc(arena, n + 1);
+    memcpy(copy, str, n);
+    copy[n] = '\0';
+    return copy;
+}
+
+/**
+ * @brief copies str into the arena
+ */
+char *arena_strdup(Arena *arena, const char *str) {
+    return arena_strndup(arena, str, strlen(str));
+}
+
+/**
+ * @brief releases everything allocated from the arena in O(1), later blocks
+ *        are reset lazily when the allocator reaches them again
+ * 
+ * @param arena the arena to reset
+ */
+void arena_reset(Arena *arena) {
+    arena->cur = arena->head;
+    arena->head->used = 0;
+}
+
+/**
+ * @brief copies str into a slab slot, the slab grows by a chunk of slots when empty.
+ *        strings that don't fit a slot are malloc'd instead
+ * 
+ * @param slab the slab to allocate from
+ * @param str string to copy
+ * @return char* the copy
+ */
+char *slab_strdup(Slab *slab, const char *str) {
+    if (strlen(str) >= slab->slot_size) {
+        char *copy = strdup(str);
+        if (!copy) {
+            perror("strdup");
+            exit(1);
+        }
+        return copy;
+    }
+
+    if (!slab->free_list) {
+        char *chunk = malloc(slab->slot_size * SLAB_SLOTS_PER_CHUNK);
+        if (!chunk) {
+            perror("malloc");
+            exit(1);
+        }
+        for (int i = 0; i < SLAB_SLOTS_PER_CHUNK; i++) {
+            SlabSlot *slot = (SlabSlot *)(chunk + i * slab->slot_size);
+            slot->next_free = slab->free_list;
+            slab->free_list = slot;
+        }
+    }
+
+    SlabSlot *slot = slab->free_list;
+    slab->free_list = slot->next_free;
+
+    char *copy = (char *)slot;
+    strcpy(copy, str);
+    return copy;
+}
+
+/**
+ * @brief returns a string from slab_strdup to its slab
+ */
+void slab_free(Slab *slab, char *str) {
+    if (strlen(str) >= slab->slot_size) {
+        free(str);
+        return;
+    }
+    SlabSlot *slot = (SlabSlot *)str;
+    slot->next_free = slab->free_list;
+    slab->free_list = slot;
+}
+
+/**
+ * @brief opens the history files on first use, history is turned off if they can't be
+ *
+ * @return int 0 if the files are open, -1 if history is off
+ */
+static int history_open(void) {
+    if (history.data_fd >= 0) {
+        return 0;
+    }
+    if (!history.path) {
+        return -1;
+    }
+
+    size_t len = strlen(history.path);
+    char *index_path = malloc(len + sizeof(".idx"));
+    if (!index_path) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(index_path, history.path, len);
+    memcpy(index_path + len, ".idx", sizeof(".idx"));
+
+    // O_APPEND makes every write land at the current end, whoever else appends
+    history.data_fd = open(history.path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    history.index_fd = open(index_path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    free(index_path);
+    if (history.data_fd < 0 || history.index_fd < 0) {
+        fprintf(stderr, "Error: cannot open history file\n");
+        if (history.data_fd >= 0) {
+            close(history.data_fd);
+        }
+        if (history.index_fd >= 0) {
+            close(history.index_fd);
+        }
+        history.data_fd = history.index_fd = -1;
+        free(history.path);
+        history.path = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief appends a completed command line to the history
+ *
+ * @param line the command line
+ * @param status exit status of its last stage
+ */
+void history_add(const char *line, int status) {
+    if (history_open() < 0) {
+        return;
+    }
+
+    // the line and its newline go in one append, lines of concurrent shells never interleave
+    size_t len = strlen(line);
+    struct iovec iov[2] = { { (void *)line, len }, { "\n", 1 } };
+    if (writev(history.data_fd, iov, 2) != (ssize_t)(len + 1)) {
+        return;
+    }
+    // our file offset now ends our own line, whatever other shells appended since
+    off_t end = lseek(history.data_fd, 0, SEEK_CUR);
+
+    // the record goes after its line, so a reader never finds a record without one
+    HistRecord rec = { end - len - 1, len, status, time(NULL), getpid(), HIST_MAGIC };
+    if (write(history.index_fd, &rec, sizeof(rec)) != sizeof(rec)) {
+        return;
+    }
+}
+
+/**
+ * @brief home slot of a pid in the map, cap is a power of two
+ */
+static size_t pid_map_slot(const PidMap *map, pid_t pid) {
+    return ((size_t)pid * 2654435761u) & (map->cap - 1);
+}
+
+/**
+ * @brief finds the slot of a pid
+ * 
+ * @param map the map to search
+ * @param pid process id
+ * @return PidSlot* its slot, NULL if the pid isn't in the map
+ */
+static PidSlot *pid_map_find(PidMap *map, pid_t pid) {
+    if (!map->count) {
+        return NULL;  // also covers the table before its first insert
+    }
+    size_t i = pid_map_slot(map, pid);
+    while (map->slots[i].pid != pid) {
+        if (!map->slots[i].pid) {
+            return NULL;
+        }
+        i = (i + 1) & (map->cap - 1);
+    }
+    return &map->slots[i];
+}
+
+/**
+ * @brief inserts a pid into the map, doubling the table at half load. the
+ *        first insert allocates it, a shell that never forks has no table
+ * 
+ * @param map the map to insert into
+ * @param pid process id, must not be in the map yet
+ * @param job job the process belongs to
+ * @param stage index of the process in its job
+ */
+void pid_map_insert(PidMap *map, pid_t pid, BackgroundJob *job, int stage) {
+    if ((map->count + 1) * 2 > map->cap) {
+        size_t cap = map->cap ? map->cap * 2 : PID_MAP_INITIAL;
+        PidMap grown = { calloc(cap, sizeof(PidSlot)), cap, 0 };
+        if (!grown.slots) {
+            perror("calloc");
+            exit(1);
+        }
+        for (size_t i = 0; i < map->cap; i++) {
+            if (map->slots[i].pid) {
+                pid_map_insert(&grown, map->slots[i].pid, map->slots[i].job, map->slots[i].stage);
+                pid_map_find(&grown, map->slots[i].pid)->stopped = map->slots[i].stopped;
+            }
+        }
+        free(map->slots);
+        *map = grown;
+    }
+
+    size_t i = pid_map_slot(map, pid);
+    while (map->slots[i].pid) {
+        i = (i + 1) & (map->cap - 1);
+    }
+    map->slots[i].pid = pid;
+    map->slots[i].job = job;
+    map->slots[i].stage = stage;
+    map->slots[i].stopped = 0;
+    map->count++;
+}
+
+/**
+ * @brief removes a pid from the map and returns its slot content
+ * 
+ * @param map the map to remove from
+ * @param pid process id
+ * @param out set to the removed slot
+ * @return int 1 if the pid was found, 0 otherwise
+ */
+int pid_map_remove(PidMap *map, pid_t pid, PidSlot *out) {
+    if (!map->count) {
+        return 0;
+    }
+    size_t i = pid_map_slot(map, pid);
+    while (map->slots[i].pid != pid) {
+        if (!map->slots[i].pid) {
+            return 0;
+        }
+        i = (i + 1) & (map->cap - 1);
+    }
+    *out = map->slots[i];
+    map->count--;
+
+    // backward shift deletion keeps every probe chain unbroken without tombstones
+    size_t hole = i;
+    while (1) {
+        i = (i + 1) & (map->cap - 1);
+        if (!map->slots[i].pid) {
+            break;
+        }
+        size_t home = pid_map_slot(map, map->slots[i].pid);
+        // move the entry back if the hole lies between its home slot and its slot
+        if (((i - home) & (map->cap - 1)) >= ((i - hole) & (map->cap - 1))) {
+            map->slots[hole] = map->slots[i];
+            hole = i;
+        }
+    }
+    map->slots[hole].pid = 0;
+    return 1;
+}
+
+/**
+ * @brief initialize the background job queue. the pid map and the job limit
+ *        are only set up by the first launch, see job_limit
+ * 
+ * @param queue the queue to initialize
+ */
+void init_bg_queue(BgJobQueue *queue) {
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->done = NULL;
+    queue->num_jobs = 0;
+    queue->next_seq = 0;
+    queue->waiting = NULL;
+    queue->waiting_tail = NULL;
+    queue->running = 0;
+    queue->limit = 0;
+    queue->pid_map.cap = 0;
+    queue->pid_map.count = 0;
+    queue->pid_map.slots = NULL;
+}
+
+/**
+ * @brief number of background jobs run at once, one per core unless SSHELL_JOBS
+ *        or jobs -l set it. the cores are only counted once a job needs it
+ */
+static int job_limit(BgJobQueue *queue) {
+    if (!queue->limit) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        queue->limit = cores > 0 ? (int)cores : 1;
+    }
+    return queue->limit;
+}
+
+// launching lives with the pipeline code further down
+static void start_queued_jobs(BgJobQueue *queue);
+static void start_job_now(BgJobQueue *queue, BackgroundJob *job);
+static void drop_queued_job(BgJobQueue *queue, BackgroundJob *job, int sig);
+
+/**
+ * @brief queues a finished job for reporting, keeping the done list in launch
+ *        order, and hands its slot to the oldest queued job
+ */
+static void mark_job_done(BgJobQueue *queue, BackgroundJob *job) {
+    if (job->foreground) {
+        return;
+    }
+    if (job->state == JOB_RUNNING) {
+        queue->running--;  // queued and stopped jobs hold no slot
+    }
+    job->state = JOB_DONE;
+
+    BackgroundJob **link = &queue->done;
+    while (*link && (*link)->seq < job->seq) {
+        link = &(*link)->done_next;
+    }
+    job->done_next = *link;
+    *link = job;
+
+    start_queued_jobs(queue);
+}
+
+/**
+ * @brief moves a background job between running and stopped as its processes
+ *        stop and continue. a stopped job hands its slot to a queued one
+ * 
+ * @param queue the queue owning the job
+ * @param job the job, with at least one process left
+ */
+static void update_stop_state(BgJobQueue *queue, BackgroundJob *job) {
+    if (job->foreground) {
+        return;  // the prompt loop turns it into a background job
+    }
+    if (job->state == JOB_RUNNING && job->stopped == job->remaining) {
+        job->state = JOB_STOPPED;
+        queue->running--;
+        start_queued_jobs(queue);
+    } else if (job->state == JOB_STOPPED && job->stopped < job->remaining) {
+        job->state = JOB_RUNNING;
+        queue->running++;
+    }
+}
+
+/**
+ * @brief records the exit, stop or continue of a child in its job through the
+ *        pid map, stopped and continued processes stay in the map
+ * 
+ * @param queue the queue owning the jobs
+ * @param pid reaped process
+ * @param status status from wait4
+ * @param ru its resource use from wait4
+ * @return int 1 if the pid belonged to a job
+ */
+static int record_exit(BgJobQueue *queue, pid_t pid, int status, const struct rusage *ru) {
+    if (WIFSTOPPED(status) || WIFCONTINUED(status)) {
+        PidSlot *found = pid_map_find(&queue->pid_map, pid);
+        if (!found) {
+            return 0;
+        }
+        int stopped = WIFSTOPPED(status);
+        // bg and fg clear the flags when they continue a job, so a late report changes nothing
+        if (found->stopped != stopped) {
+            found->stopped = stopped;
+            found->job->stopped += stopped ? 1 : -1;
+            update_stop_state(queue, found->job);
+        }
+        return 1;
+    }
+
+    PidSlot slot;
+    if (!pid_map_remove(&queue->pid_map, pid, &slot)) {
+        return 0;  // not one of our jobs
+    }
+
+    BackgroundJob *job = slot.job;
+    if (slot.stopped) {
+        job->stopped--;  // killed while stopped
+    }
+    if (slot.stage < 0) {
+        // helpers have no status of their own
+    } else if (WIFEXITED(status)) {
+        job->exit_status[slot.stage] = WEXITSTATUS(status);
+    } else if (WIFSIGNALED(status)) {
+        job->exit_status[slot.stage] = 128 + WTERMSIG(status);  // like other shells report it
+    }
+    if (job->usage && slot.stage >= 0) {
+        job->usage[slot.stage].ru = *ru;
+        job->usage[slot.stage].wall_ns = monotonic_ns() - job->start_ns;
+    }
+    if (--job->remaining == 0) {
+        mark_job_done(queue, job);
+    } else if (job->stopped > 0) {
+        update_stop_state(queue, job);
+    }
+    return 1;
+}
+
+/**
+ * @brief blocks in wait4 until one child exits, stops or continues and records it
+ * 
+ * @param queue the queue owning the jobs
+ * @return int 0, or -1 once there is no child left to wait for
+ */
+static int reap_one(BgJobQueue *queue) {
+    int status;
+    struct rusage ru;
+    pid_t pid = wait4(-1, &status, WUNTRACED | WCONTINUED, &ru);
+    STAT_SYSCALL(SYS_WAITPID);
+    if (pid < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    record_exit(queue, pid, status, &ru);
+    return 0;
+}
+
+/**
+ * @brief collects exited children with wait4(-1) until none is left and
+ *        records each status in its job through the pid map
+ * 
+ * @param queue the queue owning the jobs
+ * @param options WNOHANG to only collect children that already exited
+ * @return int number of processes reaped
+ */
+int reap_children(BgJobQueue *queue, int options) {
+    int reaped = 0;
+    int status;
+    struct rusage ru;
+    pid_t pid;
+
+    while (1) {
+        pid = wait4(-1, &status, options | WUNTRACED | WCONTINUED, &ru);
+        STAT_SYSCALL(SYS_WAITPID);
+        if (pid <= 0) {
+            break;
+        }
+        reaped += record_exit(queue, pid, status, &ru);
+        if (options == 0 && queue->pid_map.count == 0) {
+            break;  // a blocking reap stops once every job is done
+        }
+    }
+    return reaped;
+}
+
+/**
+ * @brief writes a string as the inside of a JSON string literal
+ */
+static void json_escape(FILE *out, const char *str) {
+    for (; *str; str++) {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\') {
+            fputc('\\', out);
+            fputc(c, out);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+}
+
+/**
+ * @brief reports the resource use of every stage of a finished job, after its
+ *        completion line on stderr or as one JSON line per stage in the log
+ *
+ * @param job the finished job, its usage must be recorded
+ * @param command its command line
+ */
+static void report_usage(const BackgroundJob *job, const char *command) {
+    for (int i = 0; i < job->pid_count; i++) {
+        const StageUsage *usage = &job->usage[i];
+        long user_us = usage->ru.ru_utime.tv_sec * 1000000L + usage->ru.ru_utime.tv_usec;
+        long sys_us = usage->ru.ru_stime.tv_sec * 1000000L + usage->ru.ru_stime.tv_usec;
+        if (usage_json) {
+            fprintf(usage_log, "{\"command\": \"");
+            json_escape(usage_log, command);
+            fprintf(usage_log, "\", \"stage\": %d, \"pid\": %d, \"status\": %d, \"wall_us\": %llu, "
+                    "\"user_us\": %ld, \"sys_us\": %ld, \"maxrss_kb\": %ld, \"nvcsw\": %ld, "
+                    "\"nivcsw\": %ld}\n", i + 1, (int)job->pids[i], job->exit_status[i],
+                    usage->wall_ns / 1000, user_us, sys_us, usage->ru.ru_maxrss,
+                    usage->ru.ru_nvcsw, usage->ru.ru_nivcsw);
+        } else {
+            fprintf(usage_log, "+ usage '%s' stage %d [%d] wall %.3fms user %.3fms sys %.3fms "
+                    "maxrss %ldkB csw %ld/%ld\n", command, i + 1, job->exit_status[i],
+                    usage->wall_ns / 1e6, user_us / 1e3, sys_us / 1e3, usage->ru.ru_maxrss,
+                    usage->ru.ru_nvcsw, usage->ru.ru_nivcsw);
+        }
+    }
+    fflush(usage_log);
+}
+
+static void clear_sigpipe(void);
+
+/**
+ * @brief writes the pending telemetry without blocking. what the sink can't
+ *        take now stays buffered for the next flush, a closed sink turns it off
+ */
+void telemetry_flush(void) {
+    while (telemetry.head < telemetry.len) {
+        char *data = telemetry.buf + telemetry.head;
+        size_t len = telemetry.len - telemetry.head;
+        ssize_t n = telemetry.kind == TELEMETRY_SOCKET
+            ? send(telemetry.fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL)
+            : write(telemetry.fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;  // the collector is behind, try again when we're idle next
+            }
+            if (errno == EPIPE) {
+                clear_sigpipe();
+            }
+            if (!telemetry.shared) {
+                close(telemetry.fd);
+            }
+            free(telemetry.buf);
+            telemetry.kind = TELEMETRY_OFF;
+            return;
+        }
+        telemetry.head += n;  // a partial write of a stream resumes mid record
+    }
+    telemetry.head = telemetry.len = 0;
+}
+
+/**
+ * @brief records the completion of a command line in the telemetry sink
+ *
+ * @param command its command line
+ * @param pids pid of every stage, 0 if it had none
+ * @param exit_status status of every stage
+ * @param usage resource use of every stage, NULL if none was recorded
+ * @param num_stages number of stages
+ * @param start_ns CLOCK_MONOTONIC time of the launch
+ * @param background 1 for a background job
+ */
+void telemetry_emit(const char *command, const pid_t *pids, const int *exit_status,
+                    const StageUsage *usage, int num_stages, unsigned long long start_ns,
+                    int background) {
+    TelemetryRecord rec;
+    memset(&rec, 0, sizeof(rec));
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    rec.magic = TELEMETRY_MAGIC;
+    rec.size = sizeof(rec);
+    rec.num_stages = num_stages;
+    rec.end_ns = now.tv_sec * 1000000000ll + now.tv_nsec;
+    rec.start_ns = rec.end_ns - (int64_t)(monotonic_ns() - start_ns);
+    rec.shell_pid = getpid();
+    rec.flags = background ? TELEMETRY_BACKGROUND : 0;
+    rec.dropped = telemetry.dropped;
+    for (int i = 0; i < num_stages && i < TELEMETRY_STAGES; i++) {
+        TelemetryStage *stage = &rec.stages[i];
+        stage->pid = pids[i];
+        stage->status = exit_status[i];
+        if (usage) {
+            const struct rusage *ru = &usage[i].ru;
+            stage->wall_ns = usage[i].wall_ns;
+            stage->user_us = ru->ru_utime.tv_sec * 1000000ll + ru->ru_utime.tv_usec;
+            stage->sys_us = ru->ru_stime.tv_sec * 1000000ll + ru->ru_stime.tv_usec;
+            stage->maxrss_kb = ru->ru_maxrss;
+            stage->nvcsw = ru->ru_nvcsw;
+            stage->nivcsw = ru->ru_nivcsw;
+        }
+    }
+    strncpy(rec.command, command, sizeof(rec.command) - 1);
+
+    if (telemetry.kind == TELEMETRY_RING) {
+        // claim a slot and take it from readers before touching it, a wrapped ring
+        // still has the record of the previous pass published in there
+        TelemetryRingHeader *ring = telemetry.ring;
+        uint64_t seq = __atomic_fetch_add(&ring->next, 1, __ATOMIC_RELAXED);
+        TelemetryRecord *slot = (TelemetryRecord *)((char *)ring + (seq % ring->slots + 1) * sizeof(rec));
+        __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        // everything but seq, which is published last
+        size_t seq_end = offsetof(TelemetryRecord, seq) + sizeof(rec.seq);
+        memcpy(slot, &rec, offsetof(TelemetryRecord, seq));
+        memcpy((char *)slot + seq_end, (char *)&rec + seq_end, sizeof(rec) - seq_end);
+        __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+        return;
+    }
+
+    rec.seq = ++telemetry.seq;
+    if (telemetry.len + sizeof(rec) > TELEMETRY_BUFFER * sizeof(rec)) {
+        // make room behind what was already written, never wait for the sink
+        memmove(telemetry.buf, telemetry.buf + telemetry.head, telemetry.len - telemetry.head);
+        telemetry.len -= telemetry.head;
+        telemetry.head = 0;
+        if (telemetry.len + sizeof(rec) > TELEMETRY_BUFFER * sizeof(rec)) {
+            telemetry.dropped++;
+            return;
+        }
+    }
+    memcpy(telemetry.buf + telemetry.len, &rec, sizeof(rec));
+    telemetry.len += sizeof(rec);
+    if (telemetry.len - telemetry.head >= TELEMETRY_BATCH * sizeof(rec)) {
+        telemetry_flush();
+    }
+}
+
+/**
+ * @brief maps a telemetry ring file, creating it with TELEMETRY_RING_SLOTS slots
+ *
+ * @return int 0 on success, -1 on error
+ */
+static int telemetry_open_ring(const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    off_t size = (TELEMETRY_RING_SLOTS + 1) * sizeof(TelemetryRecord);
+    TelemetryRingHeader header;
+    if (st.st_size >= (off_t)sizeof(header) && pread(fd, &header, sizeof(header), 0) == sizeof(header)
+        && header.magic == TELEMETRY_MAGIC) {
+        if (header.record_size != sizeof(TelemetryRecord) || header.slots == 0) {
+            close(fd);
+            return -1;  // a ring of another layout
+        }
+        size = (header.slots + 1) * sizeof(TelemetryRecord);
+    }
+    if (st.st_size < size && ftruncate(fd, size) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    telemetry.ring = map;
+    if (__atomic_load_n(&telemetry.ring->magic, __ATOMIC_ACQUIRE) != TELEMETRY_MAGIC) {
+        // shells creating the ring at once write the same geometry
+        telemetry.ring->record_size = sizeof(TelemetryRecord);
+        telemetry.ring->slots = TELEMETRY_RING_SLOTS;
+        __atomic_store_n(&telemetry.ring->magic, TELEMETRY_MAGIC, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/**
+ * @brief opens the sink named by SSHELL_TELEMETRY. the flags of an fd:N are
+ *        left alone, its open file description may be shared with whoever
+ *        passed it: a pipe is opened again nonblocking, a socket is written
+ *        with MSG_DONTWAIT and anything else is written as it is
+ *
+ * @param spec fd:N, unix:path or ring:path
+ * @return int 0 on success, -1 on error
+ */
+int telemetry_open(const char *spec) {
+    if (!strncmp(spec, "ring:", 5)) {
+        if (telemetry_open_ring(spec + 5) < 0) {
+            return -1;
+        }
+        telemetry.kind = TELEMETRY_RING;
+        return 0;
+    }
+
+    if (!strncmp(spec, "fd:", 3)) {
+        char *end;
+        long fd = strtol(spec + 3, &end, 10);
+        struct stat st;
+        if (end == spec + 3 || *end || fd < 0 || fd > INT_MAX || fstat(fd, &st) < 0) {
+            return -1;
+        }
+        if (S_ISFIFO(st.st_mode)) {
+            char path[64];
+            snprintf(path, sizeof(path), "/proc/self/fd/%ld", fd);
+            telemetry.fd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+            if (telemetry.fd < 0) {
+                return -1;
+            }
+            // the inherited end isn't needed any more, children don't get to write it
+            if (fd > STDERR_FILENO) {
+                close(fd);
+            }
+        } else {
+            telemetry.fd = fd;
+            telemetry.shared = 1;
+            if (fd > STDERR_FILENO) {
+                fcntl(telemetry.fd, F_SETFD, FD_CLOEXEC);  // children don't get to write it
+            }
+        }
+        telemetry.kind = S_ISSOCK(st.st_mode) ? TELEMETRY_SOCKET : TELEMETRY_FD;
+    } else if (!strncmp(spec, "unix:", 5)) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        if (strlen(spec + 5) >= sizeof(addr.sun_path)) {
+            return -1;
+        }
+        strcpy(addr.sun_path, spec + 5);
+        // a stream collector first, a datagram one gets one batch per datagram
+        telemetry.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (telemetry.fd >= 0 && connect(telemetry.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            int err = errno;
+            close(telemetry.fd);
+            telemetry.fd = err == EPROTOTYPE ? socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0) : -1;
+            if (telemetry.fd >= 0 && connect(telemetry.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+                close(telemetry.fd);
+                telemetry.fd = -1;
+            }
+        }
+        if (telemetry.fd < 0) {
+            return -1;
+        }
+        telemetry.kind = TELEMETRY_SOCKET;
+        fcntl(telemetry.fd, F_SETFL, fcntl(telemetry.fd, F_GETFL) | O_NONBLOCK);
+    } else {
+        return -1;
+    }
+
+    telemetry.buf = malloc(TELEMETRY_BUFFER * sizeof(TelemetryRecord));
+    if (!telemetry.buf) {
+        perror("malloc");
+        exit(1);
+    }
+    return 0;
+}
+
+/**
+ * @brief prints the completion line of every finished background job, oldest first
+ * 
+ * @param queue the queue to report from
+ * @return int number of jobs reported
+ */
+int report_done_jobs(BgJobQueue *queue) {
+    int completed_count = 0;
+
+    // report job completion in fifo order
+    while (queue->done) {
+        BackgroundJob *job = queue->done;
+        queue->done = job->done_next;
+
+        fprintf(stderr, "+ completed '%s' ", job->command);
+        for (int i = 0; i < job->pid_count; i++) {
+            fprintf(stderr, "[%d]", job->exit_status[i]);
+        }
+        fprintf(stderr, "\n");
+        if (usage_log) {
+            report_usage(job, job->command);
+        }
+        if (telemetry.kind) {
+            telemetry_emit(job->command, job->pids, job->exit_status, job->usage,
+                           job->pid_count, job->start_ns, 1);
+        }
+        history_add(job->command, job->exit_status[job->pid_count - 1]);
+
+        // unlink from the fifo and clean up
+        if (job->prev) {
+            job->prev->next = job->next;
+        } else {
+            queue->head = job->next;
+        }
+        if (job->next) {
+            job->next->prev = job->prev;
+        } else {
+            queue->tail = job->prev;
+        }
+        queue->num_jobs--;
+
+        slab_free(&job_slab, job->command);
+        free(job->pids);
+        free(job->usage);
+        free(job);
+        completed_count++;
+    }
+    
+    return completed_count;
+}
+
+/**
+ * @brief check for completed background jobs
+ * 
+ * @param queue the queue to check
+ * @param options waitpid options, WNOHANG to poll or 0 to block until every job is done
+ * @return int number of jobs that were completed and reported
+ */
+int check_completed_bg_jobs(BgJobQueue *queue, int options) {
+    if (queue->pid_map.count > 0) {
+        reap_children(queue, options);
+    }
+    return report_done_jobs(queue);
+}
+
+/**
+ * @brief blocks until every process of a foreground job has exited or is stopped. background
+ *        jobs finishing in the meantime are recorded as they are reaped and
+ *        reported together, oldest first, once the foreground job is done
+ * 
+ * @param queue the queue owning the background jobs
+ * @param job the foreground job, its pids must be in the pid map
+ */
+void wait_foreground_job(BgJobQueue *queue, BackgroundJob *job) {
+    while (job->remaining > job->stopped && reap_one(queue) == 0) {
+    }
+    report_done_jobs(queue);
+}
+
+/**
+ * @brief reports background jobs that finished since the last call. costs one
+ *        nonblocking read of the signalfd, the reaper only runs if SIGCHLD fired
+ * 
+ * @param queue the queue to check
+ */
+void poll_sigchld(BgJobQueue *queue) {
+    struct signalfd_siginfo info;
+    if (read(sigchld_fd, &info, sizeof(info)) > 0) {
+        check_completed_bg_jobs(queue, WNOHANG);
+    } else {
+        report_done_jobs(queue);
+    }
+}
+
+/**
+ * @brief blocks SIGCHLD, opens its signalfd and the epoll instance watching it
+ *        and the input. input that is never waited on gets no epoll instance
+ * 
+ * @param input_fd fd command lines are read from
+ */
+void init_events(int input_fd) {
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+
+    // SIGPIPE is blocked too so a native builtin writing to a closed pipe gets EPIPE
+    sigset_t blocked = chld;
+    sigaddset(&blocked, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &blocked, &child_sigmask);
+
+    sigchld_fd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigchld_fd < 0) {
+        perror("signalfd");
+        exit(1);
+    }
+
+    // regular files can't be polled, reading them never blocks anyway. neither
+    // does a -c command, which has no input fd at all
+    struct stat st;
+    if (input_fd < 0 || (fstat(input_fd, &st) == 0 && S_ISREG(st.st_mode))) {
+        return;
+    }
+
+    event_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (event_fd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = sigchld_fd;
+    epoll_ctl(event_fd, EPOLL_CTL_ADD, sigchld_fd, &ev);
+
+    ev.data.fd = input_fd;
+    if (epoll_ctl(event_fd, EPOLL_CTL_ADD, input_fd, &ev) < 0) {
+        close(event_fd);
+        event_fd = -1;
+    }
+}
+
+/**
+ * @brief sleeps until the input is readable. background jobs finishing while
+ *        the shell is idle are reported right away, followed by a new prompt
+ *        when a terminal is attached
+ * 
+ * @param queue the queue owning the background jobs
+ */
+void wait_for_input(BgJobQueue *queue) {
+    if (event_fd < 0) {
+        return;
+    }
+
+    while (1) {
+        // the shell is about to sleep, a good time to hand batched telemetry over
+        if (telemetry.len > 0) {
+            telemetry_flush();
+        }
+
+        struct epoll_event events[2];
+        int n = epoll_wait(event_fd, events, 2, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(1);
+        }
+
+        int input_ready = 0;
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd != sigchld_fd) {
+                input_ready = 1;
+                continue;
+            }
+
+            int interactive = !batch_mode && isatty(STDIN_FILENO);
+            struct signalfd_siginfo info;
+            while (read(sigchld_fd, &info, sizeof(info)) > 0) {
+                // drain, signals coalesce so this is usually a single read
+            }
+            if (queue->pid_map.count > 0) {
+                reap_children(queue, WNOHANG);
+            }
+            if (queue->done) {
+                if (interactive) {
+                    printf("\n");
+                    fflush(stdout);
+                }
+                report_done_jobs(queue);
+                if (interactive) {
+                    printf("sshell@ucd$ ");
+                    fflush(stdout);
+                }
+            }
+        }
+        if (input_ready) {
+            return;
+        }
+    }
+}
+
+/**
+ * @brief initialize a line reader
+ * 
+ * @param reader the reader to initialize
+ * @param fd fd to read from
+ * @param read_size bytes asked for by each read
+ */
+void line_reader_init(LineReader *reader, int fd, size_t read_size) {
+    reader->fd = fd;
+    reader->cap = read_size + 1;
+    reader->buf = malloc(reader->cap);
+    if (!reader->buf) {
+        perror("malloc");
+        exit(1);
+    }
+    reader->len = 0;
+    reader->pos = 0;
+    reader->read_size = read_size;
+    reader->eof = 0;
+}
+
+/**
+ * @brief returns the next command line without its newline, reading more input
+ *        through the event loop when no complete line is buffered
+ * 
+ * @param reader the reader
+ * @param queue background jobs to report while waiting for input
+ * @return char* the line, valid until the next call, or NULL at end of input
+ */
+char *read_command_line(LineReader *reader, BgJobQueue *queue) {
+    while (1) {
+        char *start = reader->buf + reader->pos;
+        char *nl = memchr(start, '\n', reader->len - reader->pos);
+        if (nl) {
+            *nl = '\0';
+            reader->pos = nl + 1 - reader->buf;
+            return start;
+        }
+
+        if (reader->eof) {
+            // last line without a newline
+            if (reader->pos < reader->len) {
+                reader->buf[reader->len] = '\0';
+                reader->pos = reader->len;
+                return start;
+            }
+            return NULL;
+        }
+
+        // move the partial line to the front and make room for one more read
+        memmove(reader->buf, start, reader->len - reader->pos);
+        reader->len -= reader->pos;
+        reader->pos = 0;
+        if (reader->cap - reader->len < reader->read_size + 1) {
+            reader->cap = reader->len + reader->read_size + 1;
+            reader->buf = realloc(reader->buf, reader->cap);
+            if (!reader->buf) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+
+        wait_for_input(queue);
+        STAT_START(read_start);
+        ssize_t n = read(reader->fd, reader->buf + reader->len, reader->read_size);
+        STAT_STOP(PHASE_READ, read_start);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            reader->eof = 1;
+        } else {
+            reader->len += n;
+        }
+    }
+}
+
+/**
+ * @brief FNV-1a hash of a command name
+ */
+static unsigned int hash_name(const char *name) {
+    unsigned int h = 2166136261u;
+    for (; *name; name++) {
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    }
+    return h;
+}
+
+/**
+ * @brief FNV-1a hash of a name that isn't NUL terminated
+ */
+static unsigned int hash_bytes(const char *name, size_t len) {
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+/**
+ * @brief empties the command hash table
+ */
+void hash_clear(void) {
+    for (int i = 0; i < HASH_BUCKETS; i++) {
+        HashEntry *entry = cmd_hash[i];
+        while (entry) {
+            HashEntry *next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+        cmd_hash[i] = NULL;
+    }
+}
+
+/**
+ * @brief removes one command from the hash table, used when its cached path stopped existing
+ * 
+ * @param name command name
+ */
+void hash_forget(const char *name) {
+    HashEntry **link = &cmd_hash[hash_name(name) % HASH_BUCKETS];
+    while (*link) {
+        HashEntry *entry = *link;
+        if (!strcmp(entry->name, name)) {
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            return;
+        }
+        link = &entry->next;
+    }
+}
+
+/**
+ * @brief walks PATH for an executable regular file called name
+ * 
+ * @param name command name without any /
+ * @param path_env value of PATH
+ * @return char* malloc'd absolute path or NULL if not found
+ */
+static char *search_path(const char *name, const char *path_env) {
+    size_t name_len = strlen(name);
+    const char *dir = path_env;
+
+    while (1) {
+        const char *end = strchr(dir, ':');
+        size_t dir_len = end ? (size_t)(end - dir) : strlen(dir);
+        char *candidate = malloc(dir_len + name_len + 3);
+        if (!candidate) {
+            perror("malloc");
+            exit(1);
+        }
+
+        // an empty PATH entry means the current directory
+        if (dir_len == 0) {
+            sprintf(candidate, "./%s", name);
+        } else {
+            sprintf(candidate, "%.*s/%s", (int)dir_len, dir, name);
+        }
+
+        struct stat st;
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0) {
+            return candidate;
+        }
+        free(candidate);
+
+        if (!end) {
+            return NULL;
+        }
+        dir = end + 1;
+    }
+}
+
+/**
+ * @brief resolves a command name to the path to exec, through the hash table
+ * 
+ * @param name command name
+ * @return const char* path to exec or NULL if the command is not found
+ */
+const char *lookup_command(const char *name) {
+    // names with a slash are never searched for
+    if (strchr(name, '/')) {
+        return name;
+    }
+
+    const char *path_env = getenv("PATH");
+    if (!path_env) {
+        path_env = "/bin:/usr/bin";
+    }
+    if (!cmd_hash_path || strcmp(cmd_hash_path, path_env)) {
+        hash_clear();
+        free(cmd_hash_path);
+        cmd_hash_path = strdup(path_env);
+        if (!cmd_hash_path) {
+            perror("strdup");
+            exit(1);
+        }
+    }
+
+    unsigned int bucket = hash_name(name) % HASH_BUCKETS;
+    for (HashEntry *entry = cmd_hash[bucket]; entry; entry = entry->next) {
+        if (!strcmp(entry->name, name)) {
+            entry->hits++;
+            return entry->path;
+        }
+    }
+
+    char *path = search_path(name, path_env);
+    if (!path) {
+        return NULL;
+    }
+
+    HashEntry *entry = malloc(sizeof(HashEntry));
+    if (!entry) {
+        perror("malloc");
+        exit(1);
+    }
+    entry->name = strdup(name);
+    if (!entry->name) {
+        perror("strdup");
+        exit(1);
+    }
+    entry->path = path;
+    entry->hits = 1;
+    entry->next = cmd_hash[bucket];
+    cmd_hash[bucket] = entry;
+    return path;
+}
+
+/**
+ * @brief finds a variable of the environment
+ * 
+ * @param name its name, not NUL terminated
+ * @param len length of the name
+ * @param link set to the link pointing at the variable, or at the end of its chain
+ * @return EnvVar* the variable, NULL if it isn't set
+ */
+static EnvVar *env_find(const char *name, size_t len, EnvVar ***link) {
+    *link = &shell_env.buckets[hash_bytes(name, len) % ENV_BUCKETS];
+    for (EnvVar *var = **link; var; *link = &var->next, var = var->next) {
+        if (var->name_len == len && !memcmp(var->entry, name, len)) {
+            return var;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief stores a malloc'd name=value entry, replacing the variable's old one
+ *        in its envp slot or appending a slot
+ * 
+ * @param entry the entry, owned by the environment from now on
+ * @param name_len length of the name part
+ */
+static void env_store(char *entry, size_t name_len) {
+    EnvVar **link;
+    EnvVar *var = env_find(entry, name_len, &link);
+    if (var) {
+        free(var->entry);
+        var->entry = entry;
+        shell_env.envp[var->index] = entry;
+        return;
+    }
+
+    if (shell_env.count + 1 == shell_env.cap) {
+        shell_env.cap *= 2;
+        shell_env.envp = realloc(shell_env.envp, shell_env.cap * sizeof(char *));
+        shell_env.vars = realloc(shell_env.vars, shell_env.cap * sizeof(EnvVar *));
+        if (!shell_env.envp || !shell_env.vars) {
+            perror("realloc");
+            exit(1);
+        }
+        environ = shell_env.envp;
+    }
+    var = malloc(sizeof(EnvVar));
+    if (!var) {
+        perror("malloc");
+        exit(1);
+    }
+    var->entry = entry;
+    var->name_len = name_len;
+    var->index = shell_env.count;
+    var->next = NULL;
+    *link = var;
+    shell_env.vars[shell_env.count] = var;
+    shell_env.envp[shell_env.count++] = entry;
+    shell_env.envp[shell_env.count] = NULL;
+}
+
+/**
+ * @brief copies environ into the table the first time a variable is used
+ */
+static void env_import(void) {
+    if (shell_env.envp) {
+        return;
+    }
+    shell_env.cap = 64;
+    shell_env.envp = malloc(shell_env.cap * sizeof(char *));
+    shell_env.vars = malloc(shell_env.cap * sizeof(EnvVar *));
+    if (!shell_env.envp || !shell_env.vars) {
+        perror("malloc");
+        exit(1);
+    }
+    shell_env.envp[0] = NULL;
+
+    char **inherited = environ;
+    environ = shell_env.envp;
+    for (char **env = inherited; env && *env; env++) {
+        char *eq = strchr(*env, '=');
+        if (!eq) {
+            continue;
+        }
+        char *entry = strdup(*env);
+        if (!entry) {
+            perror("strdup");
+            exit(1);
+        }
+        env_store(entry, eq - *env);  // a repeated name keeps its last value
+    }
+}
+
+/**
+ * @brief value of a variable
+ * 
+ * @param name its name, not NUL terminated
+ * @param len length of the name
+ * @return const char* the value, NULL if it isn't set
+ */
+const char *env_get(const char *name, size_t len) {
+    env_import();
+    EnvVar **link;
+    EnvVar *var = env_find(name, len, &link);
+    return var ? var->entry + len + 1 : NULL;
+}
+
+/**
+ * @brief sets a variable, for export
+ * 
+ * @param name its name
+ * @param len length of the name
+ * @param value its value
+ */
+void env_set(const char *name, size_t len, const char *value) {
+    env_import();
+    size_t value_len = strlen(value);
+    char *entry = malloc(len + value_len + 2);
+    if (!entry) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(entry, name, len);
+    entry[len] = '=';
+    memcpy(entry + len + 1, value, value_len + 1);
+    env_store(entry, len);
+    shell_env.gen++;
+}
+
+/**
+ * @brief removes a variable, its envp slot is filled with the last one
+ * 
+ * @param name its name
+ * @param len length of the name
+ */
+void env_unset(const char *name, size_t len) {
+    env_import();
+    EnvVar **link;
+    EnvVar *var = env_find(name, len, &link);
+    if (!var) {
+        return;
+    }
+    *link = var->next;
+    EnvVar *last = shell_env.vars[--shell_env.count];
+    shell_env.vars[var->index] = last;
+    shell_env.envp[var->index] = last->entry;
+    last->index = var->index;
+    shell_env.envp[shell_env.count] = NULL;
+    free(var->entry);
+    free(var);
+    shell_env.gen++;
+}
+
+/**
+ * @brief length of the variable name str starts with
+ * 
+ * @return size_t 0 if str doesn't start with a name
+ */
+static size_t var_name_len(const char *str, const char *end) {
+    const char *p = str;
+    while (p < end && (*p == '_' || (*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z')
+                       || (p > str && *p >= '0' && *p <= '9'))) {
+        p++;
+    }
+    return p - str;
+}
+
+/**
+ * @brief hash builtin: lists the remembered commands with their hit counts, -r forgets them all
+ * 
+ * @param cmd the hash command
+ * @return int exit status
+ */
+int builtin_hash(Command *cmd) {
+    if (cmd->args[1] && !strcmp(cmd->args[1], "-r")) {
+        hash_clear();
+        return 0;
+    }
+
+    int empty = 1;
+    for (int i = 0; i < HASH_BUCKETS; i++) {
+        for (HashEntry *entry = cmd_hash[i]; entry; entry = entry->next) {
+            if (empty) {
+                printf("hits\tcommand\n");
+                empty = 0;
+            }
+            printf("%4lu\t%s\n", entry->hits, entry->path);
+        }
+    }
+    if (empty) {
+        printf("hash: hash table empty\n");
+    }
+    fflush(stdout);
+    return 0;
+}
+
+/**
+ * @brief exit builtin, refused while background jobs are still running
+ * 
+ * @param cmd the exit command
+ * @return int exit status, the shell exits after reporting a 0
+ */
+int builtin_exit(Command *cmd) {
+    (void)cmd;
+    if (bg_queue.num_jobs > 0) {
+        fprintf(stderr, "Error: active job still running\n");
+        // check if any background jobs have completed
+        poll_sigchld(&bg_queue);
+        return 1;
+    }
+    fprintf(stderr, "Bye...\n");
+    return 0;
+}
+
+/**
+ * @brief pwd builtin
+ * 
+ * @param cmd the pwd command
+ * @return int exit status
+ */
+int builtin_pwd(Command *cmd) {
+    (void)cmd;
+    char *cwd = getcwd(NULL, 0);
+    if (!cwd) {
+        return 1;
+    }
+    fprintf(stdout, "%s\n", cwd);
+    fflush(stdout); // keep ordering with children writing to the same stdout
+    free(cwd);
+    return 0;
+}
+
+// pre-forked workers copied the environment and the cwd when they were forked
+void pool_drain(void);
+
+/**
+ * @brief cd builtin
+ * 
+ * @param cmd the cd command, can assume only one arg
+ * @return int exit status
+ */
+int builtin_cd(Command *cmd) {
+    if (chdir(cmd->args[1]) != 0) {
+        fprintf(stderr, "Error: cannot cd into directory\n");
+        return 1;
+    }
+    pool_drain();
+    return 0;
+}
+
+/**
+ * @brief export builtin: export NAME=value... sets variables for the children,
+ *        export alone lists them. every variable is exported, export NAME
+ *        leaves an existing one as it is
+ * 
+ * @param cmd the export command
+ * @return int exit status
+ */
+int builtin_export(Command *cmd) {
+    if (!cmd->args[1]) {
+        env_import();
+        for (size_t i = 0; i < shell_env.count; i++) {
+            printf("export %s\n", shell_env.envp[i]);
+        }
+        fflush(stdout);
+        return 0;
+    }
+
+    int ret = 0;
+    for (char **arg = cmd->args + 1; *arg; arg++) {
+        size_t len = var_name_len(*arg, *arg + strlen(*arg));
+        if (!len || ((*arg)[len] != '=' && (*arg)[len] != '\0')) {
+            fprintf(stderr, "Error: invalid variable name\n");
+            ret = 1;
+        } else if ((*arg)[len] == '=') {
+            env_set(*arg, len, *arg + len + 1);
+            pool_drain();
+        }
+    }
+    return ret;
+}
+
+/**
+ * @brief unset builtin: removes variables from the environment
+ * 
+ * @param cmd the unset command
+ * @return int exit status
+ */
+int builtin_unset(Command *cmd) {
+    int ret = 0;
+    for (char **arg = cmd->args + 1; *arg; arg++) {
+        size_t len = strlen(*arg);
+        if (!len || var_name_len(*arg, *arg + len) != len) {
+            fprintf(stderr, "Error: invalid variable name\n");
+            ret = 1;
+        } else {
+            env_unset(*arg, len);
+            pool_drain();
+        }
+    }
+    return ret;
+}
+
+/**
+ * @brief jobs builtin: lists the background jobs with their state, jobs -l N
+ *        sets how many run at once and jobs -l prints that limit
+ * 
+ * @param cmd the jobs command
+ * @return int exit status
+ */
+int builtin_jobs(Command *cmd) {
+    static const char *state_names[] = { "queued", "running", "stopped", "done" };
+
+    if (cmd->args[1] && !strcmp(cmd->args[1], "-l")) {
+        if (!cmd->args[2]) {
+            printf("%d\n", job_limit(&bg_queue));
+            fflush(stdout);
+            return 0;
+        }
+        char *end;
+        long limit = strtol(cmd->args[2], &end, 10);
+        if (*end || limit < 1 || limit > INT_MAX) {
+            fprintf(stderr, "Error: invalid job limit\n");
+            return 1;
+        }
+        bg_queue.limit = (int)limit;
+        start_queued_jobs(&bg_queue);  // a higher limit frees slots now
+        return 0;
+    }
+
+    for (BackgroundJob *job = bg_queue.head; job; job = job->next) {
+        printf("[%lu]\t%s\t%s\n", job->seq + 1, state_names[job->state], job->command);
+    }
+    fflush(stdout);
+    return 0;
+}
+
+/**
+ * @brief wait builtin: blocks in wait4 until every background job is done,
+ *        or only job N for wait N. finished jobs are reported before returning
+ * 
+ * @param cmd the wait command
+ * @return int 0, or the status of the last stage of job N
+ */
+int builtin_wait(Command *cmd) {
+    BackgroundJob *target = NULL;
+    if (cmd->args[1]) {
+        char *end;
+        unsigned long id = strtoul(cmd->args[1], &end, 10);
+        for (BackgroundJob *job = bg_queue.head; job && !*end; job = job->next) {
+            if (job->seq + 1 == id) {
+                target = job;
+            }
+        }
+        if (!target) {
+            fprintf(stderr, "Error: no such job\n");
+            return 1;
+        }
+    }
+
+    // queued jobs are started by the reaper as slots free up, stopped jobs aren't waited for
+    while ((target ? target->state != JOB_DONE && target->state != JOB_STOPPED
+                   : bg_queue.running > 0) && reap_one(&bg_queue) == 0) {
+    }
+
+    int ret = target ? target->exit_status[target->pid_count - 1] : 0;
+    report_done_jobs(&bg_queue);
+    return ret;
+}
+
+/**
+ * @brief finds the job a job control builtin names
+ * 
+ * @param spec %N or N, NULL for the most recent job that isn't done
+ * @return BackgroundJob* the job, NULL if there is none
+ */
+static BackgroundJob *find_job(const char *spec) {
+    BackgroundJob *found = NULL;
+    if (!spec) {
+        for (BackgroundJob *job = bg_queue.head; job; job = job->next) {
+            if (job->state != JOB_DONE) {
+                found = job;
+            }
+        }
+        return found;
+    }
+
+    char *end;
+    spec += *spec == '%';
+    unsigned long id = strtoul(spec, &end, 10);
+    for (BackgroundJob *job = bg_queue.head; job && !*end && end != spec; job = job->next) {
+        if (job->seq + 1 == id && job->state != JOB_DONE) {
+            found = job;
+        }
+    }
+    return found;
+}
+
+/**
+ * @brief continues every stopped process of a job with one killpg. the stop
+ *        flags are cleared right away, the reports wait4 makes later change nothing
+ * 
+ * @param queue the queue owning the job
+ * @param job the job, with a process group
+ */
+static void continue_job(BgJobQueue *queue, BackgroundJob *job) {
+    for (size_t i = 0; i < queue->pid_map.cap; i++) {
+        if (queue->pid_map.slots[i].pid && queue->pid_map.slots[i].job == job) {
+            queue->pid_map.slots[i].stopped = 0;
+        }
+    }
+    job->stopped = 0;
+    update_stop_state(queue, job);
+    killpg(job->pgid, SIGCONT);
+}
+
+/**
+ * @brief fg builtin: puts job N, or the most recent one, in the foreground,
+ *        continuing it if stopped, and waits until it is done or stops again
+ * 
+ * @param cmd the fg command
+ * @return int status of the last stage of the job, 128 + SIGTSTP if it stopped
+ */
+int builtin_fg(Command *cmd) {
+    BackgroundJob *job = find_job(cmd->args[1]);
+    if (!job) {
+        fprintf(stderr, "Error: no such job\n");
+        return 1;
+    }
+    if (job->state == JOB_QUEUED) {
+        start_job_now(&bg_queue, job);  // ahead of the limit, like the foreground lines
+    }
+
+    if (job_tty && job->pgid) {
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+    }
+    if (job->stopped > 0) {
+        continue_job(&bg_queue, job);
+    }
+    while (job->state == JOB_RUNNING && reap_one(&bg_queue) == 0) {
+    }
+    if (job_tty) {
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+    }
+
+    int ret = 128 + SIGTSTP;
+    if (job->state == JOB_STOPPED) {
+        fprintf(stderr, "[%lu]\tstopped\t%s\n", job->seq + 1, job->command);
+    } else {
+        ret = job->exit_status[job->pid_count - 1];
+    }
+    report_done_jobs(&bg_queue);  // frees the job if it is done
+    return ret;
+}
+
+/**
+ * @brief bg builtin: continues stopped job N, or the most recent one, in the
+ *        background. a queued job is started even if the limit is reached
+ * 
+ * @param cmd the bg command
+ * @return int exit status
+ */
+int builtin_bg(Command *cmd) {
+    BackgroundJob *job = find_job(cmd->args[1]);
+    if (!job) {
+        fprintf(stderr, "Error: no such job\n");
+        return 1;
+    }
+    if (job->state == JOB_QUEUED) {
+        start_job_now(&bg_queue, job);
+    } else if (job->stopped > 0) {
+        continue_job(&bg_queue, job);
+    }
+    return 0;
+}
+
+// signal names kill takes besides numbers
+static const struct {
+    const char *name;
+    int sig;
+} signal_names[] = {
+    { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "KILL", SIGKILL },
+    { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }, { "PIPE", SIGPIPE }, { "ALRM", SIGALRM },
+    { "TERM", SIGTERM }, { "CONT", SIGCONT }, { "STOP", SIGSTOP }, { "TSTP", SIGTSTP },
+};
+
+/**
+ * @brief parses a signal given as a name with or without SIG, or its number
+ * 
+ * @return int the signal, -1 if invalid
+ */
+static int parse_signal(const char *name) {
+    if (!strncmp(name, "SIG", 3)) {
+        name += 3;
+    }
+    for (size_t i = 0; i < sizeof(signal_names) / sizeof(signal_names[0]); i++) {
+        if (!strcmp(name, signal_names[i].name)) {
+            return signal_names[i].sig;
+        }
+    }
+    char *end;
+    long sig = strtol(name, &end, 10);
+    return *end || end == name || sig < 0 || sig >= NSIG ? -1 : (int)sig;
+}
+
+/**
+ * @brief kill builtin: kill [-SIG] %N|pid... sends SIGTERM or SIG to every
+ *        process of job N with a single killpg, or to a single pid. a stopped
+ *        job is continued so it sees the signal. a queued job has no process
+ *        yet, it is dropped as if killed unless the signal only stops or continues
+ * 
+ * @param cmd the kill command
+ * @return int 0 if every signal was sent
+ */
+int builtin_kill(Command *cmd) {
+    int sig = SIGTERM;
+    char **arg = cmd->args + 1;
+    if (*arg && (*arg)[0] == '-') {
+        if ((sig = parse_signal(*arg + 1)) < 0) {
+            fprintf(stderr, "Error: invalid signal\n");
+            return 1;
+        }
+        arg++;
+    }
+    if (!*arg) {
+        fprintf(stderr, "Error: missing job or pid\n");
+        return 1;
+    }
+
+    int ret = 0;
+    for (; *arg; arg++) {
+        if ((*arg)[0] != '%') {
+            char *end;
+            long pid = strtol(*arg, &end, 10);
+            if (*end || end == *arg || pid <= 0 || kill((pid_t)pid, sig) < 0) {
+                fprintf(stderr, "Error: cannot send signal\n");
+                ret = 1;
+            }
+            continue;
+        }
+
+        BackgroundJob *job = find_job(*arg);
+        if (!job) {
+            fprintf(stderr, "Error: no such job\n");
+            ret = 1;
+        } else if (job->state == JOB_QUEUED) {
+            if (sig && sig != SIGCONT && sig != SIGSTOP && sig != SIGTSTP) {
+                drop_queued_job(&bg_queue, job, sig);
+            }
+        } else {
+            killpg(job->pgid, sig);
+            if (job->stopped > 0 && sig != SIGSTOP && sig != SIGTSTP && sig != SIGKILL) {
+                killpg(job->pgid, SIGCONT);
+            }
+        }
+    }
+    return ret;
+}
+
+/**
+ * @brief maps a read-only view of the history files as they are right now
+ *
+ * @param records set to the index records
+ * @param count set to the number of whole records
+ * @param data set to the data file
+ * @param data_len set to its size
+ * @return int 0 on success, -1 on error
+ */
+static int history_map(const HistRecord **records, size_t *count, const char **data, size_t *data_len) {
+    struct stat index_st, data_st;
+    // the index is sized first, every record in it has its line in the data by then
+    if (fstat(history.index_fd, &index_st) < 0 || fstat(history.data_fd, &data_st) < 0) {
+        return -1;
+    }
+    *count = index_st.st_size / sizeof(HistRecord);
+    *data_len = data_st.st_size;
+    *records = NULL;
+    *data = NULL;
+    if (*count == 0) {
+        return 0;
+    }
+
+    *records = mmap(NULL, *count * sizeof(HistRecord), PROT_READ, MAP_SHARED, history.index_fd, 0);
+    *data = mmap(NULL, *data_len, PROT_READ, MAP_SHARED, history.data_fd, 0);
+    if (*records == MAP_FAILED || *data == MAP_FAILED) {
+        if (*records != MAP_FAILED) {
+            munmap((void *)*records, *count * sizeof(HistRecord));
+        }
+        if (*data != MAP_FAILED) {
+            munmap((void *)*data, *data_len);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief history builtin: history [-s text] [count] prints the last count
+ *        entries, all of them by default. -s only keeps lines containing text
+ *
+ * @param cmd the history command
+ * @return int exit status
+ */
+int builtin_history(Command *cmd) {
+    const char *search = NULL;
+    size_t want = (size_t)-1;
+    int arg = 1;
+
+    if (cmd->args[arg] && !strcmp(cmd->args[arg], "-s")) {
+        search = cmd->args[arg + 1];
+        if (!search) {
+            fprintf(stderr, "Error: missing search text\n");
+            return 1;
+        }
+        arg += 2;
+    }
+    if (cmd->args[arg]) {
+        char *end;
+        long n = strtol(cmd->args[arg], &end, 10);
+        if (*end || n < 0 || cmd->args[arg + 1]) {
+            fprintf(stderr, "Error: invalid history count\n");
+            return 1;
+        }
+        want = n;
+    }
+    if (history_open() < 0) {
+        fprintf(stderr, "Error: history is off\n");
+        return 1;
+    }
+
+    const HistRecord *records;
+    const char *data;
+    size_t count, data_len;
+    if (history_map(&records, &count, &data, &data_len) < 0) {
+        perror("mmap");
+        return 1;
+    }
+
+    // walk back from the newest entry until enough match, never touching older ones
+    size_t *found = malloc((count ? count : 1) * sizeof(size_t));
+    size_t num_found = 0;
+    size_t search_len = search ? strlen(search) : 0;
+    for (size_t i = count; i > 0 && num_found < want; i--) {
+        const HistRecord *rec = &records[i - 1];
+        if (rec->magic != HIST_MAGIC || rec->offset + rec->length > data_len) {
+            continue;  // torn or foreign record
+        }
+        if (search && !memmem(data + rec->offset, rec->length, search, search_len)) {
+            continue;
+        }
+        found[num_found++] = i - 1;
+    }
+
+    // oldest first, numbered by their position in the whole history
+    for (size_t i = num_found; i > 0; i--) {
+        const HistRecord *rec = &records[found[i - 1]];
+        printf("%5zu\t%d\t%.*s\n", found[i - 1] + 1, rec->status, (int)rec->length,
+               data + rec->offset);
+    }
+    fflush(stdout);
+
+    free(found);
+    if (count > 0) {
+        munmap((void *)records, count * sizeof(HistRecord));
+        munmap((void *)data, data_len);
+    }
+    return 0;
+}
+
+#ifndef SSHELL_NO_STATS
+/**
+ * @brief stats builtin: prints the counters, -r zeroes them
+ * 
+ * @param cmd the stats command
+ * @return int exit status
+ */
+int builtin_stats(Command *cmd) {
+    if (cmd->args[1] && !strcmp(cmd->args[1], "-r")) {
+        memset(&stats, 0, sizeof(stats));
+    } else {
+        stats_print(stdout);
+        fflush(stdout);
+    }
+    return 0;
+}
+#endif
+
+/**
+ * @brief writes all of len bytes, retrying short writes
+ * 
+ * @return int 0 on success, -1 on error
+ */
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief asks for a pipe capacity with F_SETPIPE_SZ. sizes above fs.pipe-max-size
+ *        are refused for unprivileged users, so the request is halved until it fits
+ * 
+ * @param fd either end of the pipe
+ * @param size capacity wanted in bytes
+ * @return int capacity now in effect, -1 if fd isn't a pipe
+ */
+int set_pipe_capacity(int fd, int size) {
+    for (; size >= PIPE_MIN_CAPACITY; size /= 2) {
+        int got = fcntl(fd, F_SETPIPE_SZ, size);
+        if (got >= 0) {
+            return got;
+        }
+        if (errno != EPERM && errno != EBUSY) {
+            break;
+        }
+    }
+    return fcntl(fd, F_GETPIPE_SZ);
+}
+
+/**
+ * @brief read/write fallback of the relay for fds splice doesn't support
+ */
+static ssize_t relay_copy(int in_fd, int out_fd, size_t len) {
+    char buf[RELAY_CHUNK];
+    ssize_t n;
+    do {
+        n = read(in_fd, buf, len < sizeof(buf) ? len : sizeof(buf));
+    } while (n < 0 && errno == EINTR);
+    if (n > 0 && write_all(out_fd, buf, n) < 0) {
+        return -1;
+    }
+    return n;
+}
+
+/**
+ * @brief moves up to len bytes from in_fd to out_fd, one of which is a pipe,
+ *        without copying them through user space when the kernel allows it
+ * 
+ * @param in_fd fd to read from
+ * @param out_fd fd to write to
+ * @param len most bytes to move
+ * @param use_splice cleared once this pair turns out not to splice (ttys,
+ *        O_APPEND files), later calls then read and write
+ * @return ssize_t bytes moved, 0 at end of input, -1 on error
+ */
+ssize_t relay_splice(int in_fd, int out_fd, size_t len, int *use_splice) {
+    if (*use_splice) {
+        ssize_t n;
+        do {
+            n = splice(in_fd, NULL, out_fd, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+        } while (n < 0 && errno == EINTR);
+        if (n >= 0 || (errno != EINVAL && errno != ENOSYS)) {
+            return n;
+        }
+        *use_splice = 0;
+    }
+    return relay_copy(in_fd, out_fd, len);
+}
+
+/**
+ * @brief hands an mmap'd buffer to a pipe with vmsplice and unmaps it. the
+ *        pipe holds references to the pages until they are read, so the
+ *        buffer is never copied and can't be changed under the reader
+ * 
+ * @param pipe_fd write end of a pipe
+ * @param data start of the mapping
+ * @param len bytes to hand over
+ * @param map_len size of the mapping
+ * @return int 0 on success, -1 on error
+ */
+int relay_gift(int pipe_fd, char *data, size_t len, size_t map_len) {
+    size_t done = 0;
+    int ret = 0;
+
+    while (done < len) {
+        struct iovec iov = { data + done, len - done };
+        ssize_t n = vmsplice(pipe_fd, &iov, 1, SPLICE_F_GIFT);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL || errno == ENOSYS) {
+                ret = write_all(pipe_fd, data + done, len - done);
+            } else {
+                ret = -1;
+            }
+            break;
+        }
+        done += n;
+    }
+    munmap(data, map_len);
+    return ret;
+}
+
+/**
+ * @brief relays a pipe to dst until end of input. with a capture fd every chunk
+ *        is first tee'd into a side pipe and spliced from there to the capture
+ *        file, so neither copy goes through user space
+ * 
+ * @param src read end of a pipe
+ * @param dst fd the data is meant for
+ * @param copy_fd fd getting a copy of everything, -1 for none
+ * @return int 0 on success, -1 if writing failed
+ */
+int relay_pump(int src, int dst, int copy_fd) {
+    int side[2] = { -1, -1 };
+    int dst_splice = 1;
+    int capture_splice = 1;
+    int ret = 0;
+
+    if (copy_fd >= 0 && pipe2(side, O_CLOEXEC) == 0) {
+        STAT_SYSCALL(SYS_PIPE);
+        set_pipe_capacity(side[1], fcntl(src, F_GETPIPE_SZ));
+    }
+
+    while (1) {
+        ssize_t chunk;
+        if (side[0] >= 0) {
+            chunk = tee(src, side[1], RELAY_CHUNK, 0);
+            if (chunk < 0 && errno == EINTR) {
+                continue;
+            }
+            if (chunk < 0) {
+                // no tee here, the capture falls back to copying below
+                close(side[0]);
+                close(side[1]);
+                side[0] = side[1] = -1;
+                continue;
+            }
+            if (chunk == 0) {
+                break;
+            }
+            // the side pipe was empty, so all of the duplicate fits and drains here
+            for (ssize_t left = chunk; left > 0; ) {
+                ssize_t n = relay_splice(side[0], copy_fd, left, &capture_splice);
+                if (n <= 0) {
+                    ret = -1;
+                    break;
+                }
+                left -= n;
+            }
+            for (ssize_t left = chunk; left > 0; ) {
+                ssize_t n = relay_splice(src, dst, left, &dst_splice);
+                if (n <= 0) {
+                    ret = -1;
+                    break;
+                }
+                left -= n;
+            }
+            if (ret < 0) {
+                break;
+            }
+        } else if (copy_fd >= 0) {
+            char buf[RELAY_CHUNK];
+            chunk = read(src, buf, sizeof(buf));
+            if (chunk < 0 && errno == EINTR) {
+                continue;
+            }
+            if (chunk <= 0) {
+                break;
+            }
+            if (write_all(copy_fd, buf, chunk) < 0 || write_all(dst, buf, chunk) < 0) {
+                ret = -1;
+                break;
+            }
+        } else {
+            chunk = relay_splice(src, dst, RELAY_CHUNK, &dst_splice);
+            if (chunk <= 0) {
+                ret = chunk < 0 ? -1 : 0;
+                break;
+            }
+        }
+    }
+
+    if (side[0] >= 0) {
+        close(side[0]);
+        close(side[1]);
+    }
+    return ret;
+}
+
+/**
+ * @brief reads exactly len bytes of a pipe into buf
+ *
+ * @return int 0 on success, -1 on error or early end of the data
+ */
+static int read_all(int fd, char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief body of the relay process of a fan-out: copies what the trunk writes to
+ *        every branch. the data is tee()d to all live branches but the last one,
+ *        which then takes it with splice(). a branch pipe that had no room for a
+ *        whole chunk gets the rest of it through a copy instead. a branch that
+ *        exits is dropped, the trunk gets EPIPE once none is left
+ *
+ * @param src read end of the pipe the trunk writes
+ * @param dst write ends of the pipes the first stages of the branches read, set to -1 as they close
+ * @param count number of branches
+ */
+void relay_fan_out(int src, int *dst, int count) {
+    char *buf = malloc(RELAY_CHUNK);
+    ssize_t *teed = malloc(count * sizeof(ssize_t));
+    int use_splice = 1;
+    int live = count;
+    if (!buf || !teed) {
+        perror("malloc");
+        _exit(1);
+    }
+
+    while (live > 0) {
+        int first = 0, last = count - 1;
+        while (dst[first] < 0) {
+            first++;
+        }
+        while (dst[last] < 0) {
+            last--;
+        }
+
+        ssize_t chunk;
+        if (live == 1) {
+            chunk = relay_splice(src, dst[last], RELAY_CHUNK, &use_splice);
+            if (chunk == 0) {
+                break;
+            }
+            if (chunk < 0) {
+                close(dst[last]);
+                dst[last] = -1;
+                live--;
+            }
+            continue;
+        }
+
+        // the first branch decides how much this round moves
+        chunk = tee(src, dst[first], RELAY_CHUNK, 0);
+        if (chunk < 0 && errno == EINTR) {
+            continue;
+        }
+        if (chunk == 0) {
+            break;
+        }
+        if (chunk < 0) {
+            close(dst[first]);
+            dst[first] = -1;
+            live--;
+            continue;
+        }
+
+        int short_write = 0;
+        for (int i = first; i < last; i++) {
+            teed[i] = chunk;
+            if (dst[i] < 0 || i == first) {
+                continue;
+            }
+            do {
+                teed[i] = tee(src, dst[i], chunk, 0);
+            } while (teed[i] < 0 && errno == EINTR);
+            if (teed[i] < 0 && errno == EPIPE) {
+                close(dst[i]);
+                dst[i] = -1;
+                live--;
+                teed[i] = chunk;
+            } else if (teed[i] < 0) {
+                teed[i] = 0;  // copied below
+            }
+            short_write |= teed[i] < chunk;
+        }
+
+        if (!short_write) {
+            ssize_t left = chunk;
+            while (left > 0) {
+                ssize_t n = relay_splice(src, dst[last], left, &use_splice);
+                if (n <= 0) {
+                    break;
+                }
+                left -= n;
+            }
+            if (left == 0) {
+                continue;
+            }
+            // the last branch went away, the rest of the round is only read past
+            close(dst[last]);
+            dst[last] = -1;
+            live--;
+            if (read_all(src, buf, left) < 0) {
+                break;
+            }
+            continue;
+        }
+
+        if (read_all(src, buf, chunk) < 0) {
+            break;
+        }
+        for (int i = first; i <= last; i++) {
+            ssize_t done = i == last ? 0 : teed[i];
+            if (dst[i] >= 0 && done < chunk && write_all(dst[i], buf + done, chunk - done) < 0) {
+                close(dst[i]);
+                dst[i] = -1;
+                live--;
+            }
+        }
+    }
+
+    free(buf);
+    free(teed);
+}
+
+/**
+ * @brief body of the writer process of an output file in large output mode.
+ *        the stage writes to a pipe and this stages it in 1 MiB aligned
+ *        buffers. with O_DIRECT whole blocks bypass the page cache, otherwise
+ *        every flushed megabyte is written back and dropped from the cache
+ *        once the next one is on its way, so a huge log doesn't evict
+ *        everything else
+ *
+ * @param src read end of the pipe from the stage
+ * @param fd the output file
+ * @return int 0 on success, -1 on a write error
+ */
+int write_staged(int src, int fd) {
+    char *buf;
+    if (posix_memalign((void **)&buf, DIRECT_ALIGN, OUTPUT_STAGE_SIZE) != 0) {
+        return -1;
+    }
+
+    int flags = fcntl(fd, F_GETFL);
+    int direct = output_direct && fcntl(fd, F_SETFL, flags | O_DIRECT) == 0;
+    int in_direct = direct;
+    struct stat st;
+    off_t pos = flags & O_APPEND && fstat(fd, &st) == 0 ? st.st_size : lseek(fd, 0, SEEK_CUR);
+    off_t synced = pos;  // start of what may still be dirty in the page cache
+    size_t head = direct && pos % DIRECT_ALIGN ? DIRECT_ALIGN - pos % DIRECT_ALIGN : 0;
+    size_t len = 0;
+    int eof = 0;
+    int ret = 0;
+
+    while (!eof && ret == 0) {
+        while (len < OUTPUT_STAGE_SIZE) {
+            ssize_t n = read(src, buf + len, OUTPUT_STAGE_SIZE - len);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                eof = 1;
+                break;
+            }
+            len += n;
+        }
+
+        // O_DIRECT takes whole blocks at aligned offsets, the unaligned head of
+        // an appended file and the tail go through the page cache
+        while (len > 0) {
+            size_t n = len;
+            int use_direct = 0;
+            if (direct && head > 0) {
+                n = head < len ? head : len;
+                head -= n;
+            } else if (direct && len >= DIRECT_ALIGN) {
+                n = len & ~(size_t)(DIRECT_ALIGN - 1);
+                use_direct = 1;
+            } else if (direct && !eof) {
+                break;  // the rest of the block is still to come
+            }
+            if (use_direct != in_direct) {
+                fcntl(fd, F_SETFL, use_direct ? flags | O_DIRECT : flags);
+                in_direct = use_direct;
+            }
+            if (write_all(fd, buf, n) < 0) {
+                ret = -1;
+                break;
+            }
+            memmove(buf, buf + n, len - n);
+            len -= n;
+            pos += n;
+        }
+
+        if (!direct && pos - synced >= 2 * OUTPUT_STAGE_SIZE) {
+            // start writeback of the newest stage, wait for the older ones and drop them
+            off_t old = pos - OUTPUT_STAGE_SIZE - synced;
+            sync_file_range(fd, synced + old, OUTPUT_STAGE_SIZE, SYNC_FILE_RANGE_WRITE);
+            sync_file_range(fd, synced, old, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+                            | SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(fd, synced, old, POSIX_FADV_DONTNEED);
+            synced += old;
+        }
+    }
+
+    // a truncated file gives back the reserve it didn't use, an appended log keeps
+    // it for the next appends
+    if (ret == 0 && output_hint && !(flags & O_APPEND)) {
+        ftruncate(fd, pos);
+    }
+    free(buf);
+    return ret;
+}
+
+/**
+ * @brief largest pipe capacity an unprivileged process may ask for
+ * 
+ * @return int /proc/sys/fs/pipe-max-size, 1 MiB if it can't be read
+ */
+int pipe_max_size(void) {
+    if (!pipe_max) {
+        pipe_max = RELAY_PIPE_SIZE;
+        FILE *f = fopen("/proc/sys/fs/pipe-max-size", "r");
+        if (f) {
+            if (fscanf(f, "%d", &pipe_max) != 1 || pipe_max < PIPE_MIN_CAPACITY) {
+                pipe_max = RELAY_PIPE_SIZE;
+            }
+            fclose(f);
+        }
+    }
+    return pipe_max;
+}
+
+/**
+ * @brief parses a byte count with an optional k or m suffix
+ * 
+ * @return long the size, -1 if str isn't one
+ */
+long parse_size(const char *str) {
+    char *end;
+    errno = 0;
+    long size = strtol(str, &end, 10);
+    if (end == str || size < 0 || errno) {
+        return -1;
+    }
+    if (*end == 'k' || *end == 'K') {
+        size <<= 10;
+        end++;
+    } else if (*end == 'm' || *end == 'M') {
+        size <<= 20;
+        end++;
+    } else if (*end == 'g' || *end == 'G') {
+        size <<= 30;
+        end++;
+    }
+    return *end ? -1 : size;
+}
+
+/**
+ * @brief sets the capacity of the pipes between stages, capped to fs.pipe-max-size
+ * 
+ * @param arg a size, or default for the kernel default
+ * @return int 0 on success, -1 if arg isn't a size
+ */
+int set_pipe_size(const char *arg) {
+    if (!strcmp(arg, "default")) {
+        pipe_size = 0;
+        return 0;
+    }
+    long size = parse_size(arg);
+    if (size < 0) {
+        return -1;
+    }
+    pipe_size = size > pipe_max_size() ? pipe_max_size() : (int)size;
+    return 0;
+}
+
+/**
+ * @brief pipesize builtin: pipesize [size|default] [packet|stream] sets the
+ *        capacity and mode of the pipes between stages, no arguments prints them
+ * 
+ * @param cmd the pipesize command
+ * @return int exit status
+ */
+int builtin_pipesize(Command *cmd) {
+    if (!cmd->args[1]) {
+        printf("size\tmax\tmode\n");
+        if (pipe_size) {
+            printf("%d", pipe_size);
+        } else {
+            printf("default");
+        }
+        printf("\t%d\t%s\n", pipe_max_size(), pipe_packet ? "packet" : "stream");
+        fflush(stdout);
+        return 0;
+    }
+
+    for (int i = 1; cmd->args[i]; i++) {
+        if (!strcmp(cmd->args[i], "packet")) {
+            pipe_packet = 1;
+        } else if (!strcmp(cmd->args[i], "stream")) {
+            pipe_packet = 0;
+        } else if (set_pipe_size(cmd->args[i]) < 0) {
+            fprintf(stderr, "Error: invalid pipe size\n");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief parses a sysfs cpu list like 0-3,8-11
+ * 
+ * @param list the list
+ * @param set set to the cpus of the list
+ */
+static void parse_cpulist(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    while (*list) {
+        char *end;
+        long first = strtol(list, &end, 10);
+        if (end == list) {
+            break;
+        }
+        long last = first;
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        list = *end == ',' ? end + 1 : end;
+    }
+}
+
+/**
+ * @brief formats a cpu set back into a list like 0-3,8-11
+ */
+static void format_cpulist(const cpu_set_t *set, char *buf, size_t size) {
+    size_t len = 0;
+    buf[0] = '\0';
+    for (int cpu = 0; cpu < CPU_SETSIZE && len < size; cpu++) {
+        if (!CPU_ISSET(cpu, set)) {
+            continue;
+        }
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)) {
+            last++;
+        }
+        if (last == cpu) {
+            len += snprintf(buf + len, size - len, "%s%d", len ? "," : "", cpu);
+        } else {
+            len += snprintf(buf + len, size - len, "%s%d-%d", len ? "," : "", cpu, last);
+        }
+        cpu = last;
+    }
+}
+
+/**
+ * @brief reads a cpu list file of sysfs
+ * 
+ * @return int 0 on success, -1 if the file can't be read
+ */
+static int read_cpulist(const char *path, cpu_set_t *set) {
+    char line[4096];
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+    int ok = fgets(line, sizeof(line), f) != NULL;
+    fclose(f);
+    if (!ok) {
+        return -1;
+    }
+    parse_cpulist(line, set);
+    return 0;
+}
+
+/**
+ * @brief adds a domain to a list unless it is empty or already in it
+ */
+static void add_domain(cpu_set_t **domains, int *count, const cpu_set_t *set) {
+    if (CPU_COUNT(set) == 0) {
+        return;
+    }
+    for (int i = 0; i < *count; i++) {
+        if (CPU_EQUAL(&(*domains)[i], set)) {
+            return;
+        }
+    }
+    *domains = realloc(*domains, (*count + 1) * sizeof(cpu_set_t));
+    if (!*domains) {
+        perror("realloc");
+        exit(1);
+    }
+    (*domains)[(*count)++] = *set;
+}
+
+/**
+ * @brief reads the NUMA nodes and L3 domains from sysfs, limited to the cpus
+ *        the shell may run on. without NUMA information everything is one node,
+ *        without cache information each node is one L3 domain
+ */
+void load_topology(void) {
+    cpu_set_t allowed, set;
+    char path[128];
+
+    if (topology.loaded) {
+        return;
+    }
+    topology.loaded = 1;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0
+        && read_cpulist("/sys/devices/system/cpu/online", &allowed) < 0) {
+        CPU_ZERO(&allowed);
+        CPU_SET(0, &allowed);
+    }
+
+    // node numbers may have gaps, the online list has the ones that exist
+    cpu_set_t online;
+    if (read_cpulist("/sys/devices/system/node/online", &online) == 0) {
+        for (int node = 0; node < CPU_SETSIZE; node++) {
+            if (!CPU_ISSET(node, &online)) {
+                continue;
+            }
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+            if (read_cpulist(path, &set) == 0) {
+                CPU_AND(&set, &set, &allowed);
+                add_domain(&topology.nodes, &topology.num_nodes, &set);
+            }
+        }
+    }
+    if (topology.num_nodes == 0) {
+        add_domain(&topology.nodes, &topology.num_nodes, &allowed);
+    }
+
+    // the L3 is whichever cache index reports level 3. one cpu of each L3 is
+    // enough, the others of its shared list are skipped
+    cpu_set_t covered;
+    CPU_ZERO(&covered);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed) || CPU_ISSET(cpu, &covered)) {
+            continue;
+        }
+        for (int index = 0; index < 8; index++) {
+            int level = 0;
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, index);
+            FILE *f = fopen(path, "r");
+            if (!f) {
+                break;
+            }
+            if (fscanf(f, "%d", &level) != 1) {
+                level = 0;
+            }
+            fclose(f);
+            if (level != 3) {
+                continue;
+            }
+            snprintf(path, sizeof(path),
+                     "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+            if (read_cpulist(path, &set) == 0) {
+                CPU_AND(&set, &set, &allowed);
+                CPU_OR(&covered, &covered, &set);
+                add_domain(&topology.l3, &topology.num_l3, &set);
+            }
+            break;
+        }
+    }
+    if (topology.num_l3 == 0) {
+        for (int i = 0; i < topology.num_nodes; i++) {
+            add_domain(&topology.l3, &topology.num_l3, &topology.nodes[i]);
+        }
+    }
+}
+
+/**
+ * @brief sets the cpus each stage of a pipeline runs on. a background job takes
+ *        the next domain round robin so concurrent jobs don't share one, a
+ *        foreground job stays in the domain of the cpu the shell is on. the node
+ *        policy lets all stages share the node, the l3 policy puts each stage on
+ *        its own cpu of the L3 domain
+ * 
+ * @param commands stages of the pipeline
+ * @param num_commands number of stages
+ * @param background 1 for a background job
+ * @param arena arena of the command line, holds the per stage sets
+ */
+void place_pipeline(Command *commands, int num_commands, int background, Arena *arena) {
+    load_topology();
+    cpu_set_t *domains = affinity_policy == AFFINITY_NODE ? topology.nodes : topology.l3;
+    int num_domains = affinity_policy == AFFINITY_NODE ? topology.num_nodes : topology.num_l3;
+
+    int pick = 0;
+    if (background) {
+        pick = affinity_next++ % num_domains;
+    } else {
+        int cpu = sched_getcpu();
+        for (int i = 0; i < num_domains; i++) {
+            if (cpu >= 0 && CPU_ISSET(cpu, &domains[i])) {
+                pick = i;
+                break;
+            }
+        }
+    }
+    cpu_set_t *domain = &domains[pick];
+
+    if (affinity_policy == AFFINITY_NODE) {
+        for (int i = 0; i < num_commands; i++) {
+            commands[i].cpus = domain;
+        }
+        return;
+    }
+
+    // the cpus of the domain in order, stages take them in turn
+    int num_cpus = CPU_COUNT(domain);
+    int *cpus = arena_alloc(arena, num_cpus * sizeof(int));
+    for (int cpu = 0, n = 0; n < num_cpus; cpu++) {
+        if (CPU_ISSET(cpu, domain)) {
+            cpus[n++] = cpu;
+        }
+    }
+    for (int i = 0; i < num_commands; i++) {
+        cpu_set_t *set = arena_alloc(arena, sizeof(cpu_set_t));
+        CPU_ZERO(set);
+        CPU_SET(cpus[i % num_cpus], set);
+        commands[i].cpus = set;
+    }
+}
+
+/**
+ * @brief sets the placement policy
+ * 
+ * @param name off, node or l3
+ * @return int 0 on success, -1 for an unknown policy
+ */
+int set_affinity_policy(const char *name) {
+    for (int i = 0; i < 3; i++) {
+        if (!strcmp(name, affinity_names[i])) {
+            affinity_policy = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief affinity builtin: affinity off|node|l3 sets the placement policy of
+ *        pipeline stages, no argument prints the policy and the domains
+ * 
+ * @param cmd the affinity command
+ * @return int exit status
+ */
+int builtin_affinity(Command *cmd) {
+    if (cmd->args[1]) {
+        if (set_affinity_policy(cmd->args[1]) < 0) {
+            fprintf(stderr, "Error: invalid affinity policy\n");
+            return 1;
+        }
+        return 0;
+    }
+
+    char list[1024];
+    load_topology();
+    printf("policy\t%s\n", affinity_names[affinity_policy]);
+    for (int i = 0; i < topology.num_nodes; i++) {
+        format_cpulist(&topology.nodes[i], list, sizeof(list));
+        printf("node%d\t%s\n", i, list);
+    }
+    for (int i = 0; i < topology.num_l3; i++) {
+        format_cpulist(&topology.l3[i], list, sizeof(list));
+        printf("l3_%d\t%s\n", i, list);
+    }
+    fflush(stdout);
+    return 0;
+}
+
+// output of a native builtin, collected in the line arena and written in one go
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+    Arena *arena;
+    int mapped;  // data is an mmap'd region of cap bytes instead of arena memory
+} OutBuf;
+
+/**
+ * @brief makes room for n more bytes in an output buffer
+ */
+static void out_reserve(OutBuf *out, size_t n) {
+    if (out->len + n <= out->cap) {
+        return;
+    }
+    size_t cap = out->cap ? out->cap : 256;
+    while (cap < out->len + n) {
+        cap *= 2;
+    }
+
+    // big outputs move to pages of their own which relay_gift can hand to a pipe
+    if (cap >= OUTBUF_MMAP_MIN) {
+        char *grown = out->mapped
+            ? mremap(out->data, out->cap, cap, MREMAP_MAYMOVE)
+            : mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (grown == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+        if (!out->mapped && out->len) {
+            memcpy(grown, out->data, out->len);
+        }
+        out->data = grown;
+        out->cap = cap;
+        out->mapped = 1;
+        return;
+    }
+
+    char *grown = arena_alloc(out->arena, cap);
+    if (out->len) {
+        memcpy(grown, out->data, out->len);
+    }
+    out->data = grown;
+    out->cap = cap;
+}
+
+/**
+ * @brief gives back the pages of a mapped output buffer
+ */
+static void out_release(OutBuf *out) {
+    if (out->mapped) {
+        munmap(out->data, out->cap);
+        out->mapped = 0;
+    }
+    out->data = NULL;
+    out->len = out->cap = 0;
+}
+
+static void out_append(OutBuf *out, const char *str, size_t n) {
+    out_reserve(out, n);
+    memcpy(out->data + out->len, str, n);
+    out->len += n;
+}
+
+static void out_putc(OutBuf *out, char c) {
+    out_append(out, &c, 1);
+}
+
+/**
+ * @brief appends one printf conversion, spec is a single % directive
+ */
+static void out_format(OutBuf *out, const char *spec, ...) {
+    va_list ap;
+    va_start(ap, spec);
+    int n = vsnprintf(NULL, 0, spec, ap);
+    va_end(ap);
+    if (n <= 0) {
+        return;
+    }
+
+    out_reserve(out, n + 1);
+    va_start(ap, spec);
+    vsnprintf(out->data + out->len, n + 1, spec, ap);
+    va_end(ap);
+    out->len += n;
+}
+
+/**
+ * @brief takes the SIGPIPE left pending by a write to a closed pipe off the
+ *        queue. SIGPIPE is blocked in the shell so such writes fail with EPIPE
+ */
+static void clear_sigpipe(void) {
+    sigset_t pipe_set;
+    struct timespec zero = { 0, 0 };
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    sigtimedwait(&pipe_set, NULL, &zero);
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/**
+ * @brief expands one backslash escape the way echo -e and printf do
+ * 
+ * @param str the chars right after the backslash
+ * @param out output buffer
+ * @param zero_octal 1 if octal escapes are written \0NNN (echo, %b), 0 for \NNN (printf formats)
+ * @param stop set when \c ends all further output
+ * @return size_t number of chars consumed after the backslash
+ */
+static size_t expand_escape(const char *str, OutBuf *out, int zero_octal, int *stop) {
+    static const char simple[] = "a\ab\be\033f\fn\nr\rt\tv\v\\\\";
+    for (const char *s = simple; *s; s += 2) {
+        if (*str == s[0]) {
+            out_putc(out, s[1]);
+            return 1;
+        }
+    }
+
+    if (*str == 'c') {
+        *stop = 1;
+        return 1;
+    }
+
+    if (*str == 'x' && hex_value(str[1]) >= 0) {
+        int value = hex_value(str[1]);
+        size_t used = 2;
+        if (hex_value(str[2]) >= 0) {
+            value = value * 16 + hex_value(str[2]);
+            used = 3;
+        }
+        out_putc(out, (char)value);
+        return used;
+    }
+
+    if ((zero_octal && *str == '0') || (!zero_octal && *str >= '0' && *str <= '7')) {
+        size_t used = zero_octal ? 1 : 0;
+        int value = 0;
+        for (int digits = 0; digits < 3 && str[used] >= '0' && str[used] <= '7'; digits++) {
+            value = value * 8 + (str[used++] - '0');
+        }
+        out_putc(out, (char)value);
+        return used;
+    }
+
+    // unknown escapes are kept as they are
+    out_putc(out, '\\');
+    if (!*str) {
+        return 0;
+    }
+    out_putc(out, *str);
+    return 1;
+}
+
+/**
+ * @brief true and false
+ */
+static int native_true(char **args, OutBuf *out) {
+    (void)args;
+    (void)out;
+    return 0;
+}
+
+static int native_false(char **args, OutBuf *out) {
+    (void)args;
+    (void)out;
+    return 1;
+}
+
+/**
+ * @brief echo with the -n, -e and -E options of coreutils echo
+ * 
+ * @param args the echo command
+ * @param out output buffer
+ * @return int exit status
+ */
+static int native_echo(char **args, OutBuf *out) {
+    int newline = 1;
+    int escapes = 0;
+    int i = 1;
+
+    // an argument is an option only if it is made of n, e and E alone
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        const char *flags = args[i] + 1;
+        if (strspn(flags, "neE") != strlen(flags)) {
+            break;
+        }
+        for (; *flags; flags++) {
+            if (*flags == 'n') {
+                newline = 0;
+            } else {
+                escapes = *flags == 'e';
+            }
+        }
+    }
+
+    for (int first = i; args[i]; i++) {
+        if (i > first) {
+            out_putc(out, ' ');
+        }
+        for (const char *p = args[i]; *p; p++) {
+            if (escapes && *p == '\\') {
+                int stop = 0;
+                p += expand_escape(p + 1, out, 1, &stop);
+                if (stop) {
+                    return 0;
+                }
+                continue;
+            }
+            out_putc(out, *p);
+        }
+    }
+
+    if (newline) {
+        out_putc(out, '\n');
+    }
+    return 0;
+}
+
+/**
+ * @brief converts a printf integer argument, 'c gives the code of c
+ * 
+ * @param arg the argument, NULL once the arguments ran out
+ * @param status set to 1 if arg isn't a number
+ * @return long long the value
+ */
+static long long printf_integer(const char *arg, int *status) {
+    if (!arg || !*arg) {
+        return 0;
+    }
+    if (arg[0] == '\'' || arg[0] == '"') {
+        return (unsigned char)arg[1];
+    }
+
+    char *end;
+    errno = 0;
+    long long value = strtoll(arg, &end, 0);
+    if (end == arg) {
+        fprintf(stderr, "printf: '%s': expected a numeric value\n", arg);
+        *status = 1;
+    } else if (*end || errno) {
+        fprintf(stderr, "printf: '%s': value not completely converted\n", arg);
+        *status = 1;
+    }
+    return value;
+}
+
+static double printf_double(const char *arg, int *status) {
+    if (!arg || !*arg) {
+        return 0;
+    }
+
+    char *end;
+    double value = strtod(arg, &end);
+    if (end == arg || *end) {
+        fprintf(stderr, "printf: '%s': expected a numeric value\n", arg);
+        *status = 1;
+    }
+    return value;
+}
+
+/**
+ * @brief formats once through the format string, taking arguments as directives need them
+ * 
+ * @param format the format
+ * @param argp next unused argument, advanced as arguments are used
+ * @param out output buffer
+ * @param status set to 1 on a bad numeric argument
+ * @return int 0 when done, 1 if \c stopped all output, -1 for a directive left to the real printf
+ */
+static int printf_pass(const char *format, char ***argp, OutBuf *out, int *status) {
+    for (const char *p = format; *p; p++) {
+        if (*p == '\\') {
+            int stop = 0;
+            p += expand_escape(p + 1, out, 0, &stop);
+            if (stop) {
+                return 1;
+            }
+            continue;
+        }
+        if (*p != '%') {
+            out_putc(out, *p);
+            continue;
+        }
+        if (p[1] == '%') {
+            out_putc(out, '%');
+            p++;
+            continue;
+        }
+
+        // copy flags, width and precision into a spec for snprintf
+        char spec[32];
+        size_t n = 0;
+        const char *d = p + 1;
+        spec[n++] = '%';
+        while (*d && strchr("-+ #0", *d) && n < 8) {
+            spec[n++] = *d++;
+        }
+        while (*d >= '0' && *d <= '9' && n < 16) {
+            spec[n++] = *d++;
+        }
+        if (*d == '.') {
+            spec[n++] = *d++;
+            while (*d >= '0' && *d <= '9' && n < 24) {
+                spec[n++] = *d++;
+            }
+        }
+        // * widths, length modifiers and the rest are rare enough to exec printf for
+        if (!*d || !strchr("diouxXcsbeEfFgGaA", *d)) {
+            return -1;
+        }
+
+        const char *arg = **argp ? *(*argp)++ : NULL;
+        int stop = 0;
+        switch (*d) {
+        case 'd':
+        case 'i':
+            memcpy(spec + n, "lld", 4);
+            out_format(out, spec, printf_integer(arg, status));
+            break;
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X':
+            spec[n] = 'l';
+            spec[n + 1] = 'l';
+            spec[n + 2] = *d;
+            spec[n + 3] = '\0';
+            out_format(out, spec, (unsigned long long)printf_integer(arg, status));
+            break;
+        case 'c':
+            memcpy(spec + n, "c", 2);
+            out_format(out, spec, arg ? *arg : '\0');
+            break;
+        case 's':
+            memcpy(spec + n, "s", 2);
+            out_format(out, spec, arg ? arg : "");
+            break;
+        case 'b': {
+            // %s of the argument with its escapes expanded
+            OutBuf expanded = { NULL, 0, 0, out->arena, 0 };
+            for (const char *a = arg ? arg : ""; *a && !stop; a++) {
+                if (*a == '\\') {
+                    a += expand_escape(a + 1, &expanded, 1, &stop);
+                } else {
+                    out_putc(&expanded, *a);
+                }
+            }
+            out_putc(&expanded, '\0');
+            memcpy(spec + n, "s", 2);
+            out_format(out, spec, expanded.data);
+            out_release(&expanded);
+            break;
+        }
+        default:
+            spec[n] = *d;
+            spec[n + 1] = '\0';
+            out_format(out, spec, printf_double(arg, status));
+            break;
+        }
+        if (stop) {
+            return 1;
+        }
+        p = d;
+    }
+    return 0;
+}
+
+/**
+ * @brief printf, the format is reused while arguments are left like coreutils does
+ * 
+ * @param args the printf command
+ * @param out output buffer
+ * @return int exit status, -1 to run the real printf instead
+ */
+static int native_printf(char **args, OutBuf *out) {
+    int i = 1;
+    if (args[i] && !strcmp(args[i], "--")) {
+        i++;
+    }
+    if (!args[i]) {
+        fprintf(stderr, "printf: missing operand\n");
+        return 1;
+    }
+
+    const char *format = args[i];
+    char **argp = &args[i + 1];
+    int status = 0;
+    while (1) {
+        char **pass_start = argp;
+        int ret = printf_pass(format, &argp, out, &status);
+        if (ret < 0) {
+            return -1;
+        }
+        // stop after \c, when no arguments are left or the format takes none
+        if (ret > 0 || !*argp || argp == pass_start) {
+            break;
+        }
+    }
+    return status;
+}
+
+/**
+ * @brief parses an integer operand of test
+ * 
+ * @param name test or [, for the error message
+ * @param str the operand
+ * @param value the parsed value
+ * @return int 0 on success, -1 after printing an error
+ */
+static int test_integer(const char *name, const char *str, long long *value) {
+    char *end;
+    errno = 0;
+    *value = strtoll(str, &end, 10);
+    while (*end == ' ' || *end == '\t') {
+        end++;
+    }
+    if (end == str || *end || errno) {
+        fprintf(stderr, "%s: invalid integer '%s'\n", name, str);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief evaluates a unary file or string test
+ * 
+ * @return int 1 if true, 0 if false, -1 for an unknown operator
+ */
+static int test_unary(const char *op, const char *arg) {
+    struct stat st;
+    if (op[0] != '-' || !op[1] || op[2]) {
+        return -1;
+    }
+
+    switch (op[1]) {
+    case 'n':
+        return arg[0] != '\0';
+    case 'z':
+        return arg[0] == '\0';
+    case 'e':
+        return stat(arg, &st) == 0;
+    case 'f':
+        return stat(arg, &st) == 0 && S_ISREG(st.st_mode);
+    case 'd':
+        return stat(arg, &st) == 0 && S_ISDIR(st.st_mode);
+    case 'b':
+        return stat(arg, &st) == 0 && S_ISBLK(st.st_mode);
+    case 'c':
+        return stat(arg, &st) == 0 && S_ISCHR(st.st_mode);
+    case 'p':
+        return stat(arg, &st) == 0 && S_ISFIFO(st.st_mode);
+    case 'S':
+        return stat(arg, &st) == 0 && S_ISSOCK(st.st_mode);
+    case 's':
+        return stat(arg, &st) == 0 && st.st_size > 0;
+    case 'h':
+    case 'L':
+        return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    case 'r':
+        return access(arg, R_OK) == 0;
+    case 'w':
+        return access(arg, W_OK) == 0;
+    case 'x':
+        return access(arg, X_OK) == 0;
+    case 't':
+        return isatty(atoi(arg));
+    default:
+        return -1;
+    }
+}
+
+/**
+ * @brief evaluates a binary string, integer or file comparison
+ * 
+ * @return int 1 if true, 0 if false, 2 after an error, -1 for an unknown operator
+ */
+static int test_binary(const char *name, const char *a, const char *op, const char *b) {
+    static const char *int_ops[] = { "-eq", "-ne", "-lt", "-le", "-gt", "-ge" };
+
+    if (!strcmp(op, "=") || !strcmp(op, "==")) {
+        return strcmp(a, b) == 0;
+    }
+    if (!strcmp(op, "!=")) {
+        return strcmp(a, b) != 0;
+    }
+    if (!strcmp(op, "<")) {
+        return strcmp(a, b) < 0;
+    }
+    if (!strcmp(op, ">")) {
+        return strcmp(a, b) > 0;
+    }
+    if (!strcmp(op, "-a")) {
+        return a[0] && b[0];
+    }
+    if (!strcmp(op, "-o")) {
+        return a[0] || b[0];
+    }
+
+    for (int i = 0; i < 6; i++) {
+        if (strcmp(op, int_ops[i])) {
+            continue;
+        }
+        long long x, y;
+        if (test_integer(name, a, &x) < 0 || test_integer(name, b, &y) < 0) {
+            return 2;
+        }
+        int results[] = { x == y, x != y, x < y, x <= y, x > y, x >= y };
+        return results[i];
+    }
+
+    if (!strcmp(op, "-nt") || !strcmp(op, "-ot") || !strcmp(op, "-ef")) {
+        struct stat sa, sb;
+        int have_a = stat(a, &sa) == 0;
+        int have_b = stat(b, &sb) == 0;
+        if (op[1] == 'e') {
+            return have_a && have_b && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+        }
+        if (!have_a || !have_b) {
+            // a missing file is older than any existing one
+            return op[1] == 'n' ? have_a : have_b;
+        }
+        long long diff = (long long)(sa.st_mtim.tv_sec - sb.st_mtim.tv_sec) * 1000000000
+                         + (sa.st_mtim.tv_nsec - sb.st_mtim.tv_nsec);
+        return op[1] == 'n' ? diff > 0 : diff < 0;
+    }
+    return -1;
+}
+
+/**
+ * @brief evaluates test operands following the POSIX rules for up to 4 of them
+ * 
+ * @param name test or [, for error messages
+ * @param argv the operands
+ * @param argc number of operands
+ * @return int exit status, -1 for longer expressions left to the real test
+ */
+static int test_eval(const char *name, char **argv, int argc) {
+    int result;
+
+    switch (argc) {
+    case 0:
+        return 1;
+    case 1:
+        return argv[0][0] ? 0 : 1;
+    case 2:
+        if (!strcmp(argv[0], "!")) {
+            return argv[1][0] ? 1 : 0;
+        }
+        result = test_unary(argv[0], argv[1]);
+        if (result < 0) {
+            fprintf(stderr, "%s: '%s': unary operator expected\n", name, argv[0]);
+            return 2;
+        }
+        return !result;
+    case 3:
+        result = test_binary(name, argv[0], argv[1], argv[2]);
+        if (result >= 0) {
+            return result == 2 ? 2 : !result;
+        }
+        if (!strcmp(argv[0], "!")) {
+            result = test_eval(name, argv + 1, 2);
+            return result == 2 ? 2 : !result;
+        }
+        if (!strcmp(argv[0], "(") && !strcmp(argv[2], ")")) {
+            return test_eval(name, argv + 1, 1);
+        }
+        fprintf(stderr, "%s: '%s': binary operator expected\n", name, argv[1]);
+        return 2;
+    case 4:
+        if (!strcmp(argv[0], "!")) {
+            result = test_eval(name, argv + 1, 3);
+            return result < 0 || result == 2 ? result : !result;
+        }
+        if (!strcmp(argv[0], "(") && !strcmp(argv[3], ")")) {
+            return test_eval(name, argv + 1, 2);
+        }
+        return -1;
+    default:
+        return -1;
+    }
+}
+
+/**
+ * @brief test and [
+ * 
+ * @param args the test command
+ * @param out unused, test prints nothing
+ * @return int exit status, -1 to run the real test instead
+ */
+static int native_test(char **args, OutBuf *out) {
+    (void)out;
+    int argc = 0;
+    while (args[argc + 1]) {
+        argc++;
+    }
+
+    if (!strcmp(args[0], "[")) {
+        if (argc == 0 || strcmp(args[argc], "]")) {
+            fprintf(stderr, "[: missing ']'\n");
+            return 2;
+        }
+        argc--;
+    }
+    return test_eval(args[0], args + 1, argc);
+}
+
+// builtins run by the shell itself, whatever pipeline they are in
+typedef int (*ShellBuiltin)(Command *cmd);
+
+// utilities run in-process instead of fork+exec, -1 means the arguments are
+// left to the real program
+typedef int (*NativeBuiltin)(char **args, OutBuf *out);
+
+typedef struct {
+    const char *name;
+    ShellBuiltin shell;
+    NativeBuiltin native;
+} Builtin;
+
+// perfect hash over the length, first and last char of the builtin names. two
+// names sharing a slot would override a designated initializer, which
+// -Woverride-init from -Wextra turns into a build error
+#define BUILTIN_SLOTS 64
+#define BUILTIN_HASH(len, first, last) (((len) + (first) * 2 + (last)) % BUILTIN_SLOTS)
+#define BUILTIN_ENTRY(name, first, last, shell, native) \
+    [BUILTIN_HASH(sizeof(name) - 1, first, last)] = { name, shell, native }
+
+static const Builtin builtins[BUILTIN_SLOTS] = {
+    BUILTIN_ENTRY("exit", 'e', 't', builtin_exit, NULL),
+    BUILTIN_ENTRY("pwd", 'p', 'd', builtin_pwd, NULL),
+    BUILTIN_ENTRY("cd", 'c', 'd', builtin_cd, NULL),
+    BUILTIN_ENTRY("hash", 'h', 'h', builtin_hash, NULL),
+    BUILTIN_ENTRY("pipesize", 'p', 'e', builtin_pipesize, NULL),
+    BUILTIN_ENTRY("affinity", 'a', 'y', builtin_affinity, NULL),
+    BUILTIN_ENTRY("jobs", 'j', 's', builtin_jobs, NULL),
+    BUILTIN_ENTRY("wait", 'w', 't', builtin_wait, NULL),
+    BUILTIN_ENTRY("history", 'h', 'y', builtin_history, NULL),
+    BUILTIN_ENTRY("fg", 'f', 'g', builtin_fg, NULL),
+    BUILTIN_ENTRY("bg", 'b', 'g', builtin_bg, NULL),
+    BUILTIN_ENTRY("kill", 'k', 'l', builtin_kill, NULL),
+    BUILTIN_ENTRY("export", 'e', 't', builtin_export, NULL),
+    BUILTIN_ENTRY("unset", 'u', 't', builtin_unset, NULL),
+#ifndef SSHELL_NO_STATS
+    BUILTIN_ENTRY("stats", 's', 's', builtin_stats, NULL),
+#endif
+    BUILTIN_ENTRY("true", 't', 'e', NULL, native_true),
+    BUILTIN_ENTRY("false", 'f', 'e', NULL, native_false),
+    BUILTIN_ENTRY("echo", 'e', 'o', NULL, native_echo),
+    BUILTIN_ENTRY("printf", 'p', 'f', NULL, native_printf),
+    BUILTIN_ENTRY("test", 't', 't', NULL, native_test),
+    BUILTIN_ENTRY("[", '[', '[', NULL, native_test),
+};
+
+/**
+ * @brief finds a builtin in constant time
+ * 
+ * @param name command name
+ * @return const Builtin* the builtin, NULL if name isn't one
+ */
+const Builtin *find_builtin(const char *name) {
+    size_t len = strlen(name);
+    if (len == 0) {
+        return NULL;
+    }
+    const Builtin *builtin = &builtins[BUILTIN_HASH(len, (unsigned char)name[0],
+                                                    (unsigned char)name[len - 1])];
+    return builtin->name && !strcmp(builtin->name, name) ? builtin : NULL;
+}
+
+// tokens produced by the command line lexer
+typedef enum {
+    TOK_END,
+    TOK_WORD,
+    TOK_PIPE,
+    TOK_LT,
+    TOK_GT,
+    TOK_APPEND,
+    TOK_AMP,
+    TOK_SEMI,
+    TOK_AND,
+    TOK_OR
+} TokenType;
+
+/**
+ * @brief reads the next token of the line, metacharacters don't need surrounding spaces
+ * 
+ * @param pos read position in the line, advanced past the token
+ * @param start set to the first char of a TOK_WORD
+ * @param len set to the length of a TOK_WORD
+ * @return TokenType type of the token
+ */
+static TokenType next_token(const char **pos, const char **start, size_t *len) {
+    const char *p = *pos;
+
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+
+    TokenType type;
+    switch (*p) {
+    case '\0':
+        *pos = p;
+        return TOK_END;
+    case '|':
+        if (p[1] == '|') {
+            *pos = p + 2;
+            return TOK_OR;
+        }
+        type = TOK_PIPE;
+        break;
+    case ';':
+        type = TOK_SEMI;
+        break;
+    case '<':
+        type = TOK_LT;
+        break;
+    case '>':
+        if (p[1] == '>') {
+            *pos = p + 2;
+            return TOK_APPEND;
+        }
+        type = TOK_GT;
+        break;
+    case '&':
+        if (p[1] == '&') {
+            *pos = p + 2;
+            return TOK_AND;
+        }
+        type = TOK_AMP;
+        break;
+    default:
+        *start = p;
+        while (*p && !strchr(" \t|<>&;", *p)) {
+            p++;
+        }
+        *len = p - *start;
+        *pos = p;
+        return TOK_WORD;
+    }
+
+    *pos = p + 1;
+    return type;
+}
+
+/**
+ * @brief expands the $ at p: $NAME, ${NAME}, $? and $$. a $ that starts
+ *        none of them is kept as it is
+ * 
+ * @param p the $
+ * @param end end of the word
+ * @param used set to the length of what was expanded
+ * @param num room for a number printed by $? or $$
+ * @return const char* the expansion, "" for an unset variable
+ */
+static const char *expand_var(const char *p, const char *end, size_t *used, char num[16]) {
+    if (p + 1 < end && (p[1] == '?' || p[1] == '$')) {
+        snprintf(num, 16, "%d", p[1] == '?' ? last_status : (int)getpid());
+        parse_expansion = EXPAND_VOLATILE;  // a daemon session has a pid of its own
+        *used = 2;
+        return num;
+    }
+
+    int braced = p + 1 < end && p[1] == '{';
+    const char *name = p + 1 + braced;
+    size_t len = var_name_len(name, end);
+    if (!len || (braced && (name + len == end || name[len] != '}'))) {
+        *used = 1;
+        return "$";
+    }
+    *used = 1 + braced + len + braced;
+    if (parse_expansion == EXPAND_NONE) {
+        parse_expansion = EXPAND_ENV;
+    }
+    const char *value = env_get(name, len);
+    return value ? value : "";
+}
+
+/**
+ * @brief copies a word into the arena with its variables expanded
+ * 
+ * @param arena storage for the word
+ * @param word the word as it is in the line
+ * @param len its length
+ * @return char* the expanded word
+ */
+static char *expand_word(Arena *arena, const char *word, size_t len) {
+    const char *end = word + len;
+    if (!memchr(word, '$', len)) {
+        return arena_strndup(arena, word, len);
+    }
+
+    // measure, then copy
+    char num[16];
+    size_t used, size = 0;
+    for (const char *p = word; p < end; ) {
+        if (*p == '$') {
+            size += strlen(expand_var(p, end, &used, num));
+            p += used;
+        } else {
+            size++;
+            p++;
+        }
+    }
+    char *out = arena_alloc(arena, size + 1);
+    char *w = out;
+    for (const char *p = word; p < end; ) {
+        if (*p == '$') {
+            w = stpcpy(w, expand_var(p, end, &used, num));
+            p += used;
+        } else {
+            *w++ = *p++;
+        }
+    }
+    *w = '\0';
+    return out;
+}
+
+/**
+ * @brief appends an argument to a command, growing its vector in the arena
+ * 
+ * @param arena storage of the line
+ * @param cmd the command
+ * @param arg the argument
+ */
+static void add_arg(Arena *arena, Command *cmd, char *arg) {
+    // keep room for the NULL terminator
+    if (cmd->num_args + 1 == cmd->args_cap) {
+        char **grown = arena_alloc(arena, 2 * cmd->args_cap * sizeof(char *));
+        memcpy(grown, cmd->args, cmd->args_cap * sizeof(char *));
+        cmd->args = grown;
+        cmd->args_cap *= 2;
+    }
+    cmd->args[cmd->num_args++] = arg;
+    cmd->args[cmd->num_args] = NULL;
+}
+
+/**
+ * @brief tells if a word is a glob pattern, a [ only counts with a ] after it
+ */
+static int has_glob_meta(const char *word, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (word[i] == '*' || word[i] == '?' || (word[i] == '[' && memchr(word + i + 1, ']', len - i - 1))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int cmp_name(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * @brief lists a directory for glob expansion. the directory is looked up with
+ *        fstatat and its cached names are used while its mtime is unchanged,
+ *        otherwise it is read again into its slot or the least recently used one
+ * 
+ * @param dir the directory, "" for the current one
+ * @return GlobDir* its sorted names, NULL if it isn't a readable directory
+ */
+static GlobDir *glob_dir(const char *dir) {
+    const char *path = *dir ? dir : ".";
+    struct stat st;
+    if (fstatat(AT_FDCWD, path, &st, 0) < 0 || !S_ISDIR(st.st_mode)) {
+        return NULL;
+    }
+
+    GlobDir *slot = NULL;
+    for (int i = 0; i < GLOB_CACHE_DIRS; i++) {
+        GlobDir *gd = &glob_cache[i];
+        if (gd->names && gd->dev == st.st_dev && gd->ino == st.st_ino) {
+            if (!gd->racy && gd->mtime.tv_sec == st.st_mtim.tv_sec && gd->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+                gd->used = ++glob_tick;
+                return gd;
+            }
+            slot = gd;
+            break;
+        }
+        if (!slot || (slot->names && (!gd->names || gd->used < slot->used))) {
+            slot = gd;
+        }
+    }
+
+    struct timespec listed;
+    clock_gettime(CLOCK_REALTIME, &listed);
+    DIR *d = opendir(path);
+    if (!d) {
+        return NULL;
+    }
+    size_t size = 0, cap = 4096, count = 0;
+    char *names = malloc(cap);
+    if (!names) {
+        perror("malloc");
+        exit(1);
+    }
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+            continue;
+        }
+        size_t n = strlen(ent->d_name) + 1;
+        if (size + n > cap) {
+            while (size + n > cap) {
+                cap *= 2;
+            }
+            names = realloc(names, cap);
+            if (!names) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        memcpy(names + size, ent->d_name, n);
+        size += n;
+        count++;
+    }
+    closedir(d);
+
+    char **sorted = malloc((count ? count : 1) * sizeof(char *));
+    if (!sorted) {
+        perror("malloc");
+        exit(1);
+    }
+    char *name = names;
+    for (size_t i = 0; i < count; i++) {
+        sorted[i] = name;
+        name += strlen(name) + 1;
+    }
+    qsort(sorted, count, sizeof(char *), cmp_name);
+
+    free(slot->names);
+    free(slot->sorted);
+    slot->dev = st.st_dev;
+    slot->ino = st.st_ino;
+    slot->mtime = st.st_mtim;
+    // a file added later in the same tick of a coarse clock leaves the mtime as it is
+    slot->racy = st.st_mtim.tv_sec >= listed.tv_sec - 1;
+    slot->names = names;
+    slot->sorted = sorted;
+    slot->count = count;
+    slot->used = ++glob_tick;
+    return slot;
+}
+
+/**
+ * @brief narrows the names a pattern can match to those starting with its
+ *        literal prefix, found by binary search in the sorted names
+ * 
+ * @param gd the directory
+ * @param comp the pattern
+ * @param first set to the first candidate
+ * @return size_t the end of the candidates
+ */
+static size_t glob_range(const GlobDir *gd, const char *comp, size_t *first) {
+    size_t prefix = strcspn(comp, "*?[\\");
+    size_t lo = 0, hi = gd->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strncmp(gd->sorted[mid], comp, prefix) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *first = lo;
+    size_t end = lo;
+    while (end < gd->count && !strncmp(gd->sorted[end], comp, prefix)) {
+        end++;
+    }
+    return end;
+}
+
+/**
+ * @brief adds the paths matching the rest of a pattern to a command, sorted.
+ *        components are matched one at a time so every directory on the way
+ *        is listed through the cache
+ * 
+ * @param arena storage of the line
+ * @param cmd the command
+ * @param path the matched path so far, len bytes of a PATH_MAX buffer
+ * @param len its length
+ * @param pattern what is left of the pattern
+ * @return int number of paths added
+ */
+static int glob_walk(Arena *arena, Command *cmd, char *path, size_t len, const char *pattern) {
+    const char *slash = strchr(pattern, '/');
+    size_t comp_len = slash ? (size_t)(slash - pattern) : strlen(pattern);
+    if (len + comp_len + 2 > PATH_MAX) {
+        return 0;
+    }
+
+    if (!has_glob_meta(pattern, comp_len)) {
+        memcpy(path + len, pattern, comp_len + (slash != NULL));
+        len += comp_len + (slash != NULL);
+        path[len] = '\0';
+        if (slash) {
+            return glob_walk(arena, cmd, path, len, slash + 1);
+        }
+        struct stat st;
+        if (fstatat(AT_FDCWD, path, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            return 0;
+        }
+        add_arg(arena, cmd, arena_strdup(arena, path));
+        return 1;
+    }
+
+    char comp[NAME_MAX + 1];
+    if (comp_len > NAME_MAX) {
+        return 0;
+    }
+    memcpy(comp, pattern, comp_len);
+    comp[comp_len] = '\0';
+    GlobDir *gd = glob_dir(path);
+    if (!gd) {
+        return 0;
+    }
+
+    int added = 0;
+    size_t first, end = glob_range(gd, comp, &first);
+    if (!slash) {
+        for (size_t i = first; i < end; i++) {
+            if (!fnmatch(comp, gd->sorted[i], FNM_PERIOD)) {
+                char *arg = arena_alloc(arena, len + strlen(gd->sorted[i]) + 1);
+                memcpy(arg, path, len);
+                strcpy(arg + len, gd->sorted[i]);
+                add_arg(arena, cmd, arg);
+                added++;
+            }
+        }
+        return added;
+    }
+
+    // walking into the matches lists other directories, which may reuse this slot
+    size_t num_matches = 0;
+    char **matches = arena_alloc(arena, (end > first ? end - first : 1) * sizeof(char *));
+    for (size_t i = first; i < end; i++) {
+        if (!fnmatch(comp, gd->sorted[i], FNM_PERIOD)) {
+            matches[num_matches++] = arena_strdup(arena, gd->sorted[i]);
+        }
+    }
+    for (size_t i = 0; i < num_matches; i++) {
+        size_t n = strlen(matches[i]);
+        if (len + n + 2 > PATH_MAX) {
+            continue;
+        }
+        memcpy(path + len, matches[i], n);
+        path[len + n] = '/';
+        path[len + n + 1] = '\0';
+        added += glob_walk(arena, cmd, path, len + n + 1, slash + 1);
+    }
+    path[len] = '\0';
+    return added;
+}
+
+/**
+ * @brief adds a word to a command's args, replaced by the paths it matches when
+ *        it is a glob pattern. a pattern matching nothing is kept as it is
+ * 
+ * @param arena storage of the line
+ * @param cmd the command
+ * @param word the expanded word
+ */
+static void add_glob_arg(Arena *arena, Command *cmd, char *word) {
+    if (!has_glob_meta(word, strlen(word))) {
+        add_arg(arena, cmd, word);
+        return;
+    }
+    // the directories can change under a cached line, glob_dir caches their names instead
+    parse_expansion = EXPAND_VOLATILE;
+    char path[PATH_MAX];
+    path[0] = '\0';
+    if (!glob_walk(arena, cmd, path, 0, word)) {
+        add_arg(arena, cmd, word);
+    }
+}
+
+/**
+ * @brief closes the redirection fds the parser opened for a command line
+ * 
+ * @param commands the parsed commands
+ * @param num_commands number of commands
+ */
+void close_command_fds(Command *commands, int num_commands) {
+    for (int i = 0; i < num_commands; i++) {
+        if (commands[i].input_fd >= 0) {
+            close(commands[i].input_fd);
+            commands[i].input_fd = -1;
+        }
+        if (commands[i].output_fd >= 0) {
+            close(commands[i].output_fd);
+            commands[i].output_fd = -1;
+        }
+    }
+}
+
+/**
+ * @brief opens the output file of a stage that ends a pipeline or a fan-out
+ *        branch, truncated for > and appended to for >>. large output mode
+ *        reserves room for the hint up front so the file grows unfragmented
+ *
+ * @param cmd the stage, nothing is done without an output file
+ * @return int 0 on success, -1 on error
+ */
+static int open_output_file(Command *cmd) {
+    if (!cmd->output_f) {
+        return 0;
+    }
+    int mode = cmd->append ? O_APPEND : O_TRUNC;
+    STAT_START(open_start);
+    cmd->output_fd = open(cmd->output_f, O_WRONLY | O_CREAT | mode | O_CLOEXEC, 0644);
+    STAT_STOP(PHASE_OPEN, open_start);
+    STAT_SYSCALL(SYS_OPEN);
+    if (cmd->output_fd == -1) {
+        fprintf(stderr, "Error: cannot open output file\n");
+        return -1;
+    }
+
+    struct stat st;
+    if (output_hint && fstat(cmd->output_fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        // best effort, KEEP_SIZE leaves the size alone for readers and appenders
+        fallocate(cmd->output_fd, FALLOC_FL_KEEP_SIZE, st.st_size, output_hint);
+        posix_fadvise(cmd->output_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    return 0;
+}
+
+/**
+ * @brief checks the pipeline ending at a list operator or at the end of the
+ *        line, and notes where its text ends
+ * 
+ * @param line the line being parsed
+ * @param head first stage of the pipeline, NULL if it has none
+ * @param cmd its last stage
+ * @param end where its text stops
+ * @param branch fan-out branch being parsed
+ * @param fan_closed the fan-out was closed
+ * @param open_files open its output file now, later pipelines of a list open theirs when they run
+ * @return int 0 if it is complete, -1 on error
+ */
+static int end_pipeline(const char *line, Command *head, Command *cmd, const char *end, int branch, int fan_closed,
+                        int open_files) {
+    if (branch && !fan_closed) {
+        fprintf(stderr, "Error: unterminated fan-out\n");
+        return -1;
+    }
+
+    // a trailing |, a lone & or an operator without a pipeline leaves a stage without a command
+    if (!cmd) {
+        fprintf(stderr, "Error: missing command\n");
+        return -1;
+    }
+
+    if (open_files && !fan_closed && open_output_file(cmd) < 0) {
+        return -1;
+    }
+
+    while (end > line + head->text_start && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+    }
+    head->text_len = end - (line + head->text_start);
+    return 0;
+}
+
+/**
+ * @brief parses command line and returns number of commands. commands are stored in array of Command structs.
+ *        the line is lexed in a single pass and tokens are copied straight into their Command slot,
+ *        errors are reported for the leftmost problem. a pipeline may end in a fan-out,
+ *        a | { b , c | d } feeds the output of a to both b and c | d. pipelines are chained
+ *        into a list by ; && and ||, each list_op on the first stage of a pipeline. only the
+ *        first pipeline has its files opened, the others may never run, see open_command_files
+ * 
+ * @param line line to process, left untouched
+ * @param commands set to the commands struct list, allocated in the arena
+ * @param arena storage for the parsed tokens
+ * @return int num commands, 0 for a blank line or -1 if invalid
+ */
+int parse_command(const char *line, Command **commands, Arena *arena) {
+    const char *pos = line;
+    const char *word = NULL;
+    size_t word_len = 0;
+    int num_commands = 0;
+    int commands_cap = INITIAL_COMMANDS;
+    int background = 0;
+    TokenType pending = TOK_END;  // redirection waiting for its file name
+    Command *cmd = NULL;
+    int head = -1;  // first stage of the pipeline being parsed, -1 before its first word
+    int list_op = LIST_SEQ;  // how that pipeline follows the previous one
+    int open_files = 1;  // still in the first pipeline
+    int branch = 0;  // fan-out branch being parsed, 0 before the {
+    int fan_closed = 0;  // the } was seen, only & may follow
+
+    *commands = arena_alloc(arena, commands_cap * sizeof(Command));
+    parse_expansion = EXPAND_NONE;
+
+    while (1) {
+        const char *tok_pos = pos;
+        TokenType tok = next_token(&pos, &word, &word_len);
+
+        // the background sign may only be the last token
+        if (background && tok != TOK_END) {
+            fprintf(stderr, "Error: mislocated background sign\n");
+            goto error;
+        }
+        if (fan_closed && tok != TOK_END && tok != TOK_AMP && tok != TOK_SEMI
+            && tok != TOK_AND && tok != TOK_OR) {
+            fprintf(stderr, "Error: mislocated fan-out\n");
+            goto error;
+        }
+
+        // { , and } are only operators as words of their own where a fan-out can be
+        if (tok == TOK_WORD && pending == TOK_END && word_len == 1 && strchr("{,}", *word)) {
+            if (*word == '{' && !cmd && head >= 0 && !branch) {
+                branch = 1;  // right after a |
+                continue;
+            }
+            if (*word != '{' && branch && !fan_closed) {
+                if (!cmd) {
+                    fprintf(stderr, "Error: missing command\n");
+                    goto error;
+                }
+                if (open_files && open_output_file(cmd) < 0) {
+                    goto error;
+                }
+                if (*word == ',') {
+                    branch++;
+                    cmd = NULL;
+                } else {
+                    fan_closed = 1;
+                }
+                continue;
+            }
+        }
+
+        if (tok == TOK_WORD) {
+            // a word that expands to nothing isn't a word, like in other shells
+            char *text = expand_word(arena, word, word_len);
+            if (!*text && pending == TOK_END) {
+                continue;
+            }
+            if (!cmd) {
+                // first word of a new stage
+                if (num_commands == commands_cap) {
+                    Command *grown = arena_alloc(arena, 2 * commands_cap * sizeof(Command));
+                    memcpy(grown, *commands, commands_cap * sizeof(Command));
+                    *commands = grown;
+                    commands_cap *= 2;
+                }
+                cmd = &(*commands)[num_commands++];
+                cmd->args_cap = INITIAL_ARGS;
+                cmd->args = arena_alloc(arena, cmd->args_cap * sizeof(char *));
+                cmd->num_args = 0;
+                cmd->input_f = NULL;
+                cmd->output_f = NULL;
+                cmd->input_fd = -1;
+                cmd->output_fd = -1;
+                cmd->exec_path = NULL;
+                cmd->cpus = NULL;
+                cmd->branch = branch;
+                cmd->append = 0;
+                cmd->pgid = 0;
+                cmd->take_tty = 0;
+                cmd->list_op = LIST_NONE;
+                cmd->text_start = 0;
+                cmd->text_len = 0;
+                cmd->background = 0;
+                if (head < 0) {
+                    head = num_commands - 1;
+                    cmd->list_op = list_op;
+                    cmd->text_start = word - line;
+                }
+            }
+
+            if (pending == TOK_LT && !open_files) {
+                cmd->input_f = text;
+            } else if (pending == TOK_LT) {
+                cmd->input_f = text;
+                if (cmd->input_fd >= 0) {
+                    close(cmd->input_fd);  // only the last < is used
+                }
+                STAT_START(open_start);
+                cmd->input_fd = open(cmd->input_f, O_RDONLY | O_CLOEXEC);
+                STAT_STOP(PHASE_OPEN, open_start);
+                STAT_SYSCALL(SYS_OPEN);
+                if (cmd->input_fd == -1) {
+                    fprintf(stderr, "Error: cannot open input file\n");
+                    goto error;
+                }
+            } else if (pending == TOK_GT) {
+                // opened once we know no pipe follows
+                cmd->output_f = text;
+            } else {
+                add_glob_arg(arena, cmd, text);
+            }
+            pending = TOK_END;
+            continue;
+        }
+
+        // a redirection needs a file name right after it
+        if (pending == TOK_LT) {
+            fprintf(stderr, "Error: no input file\n");
+            goto error;
+        }
+        if (pending == TOK_GT) {
+            fprintf(stderr, "Error: no output file\n");
+            goto error;
+        }
+
+        if (tok == TOK_END) {
+            break;
+        }
+
+        if (tok == TOK_AMP) {
+            background = 1;
+            continue;
+        }
+
+        // ; && and || end the pipeline, a ; may also end the line
+        if (tok == TOK_SEMI || tok == TOK_AND || tok == TOK_OR) {
+            if (end_pipeline(line, head >= 0 ? &(*commands)[head] : NULL, cmd, tok_pos + strspn(tok_pos, " \t"),
+                             branch, fan_closed, open_files) < 0) {
+                goto error;
+            }
+            open_files = 0;
+            cmd = NULL;
+            head = -1;
+            list_op = tok == TOK_SEMI ? LIST_SEQ : tok == TOK_AND ? LIST_AND : LIST_OR;
+            branch = 0;
+            fan_closed = 0;
+            continue;
+        }
+
+        // | < > >> all need a command before them
+        if (!cmd) {
+            fprintf(stderr, "Error: missing command\n");
+            goto error;
+        }
+
+        if (tok == TOK_LT) {
+            if (cmd != &(*commands)[head]) {
+                fprintf(stderr, "Error: mislocated input redirection\n");
+                goto error;
+            }
+            pending = TOK_LT;
+        } else if (tok == TOK_GT || tok == TOK_APPEND) {
+            pending = TOK_GT;
+            cmd->append = tok == TOK_APPEND;
+        } else {  // TOK_PIPE
+            if (cmd->output_f) {
+                fprintf(stderr, "Error: mislocated output redirection\n");
+                goto error;
+            }
+            cmd = NULL;
+        }
+    }
+
+    if (num_commands == 0 && !background) {
+        return 0;  // blank line
+    }
+    if (head < 0 && !background && list_op == LIST_SEQ) {
+        return num_commands;  // a ; may end the line
+    }
+    if (end_pipeline(line, head >= 0 ? &(*commands)[head] : NULL, cmd, pos, branch, fan_closed, open_files) < 0) {
+        goto error;
+    }
+
+    // only the last command can be a background job
+    cmd->background = background;
+
+    return num_commands;
+
+error:
+    // an input file may already be open
+    close_command_fds(*commands, num_commands);
+    return -1;
+}
+
+/**
+ * @brief debug function to print out command struct list
+ * 
+ * @param commands commands list
+ * @param num_jobs number of commands
+ */
+void preview_command_list(Command commands[], int num_jobs) {
+    for (int i = 0; i < num_jobs; i++) {
+        printf("----------------------------\n");
+        printf("Command %d:\n", i + 1);
+        printf("\tArgs: ");
+        for (int j = 0; commands[i].args[j] != NULL; j++) {
+            printf("{%s} ", commands[i].args[j]);
+        }
+        printf("\n");
+        if (commands[i].input_f)
+            printf("\tInput: %s\n", commands[i].input_f);
+        if (commands[i].output_f)
+            printf("\tOutput: %s\n", commands[i].output_f);
+    }
+    printf("----------------------------\n");
+}
+
+/**
+ * @brief switches the shell to batch mode: completion lines are coalesced on
+ *        stderr until the buffer fills or the shell exits
+ */
+void enter_batch_mode(void) {
+    batch_mode = 1;
+    setvbuf(stderr, status_buf, _IOFBF, sizeof(status_buf));
+}
+
+/**
+ * @brief makes the shell a process group leader owning the terminal. it ignores
+ *        the signals the terminal sends to background groups and Ctrl-Z
+ */
+void init_job_control(void) {
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    setpgid(0, 0);  // fails for a session leader, which leads its group already
+    shell_pgid = getpgrp();
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+    job_tty = 1;
+}
+
+/**
+ * @brief picks the fds a pipeline stage reads and writes
+ * 
+ * @param cmd command of this stage
+ * @param i index of the stage in the pipeline
+ * @param num_commands number of stages in the pipeline
+ * @param pipe_fds the num_commands - 1 pipes linking the stages
+ * @param in_fd set to the fd for stdin, -1 keeps the shell's
+ * @param out_fd set to the fd for stdout, -1 keeps the shell's
+ */
+static void stage_fds(Command *cmd, int i, int num_commands, int pipe_fds[][2],
+                      int *in_fd, int *out_fd) {
+    // input redirection, or the previous pipe if not the first command
+    *in_fd = -1;
+    if (cmd->input_fd >= 0) {
+        *in_fd = cmd->input_fd;
+    } else if (i > 0) {
+        *in_fd = pipe_fds[i - 1][0];
+    }
+
+    // output redirection, or the next pipe if not the last command of its pipeline or branch
+    *out_fd = -1;
+    if (cmd->output_fd >= 0) {
+        *out_fd = cmd->output_fd;
+    } else if (i < num_commands - 1 && cmd[1].branch == cmd->branch) {
+        *out_fd = pipe_fds[i][1];
+    }
+}
+
+/**
+ * @brief wires stdin/stdout of one pipeline stage and closes every pipe fd. only
+ *        async-signal-safe calls are made so it can run in a vfork child
+ * 
+ * @param cmd command of this stage
+ * @param i index of the stage in the pipeline
+ * @param num_commands number of stages in the pipeline
+ * @param pipe_fds the num_commands - 1 pipes linking the stages
+ */
+static void setup_stage_fds(Command *cmd, int i, int num_commands, int pipe_fds[][2]) {
+    // the parser's fds are close-on-exec, only the dup2'd copies survive exec
+    int in_fd, out_fd;
+    stage_fds(cmd, i, num_commands, pipe_fds, &in_fd, &out_fd);
+    if (in_fd >= 0) {
+        dup2(in_fd, STDIN_FILENO);
+    }
+    if (out_fd >= 0) {
+        dup2(out_fd, STDOUT_FILENO);
+    }
+
+    // close all fds from piping
+    for (int j = 0; j < num_commands - 1; j++) {
+        close(pipe_fds[j][0]);
+        close(pipe_fds[j][1]);
+    }
+}
+
+/**
+ * @brief gives a child the job control signals the interactive shell ignores back
+ */
+static void restore_job_signals(void) {
+    if (job_tty) {
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+    }
+}
+
+/**
+ * @brief child side of a launch: joins the process group of the stage. the
+ *        terminal is taken while stdin is still the shell's
+ */
+static void join_stage_group(Command *cmd) {
+    // the parent calls setpgid too, whichever runs first wins the race with a
+    // signal to the group
+    setpgid(0, cmd->pgid);
+    if (cmd->take_tty && !cmd->pgid) {
+        tcsetpgrp(STDIN_FILENO, getpid());
+    }
+    restore_job_signals();
+}
+
+/**
+ * @brief child side of a launch once the fds are set up: exec, never returns
+ */
+static void exec_command(Command *cmd) {
+    if (cmd->cpus) {
+        sched_setaffinity(0, sizeof(cpu_set_t), cmd->cpus);
+    }
+    sigprocmask(SIG_SETMASK, &child_sigmask, NULL);
+    execv(cmd->exec_path, cmd->args);
+    // the cached path went away, tell the parent and search PATH again
+    if (errno == ENOENT && cmd->exec_path != cmd->args[0]) {
+        vfork_exec_errno = ENOENT;
+        execvp(cmd->args[0], cmd->args);
+    }
+    // unbuffered write and _exit so batch mode status lines held in
+    // the inherited stderr buffer are not flushed a second time
+    dprintf(STDERR_FILENO, "Error: command not found\n");
+    _exit(1);
+}
+
+/**
+ * @brief child side of a launch: join the process group, set up the fds and
+ *        exec, never returns
+ */
+static void exec_stage(Command *cmd, int i, int num_commands, int pipe_fds[][2]) {
+    join_stage_group(cmd);
+    setup_stage_fds(cmd, i, num_commands, pipe_fds);
+    exec_command(cmd);
+}
+
+/**
+ * @brief worker side of the pool: waits for one request and becomes that
+ *        stage, running a native builtin itself or exec'ing. never returns
+ * 
+ * @param fd worker end of the control socket
+ */
+static void worker_main(int fd) {
+    static char buf[WORKER_MSG_MAX];
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = { buf, sizeof(buf) };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t len;
+    do {
+        len = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (len < 0 && errno == EINTR);
+    if (len < (ssize_t)sizeof(WorkerRequest)) {
+        _exit(0);  // the shell went away
+    }
+    WorkerRequest req;
+    memcpy(&req, buf, sizeof(req));
+    int fds[2] = { -1, -1 };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(fds, CMSG_DATA(cmsg), cmsg->cmsg_len - CMSG_LEN(0));
+    }
+    int in_fd = req.has_stdin ? fds[0] : -1;
+    int out_fd = req.has_stdout ? fds[req.has_stdin] : -1;
+
+    // the exec path, then the arguments
+    char **args = malloc((req.num_args + 1) * sizeof(char *));
+    if (!args) {
+        _exit(1);
+    }
+    char *next = buf + sizeof(req);
+    Command cmd = { 0 };
+    cmd.exec_path = next;
+    next += strlen(next) + 1;
+    for (int i = 0; i < req.num_args; i++) {
+        args[i] = next;
+        next += strlen(next) + 1;
+    }
+    args[req.num_args] = NULL;
+    cmd.args = args;
+    cmd.num_args = req.num_args;
+    cmd.pgid = req.pgid;
+    cmd.take_tty = req.take_tty;
+    cmd.cpus = req.has_cpus ? &req.cpus : NULL;
+
+    join_stage_group(&cmd);
+    if (in_fd >= 0) {
+        dup2(in_fd, STDIN_FILENO);
+        close(in_fd);
+    }
+    if (out_fd >= 0) {
+        dup2(out_fd, STDOUT_FILENO);
+        close(out_fd);
+    }
+    close(fd);
+
+    // a native builtin needs no exec, SIGPIPE is unblocked so it dies like the real program
+    const Builtin *builtin = find_builtin(args[0]);
+    if (builtin && builtin->native) {
+        if (cmd.cpus) {
+            sched_setaffinity(0, sizeof(cpu_set_t), cmd.cpus);
+        }
+        sigprocmask(SIG_SETMASK, &child_sigmask, NULL);
+        OutBuf out = { NULL, 0, 0, &line_arena, 0 };
+        int ret = builtin->native(args, &out);
+        if (ret >= 0) {
+            _exit(write_all(STDOUT_FILENO, out.data, out.len) && !ret ? 1 : ret);
+        }
+    }
+    exec_command(&cmd);
+}
+
+/**
+ * @brief tops the worker pool up to its size. forked children inherit every
+ *        fd the shell holds, so this only runs while the shell holds no pipe
+ */
+void pool_refill(void) {
+    while (worker_pool.count < worker_pool.size) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+            return;  // stages are forked as usual until there are fds again
+        }
+        STAT_SYSCALL(SYS_FORK);
+        pid_t pid = fork();
+        if (pid < 0) {
+            close(sv[0]);
+            close(sv[1]);
+            return;
+        }
+        if (pid == 0) {
+            // the shell ends of the other workers, or they never see EOF when the shell exits
+            close(sv[0]);
+            for (int i = 0; i < worker_pool.count; i++) {
+                close(worker_pool.fds[i]);
+            }
+            worker_main(sv[1]);
+        }
+        close(sv[1]);
+        worker_pool.pids[worker_pool.count] = pid;
+        worker_pool.fds[worker_pool.count] = sv[0];
+        worker_pool.count++;
+    }
+}
+
+/**
+ * @brief lets every idle worker go, they exit once their socket is closed, and
+ *        the pool is filled again with the environment and cwd as they are now
+ */
+void pool_drain(void) {
+    while (worker_pool.count > 0) {
+        close(worker_pool.fds[--worker_pool.count]);
+    }
+}
+
+/**
+ * @brief hands a stage to an idle worker, which becomes the stage
+ * 
+ * @param cmd command of this stage, resolved through the command hash
+ * @param in_fd fd for its stdin, -1 keeps the shell's
+ * @param out_fd fd for its stdout, -1 keeps the shell's
+ * @return pid_t pid of the worker, -1 if the stage has to be forked
+ */
+pid_t pool_dispatch(Command *cmd, int in_fd, int out_fd) {
+    static char buf[WORKER_MSG_MAX];
+    if (worker_pool.count == 0) {
+        return -1;
+    }
+
+    WorkerRequest req;
+    memset(&req, 0, sizeof(req));
+    req.pgid = cmd->pgid;
+    req.take_tty = cmd->take_tty;
+    req.num_args = cmd->num_args;
+    req.has_stdin = in_fd >= 0;
+    req.has_stdout = out_fd >= 0;
+    if (cmd->cpus) {
+        req.has_cpus = 1;
+        req.cpus = *cmd->cpus;
+    }
+    size_t len = sizeof(req);
+    memcpy(buf, &req, len);
+    for (int i = -1; i < cmd->num_args; i++) {
+        const char *str = i < 0 ? cmd->exec_path : cmd->args[i];
+        size_t n = strlen(str) + 1;
+        if (len + n > sizeof(buf)) {
+            return -1;
+        }
+        memcpy(buf + len, str, n);
+        len += n;
+    }
+
+    int fds[2], num_fds = 0;
+    if (in_fd >= 0) {
+        fds[num_fds++] = in_fd;
+    }
+    if (out_fd >= 0) {
+        fds[num_fds++] = out_fd;
+    }
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = { buf, len };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (num_fds > 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(num_fds * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(num_fds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, num_fds * sizeof(int));
+    }
+
+    // a worker that died is reaped as an unknown pid, the stage is forked instead
+    worker_pool.count--;
+    int fd = worker_pool.fds[worker_pool.count];
+    pid_t pid = worker_pool.pids[worker_pool.count];
+    ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    close(fd);
+    return sent == (ssize_t)len ? pid : -1;
+}
+
+/**
+ * @brief launches one pipeline stage. vfork shares the parent's address space
+ *        so the launch cost doesn't grow with the shell's RSS, fork is only
+ *        used if vfork fails or SSHELL_LAUNCH=fork is set
+ * 
+ * @param cmd command of this stage
+ * @param i index of the stage in the pipeline
+ * @param num_commands number of stages in the pipeline
+ * @param pipe_fds the num_commands - 1 pipes linking the stages
+ * @return pid_t pid of the child
+ */
+pid_t spawn_stage(Command *cmd, int i, int num_commands, int pipe_fds[][2]) {
+    pid_t pid = -1;
+
+    if (launch_mode == LAUNCH_VFORK) {
+        vfork_exec_errno = 0;
+        STAT_SYSCALL(SYS_FORK);
+        pid = vfork();
+        if (pid == 0) {
+            exec_stage(cmd, i, num_commands, pipe_fds);
+        }
+        if (pid > 0 && vfork_exec_errno == ENOENT) {
+            hash_forget(cmd->args[0]);
+        }
+    }
+    if (pid < 0) {
+        STAT_SYSCALL(SYS_FORK);
+        pid = fork();
+        if (pid == 0) {
+            exec_stage(cmd, i, num_commands, pipe_fds);
+        }
+    }
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    return pid;
+}
+
+/**
+ * @brief resolves a stage through the command hash and launches it, an unknown
+ *        command fails with status 1 without forking
+ * 
+ * @param cmd command of this stage
+ * @param i index of the stage in the pipeline
+ * @param num_commands number of stages in the pipeline
+ * @param pipe_fds the num_commands - 1 pipes linking the stages
+ * @param pid set to the pid of the child, stays 0 if nothing was launched
+ * @param status set to 1 if the command wasn't found
+ * @param pgid process group of the pipeline, set by the first stage launched
+ */
+void launch_stage(Command *cmd, int i, int num_commands, int pipe_fds[][2], pid_t *pid, int *status,
+                  pid_t *pgid) {
+    STAT_START(lookup_start);
+    cmd->exec_path = lookup_command(cmd->args[0]);
+    STAT_STOP(PHASE_LOOKUP, lookup_start);
+    // only a vfork launch tells the parent that exec found no file at a cached
+    // path, a path handed to fork or a worker is checked before it goes out
+    if (cmd->exec_path && cmd->exec_path != cmd->args[0]
+        && (launch_mode != LAUNCH_VFORK || worker_pool.count > 0) && access(cmd->exec_path, X_OK) < 0) {
+        hash_forget(cmd->args[0]);
+        cmd->exec_path = lookup_command(cmd->args[0]);
+    }
+    if (!cmd->exec_path) {
+        fprintf(stderr, "Error: command not found\n");
+        *status = 1;
+        return;
+    }
+    // a vfork parent resumes once the child has exec'd, so this includes exec
+    STAT_START(spawn_start);
+    cmd->pgid = *pgid;
+    *pid = -1;
+    if (worker_pool.count > 0) {
+        int in_fd, out_fd;
+        stage_fds(cmd, i, num_commands, pipe_fds, &in_fd, &out_fd);
+        *pid = pool_dispatch(cmd, in_fd, out_fd);
+    }
+    if (*pid < 0) {
+        *pid = spawn_stage(cmd, i, num_commands, pipe_fds);
+    }
+    if (!*pgid) {
+        *pgid = *pid;
+    }
+    setpgid(*pid, *pgid);  // fails once a vfork child has exec'd, it joined by itself then
+    STAT_STOP(PHASE_SPAWN, spawn_start);
+}
+
+/**
+ * @brief runs a native builtin stage inside the shell, writing to its output
+ *        file, the pipe to the next stage or stdout
+ * 
+ * @param builtin the builtin
+ * @param cmd command of this stage
+ * @param i index of the stage in the pipeline
+ * @param num_commands number of stages in the pipeline
+ * @param pipe_out write end of the pipe to the next stage, -1 for the last stage
+ * @param status set to the exit status of the builtin
+ * @return int 0 if the stage ran, -1 if its arguments are left to the real program
+ */
+int run_native_stage(const Builtin *builtin, Command *cmd, int i, int num_commands,
+                     int pipe_out, int *status) {
+    STAT_START(native_start);
+    OutBuf out = { NULL, 0, 0, &line_arena, 0 };
+    int ret = builtin->native(cmd->args, &out);
+    if (ret < 0) {
+        out_release(&out);
+        return -1;
+    }
+
+    int fd = STDOUT_FILENO;
+    if (cmd->output_fd >= 0) {
+        fd = cmd->output_fd;
+    } else if (i < num_commands - 1) {
+        fd = pipe_out;
+    }
+    fflush(stdout);  // keep ordering with what the shell printed before
+
+    if (fd == STDOUT_FILENO && capture_fd >= 0) {
+        write_all(capture_fd, out.data, out.len);
+    }
+    int failed;
+    if (out.mapped && fd == pipe_out) {
+        failed = relay_gift(fd, out.data, out.len, out.cap);
+    } else {
+        failed = write_all(fd, out.data, out.len);
+        out_release(&out);
+    }
+    if (failed) {
+        if (errno == EPIPE) {
+            clear_sigpipe();
+        }
+        if (ret == 0) {
+            ret = 1;  // write error
+        }
+    }
+    *status = ret;
+    STAT_STOP(PHASE_NATIVE, native_start);
+    return 0;
+}
+
+/**
+ * @brief creates the pipes between the stages of a pipeline with the session's
+ *        size and mode
+ * 
+ * @param pipe_fds room for count pipes
+ * @param count number of pipes
+ */
+void open_stage_pipes(int pipe_fds[][2], int count) {
+    for (int i = 0; i < count; i++) {
+        STAT_SYSCALL(SYS_PIPE);
+        // close-on-exec, a fan-out has a pipe the children don't know to close
+        if (pipe2(pipe_fds[i], O_CLOEXEC | (pipe_packet ? O_DIRECT : 0)) == -1) {
+            perror("pipe");
+            exit(1);
+        }
+        if (pipe_size) {
+            STAT_PIPE_CAPACITY(set_pipe_capacity(pipe_fds[i][1], pipe_size));
+        }
+    }
+}
+
+/**
+ * @brief number of pipes a pipeline needs, a fan-out has one more for the
+ *        trunk's output, which the relay reads
+ */
+static int stage_pipe_count(Command *commands, int num_commands) {
+    return num_commands - 1 + (commands[num_commands - 1].branch > 0);
+}
+
+/**
+ * @brief wires a fan-out before its stages are launched and forks the relay
+ *        feeding the branches. the trunk writes to pipe_fds[num_commands - 1],
+ *        a branch starting at stage i reads pipe_fds[i - 1] like any stage
+ *        does, and the relay writes the other end
+ *
+ * @param commands the stages, the last one is in a branch
+ * @param num_commands number of stages
+ * @param pipe_fds the num_commands pipes of the line
+ * @return pid_t pid of the relay
+ */
+pid_t start_fan_out(Command *commands, int num_commands, int pipe_fds[][2]) {
+    int *dst = arena_alloc(&line_arena, num_commands * sizeof(int));
+    int num_branches = 0;
+    int trunk_last = 0;
+    while (commands[trunk_last + 1].branch == 0) {
+        trunk_last++;
+    }
+    for (int i = trunk_last + 1; i < num_commands; i++) {
+        if (commands[i].branch != commands[i - 1].branch) {
+            dst[num_branches++] = pipe_fds[i - 1][1];
+        }
+    }
+
+    // the trunk output is owned like a redirection from now on
+    commands[trunk_last].output_fd = pipe_fds[num_commands - 1][1];
+    pipe_fds[num_commands - 1][1] = -1;
+    int src = pipe_fds[num_commands - 1][0];
+
+    STAT_SYSCALL(SYS_FORK);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        restore_job_signals();
+        // keep only the trunk output and the branch inputs, or the pipes never see EOF
+        close_command_fds(commands, num_commands);
+        for (int i = 0; i < num_commands; i++) {
+            if (pipe_fds[i][0] != src) {
+                close(pipe_fds[i][0]);
+            }
+            int keep = 0;
+            for (int j = 0; j < num_branches; j++) {
+                keep |= pipe_fds[i][1] == dst[j];
+            }
+            if (!keep && pipe_fds[i][1] >= 0) {
+                close(pipe_fds[i][1]);
+            }
+        }
+        relay_fan_out(src, dst, num_branches);
+        _exit(0);
+    }
+    return pid;
+}
+
+/**
+ * @brief puts a writer process between every stage with an output file and
+ *        that file, for large output mode
+ *
+ * @param commands the stages
+ * @param num_commands number of stages
+ * @param pipe_fds the pipes of the line, closed in the writers
+ * @param num_pipes number of pipes
+ * @param helpers gets the pid of every writer
+ * @return int number of writers started
+ */
+static int start_output_writers(Command *commands, int num_commands, int pipe_fds[][2],
+                                int num_pipes, pid_t *helpers) {
+    int count = 0;
+    for (int i = 0; i < num_commands; i++) {
+        if (commands[i].output_fd < 0) {
+            continue;
+        }
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) < 0) {
+            perror("pipe");
+            exit(1);
+        }
+        STAT_SYSCALL(SYS_PIPE);
+        set_pipe_capacity(fds[1], RELAY_PIPE_SIZE);
+
+        STAT_SYSCALL(SYS_FORK);
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            exit(1);
+        }
+        if (pid == 0) {
+            restore_job_signals();
+            // nothing but the file and the pipe from the stage, so every pipe sees its EOF
+            close(fds[1]);
+            for (int j = 0; j < num_pipes; j++) {
+                close(pipe_fds[j][0]);
+                if (pipe_fds[j][1] >= 0) {
+                    close(pipe_fds[j][1]);
+                }
+            }
+            for (int j = 0; j < num_commands; j++) {
+                if (commands[j].input_fd >= 0) {
+                    close(commands[j].input_fd);
+                }
+                if (j != i && commands[j].output_fd >= 0) {
+                    close(commands[j].output_fd);
+                }
+            }
+            if (write_staged(fds[0], commands[i].output_fd) < 0) {
+                dprintf(STDERR_FILENO, "Error: cannot write output file\n");
+                _exit(1);
+            }
+            _exit(0);
+        }
+
+        // the stage writes the pipe instead of the file
+        close(fds[0]);
+        close(commands[i].output_fd);
+        commands[i].output_fd = fds[1];
+        helpers[count++] = pid;
+    }
+    return count;
+}
+
+/**
+ * @brief starts the processes a line needs besides its stages: the writers of
+ *        large output mode and the relay of a fan-out
+ *
+ * @param commands the stages
+ * @param num_commands number of stages
+ * @param pipe_fds the pipes of the line
+ * @param num_pipes number of pipes, num_commands for a fan-out
+ * @param helpers room for num_commands + 1 pids
+ * @return int number of helpers started, they are waited for with stage -1 and
+ *         join the process group of the stages once those are launched
+ */
+int start_helpers(Command *commands, int num_commands, int pipe_fds[][2], int num_pipes,
+                  pid_t *helpers) {
+    int count = 0;
+    if (output_hint || output_direct) {
+        count = start_output_writers(commands, num_commands, pipe_fds, num_pipes, helpers);
+    }
+    if (num_pipes == num_commands) {
+        helpers[count++] = start_fan_out(commands, num_commands, pipe_fds);
+    }
+    return count;
+}
+
+/**
+ * @brief moves the helpers of a line into the process group of its stages, so
+ *        a signal to the group reaches them too
+ */
+static void join_helpers(pid_t *helpers, int num_helpers, pid_t pgid) {
+    for (int i = 0; i < num_helpers && pgid; i++) {
+        setpgid(helpers[i], pgid);
+    }
+}
+
+/**
+ * @brief copies a parsed pipeline into one malloc'd block so it outlives its
+ *        line. the redirection fds move to the copy
+ * 
+ * @param commands the parsed commands
+ * @param num_commands number of commands
+ * @return Command* the copy, freed with a single free()
+ */
+Command *copy_commands(Command *commands, int num_commands) {
+    size_t size = num_commands * sizeof(Command);
+    for (int i = 0; i < num_commands; i++) {
+        size += (commands[i].num_args + 1) * sizeof(char *);
+        for (int j = 0; j < commands[i].num_args; j++) {
+            size += strlen(commands[i].args[j]) + 1;
+        }
+        size += commands[i].input_f ? strlen(commands[i].input_f) + 1 : 0;
+        size += commands[i].output_f ? strlen(commands[i].output_f) + 1 : 0;
+    }
+
+    char *block = malloc(size);
+    if (!block) {
+        perror("malloc");
+        exit(1);
+    }
+    Command *copy = (Command *)block;
+    char *next = block + num_commands * sizeof(Command);
+
+    // pointer arrays first so they stay aligned, strings after them
+    for (int i = 0; i < num_commands; i++) {
+        copy[i] = commands[i];
+        copy[i].args = (char **)next;
+        copy[i].args_cap = commands[i].num_args + 1;
+        copy[i].exec_path = NULL;
+        copy[i].cpus = NULL;
+        next += copy[i].args_cap * sizeof(char *);
+    }
+    for (int i = 0; i < num_commands; i++) {
+        for (int j = 0; j < commands[i].num_args; j++) {
+            copy[i].args[j] = next;
+            next = stpcpy(next, commands[i].args[j]) + 1;
+        }
+        copy[i].args[commands[i].num_args] = NULL;
+        if (commands[i].input_f) {
+            copy[i].input_f = next;
+            next = stpcpy(next, commands[i].input_f) + 1;
+        }
+        if (commands[i].output_f) {
+            copy[i].output_f = next;
+            next = stpcpy(next, commands[i].output_f) + 1;
+        }
+    }
+    return copy;
+}
+
+/**
+ * @brief moves a parse cache entry to the most recently used end
+ */
+static void parse_cache_touch(ParseEntry *entry) {
+    if (parse_cache.lru_head == entry) {
+        return;
+    }
+    // unlink, it has a prev since it isn't the head
+    entry->lru_prev->lru_next = entry->lru_next;
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        parse_cache.lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = parse_cache.lru_head;
+    parse_cache.lru_head->lru_prev = entry;
+    parse_cache.lru_head = entry;
+}
+
+/**
+ * @brief drops a parse cache entry, the least recently used one to make room
+ */
+static void parse_cache_remove(ParseEntry *entry) {
+    ParseEntry **link = &parse_cache.buckets[entry->hash % PARSE_CACHE_BUCKETS];
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        parse_cache.lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        parse_cache.lru_tail = entry->lru_prev;
+    }
+    parse_cache.count--;
+
+    free(entry->line);
+    free(entry->commands);
+    free(entry);
+}
+
+/**
+ * @brief keeps a private copy of a parsed line in the parse cache
+ */
+static void parse_cache_store(const char *line, unsigned int hash, Command *commands, int num_commands) {
+    if (parse_cache.count == PARSE_CACHE_SIZE) {
+        parse_cache_remove(parse_cache.lru_tail);
+    }
+
+    ParseEntry *entry = malloc(sizeof(ParseEntry));
+    if (!entry || !(entry->line = strdup(line))) {
+        perror("malloc");
+        exit(1);
+    }
+    entry->hash = hash;
+    entry->commands = copy_commands(commands, num_commands);
+    entry->num_commands = num_commands;
+    entry->env_gen = parse_expansion == EXPAND_ENV ? shell_env.gen : 0;
+    for (int i = 0; i < num_commands; i++) {
+        // fds belong to the line being run, every hit opens its own
+        entry->commands[i].input_fd = -1;
+        entry->commands[i].output_fd = -1;
+    }
+
+    ParseEntry **bucket = &parse_cache.buckets[hash % PARSE_CACHE_BUCKETS];
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    entry->lru_prev = NULL;
+    entry->lru_next = parse_cache.lru_head;
+    if (parse_cache.lru_head) {
+        parse_cache.lru_head->lru_prev = entry;
+    } else {
+        parse_cache.lru_tail = entry;
+    }
+    parse_cache.lru_head = entry;
+    parse_cache.count++;
+}
+
+/**
+ * @brief number of stages of the pipeline starting at commands, up to the next list operator
+ */
+int pipeline_length(const Command *commands, int num_commands) {
+    int n = 1;
+    while (n < num_commands && commands[n].list_op == LIST_NONE) {
+        n++;
+    }
+    return n;
+}
+
+/**
+ * @brief opens the redirections of a pipeline, for a cached line as the files may
+ *        have changed since it was parsed or for a later pipeline of a list once
+ *        it runs. fails the way parse_command would
+ *
+ * @return int 0 on success, -1 on error
+ */
+int open_command_files(Command *commands, int num_commands) {
+    Command *first = &commands[0];
+
+    // only the first stage can read a file, outputs end the pipeline or a fan-out branch
+    if (first->input_f) {
+        STAT_START(open_start);
+        first->input_fd = open(first->input_f, O_RDONLY | O_CLOEXEC);
+        STAT_STOP(PHASE_OPEN, open_start);
+        STAT_SYSCALL(SYS_OPEN);
+        if (first->input_fd == -1) {
+            fprintf(stderr, "Error: cannot open input file\n");
+            return -1;
+        }
+    }
+    for (int i = 0; i < num_commands; i++) {
+        if (open_output_file(&commands[i]) < 0) {
+            close_command_fds(commands, num_commands);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief parse_command through the parse cache. a hit copies the cached stages
+ *        into the arena and only redoes the opens of the first pipeline, lines
+ *        that fail aren't cached
+ *
+ * @param line line to process, left untouched
+ * @param commands set to the commands struct list, allocated in the arena
+ * @param arena storage for the stages, their strings stay in the cache
+ * @return int num commands, 0 for a blank line or -1 if invalid
+ */
+int parse_cached(const char *line, Command **commands, Arena *arena) {
+    unsigned int hash = hash_name(line);
+
+    for (ParseEntry *entry = parse_cache.buckets[hash % PARSE_CACHE_BUCKETS]; entry;
+         entry = entry->hash_next) {
+        if (entry->hash == hash && !strcmp(entry->line, line)) {
+            if (entry->env_gen && entry->env_gen != shell_env.gen) {
+                parse_cache_remove(entry);  // expanded with variables that changed since
+                break;
+            }
+            STAT_PARSE_CACHE(1);
+            parse_cache_touch(entry);
+            *commands = arena_alloc(arena, entry->num_commands * sizeof(Command));
+            memcpy(*commands, entry->commands, entry->num_commands * sizeof(Command));
+            if (open_command_files(*commands, pipeline_length(*commands, entry->num_commands)) < 0) {
+                return -1;
+            }
+            return entry->num_commands;
+        }
+    }
+
+    STAT_PARSE_CACHE(0);
+    int num_commands = parse_command(line, commands, arena);
+    if (num_commands > 0 && parse_expansion != EXPAND_VOLATILE) {
+        parse_cache_store(line, hash, *commands, num_commands);
+    }
+    return num_commands;
+}
+
+/**
+ * @brief launches every stage of a background job and tracks its pids
+ * 
+ * @param queue the queue owning the job
+ * @param job the job, already in the queue
+ * @param commands its pipeline, the redirection fds are closed afterwards
+ */
+static void launch_job(BgJobQueue *queue, BackgroundJob *job, Command *commands) {
+    int n = job->pid_count;
+    int num_pipes = stage_pipe_count(commands, n);
+    int (*pipe_fds)[2] = arena_alloc(&line_arena, num_pipes * sizeof(*pipe_fds));
+    open_stage_pipes(pipe_fds, num_pipes);
+    job->start_ns = monotonic_ns();
+    pid_t *helpers = arena_alloc(&line_arena, (n + 1) * sizeof(pid_t));
+    int num_helpers = start_helpers(commands, n, pipe_fds, num_pipes, helpers);
+
+    if (affinity_policy != AFFINITY_OFF) {
+        place_pipeline(commands, n, 1, &line_arena);
+    }
+    for (int i = 0; i < n; i++) {
+        launch_stage(&commands[i], i, n, pipe_fds, &job->pids[i], &job->exit_status[i], &job->pgid);
+    }
+    join_helpers(helpers, num_helpers, job->pgid);
+    for (int i = 0; i < num_pipes; i++) {
+        close(pipe_fds[i][0]);
+        if (pipe_fds[i][1] >= 0) {
+            close(pipe_fds[i][1]);
+        }
+    }
+    close_command_fds(commands, n);
+
+    job->state = JOB_RUNNING;
+    queue->running++;
+    for (int i = 0; i < n; i++) {
+        if (job->pids[i]) {  // 0 was never launched
+            pid_map_insert(&queue->pid_map, job->pids[i], job, i);
+            job->remaining++;
+        }
+    }
+    for (int i = 0; i < num_helpers; i++) {
+        pid_map_insert(&queue->pid_map, helpers[i], job, -1);
+        job->remaining++;
+    }
+    if (job->remaining == 0) {
+        mark_job_done(queue, job);
+    }
+}
+
+/**
+ * @brief launches queued jobs, oldest first, while the limit has free slots
+ * 
+ * @param queue the queue to start jobs from
+ */
+static void start_queued_jobs(BgJobQueue *queue) {
+    static int starting = 0;  // a job failing right away frees its slot from inside the loop
+    if (starting) {
+        return;
+    }
+    starting = 1;
+    while (queue->waiting && queue->running < job_limit(queue)) {
+        BackgroundJob *job = queue->waiting;
+        queue->waiting = job->wait_next;
+        if (!queue->waiting) {
+            queue->waiting_tail = NULL;
+        }
+        launch_job(queue, job, job->commands);
+        free(job->commands);
+        job->commands = NULL;
+    }
+    starting = 0;
+}
+
+/**
+ * @brief unlinks a job from the list of queued jobs
+ */
+static void unqueue_job(BgJobQueue *queue, BackgroundJob *job) {
+    BackgroundJob **link = &queue->waiting;
+    BackgroundJob *prev = NULL;
+    while (*link != job) {
+        prev = *link;
+        link = &prev->wait_next;
+    }
+    *link = job->wait_next;
+    if (queue->waiting_tail == job) {
+        queue->waiting_tail = prev;
+    }
+}
+
+/**
+ * @brief launches a queued job out of turn, for fg and bg
+ */
+static void start_job_now(BgJobQueue *queue, BackgroundJob *job) {
+    unqueue_job(queue, job);
+    launch_job(queue, job, job->commands);
+    free(job->commands);
+    job->commands = NULL;
+}
+
+/**
+ * @brief finishes a queued job without launching it, every stage gets the
+ *        status of a death by sig
+ */
+static void drop_queued_job(BgJobQueue *queue, BackgroundJob *job, int sig) {
+    unqueue_job(queue, job);
+    close_command_fds(job->commands, job->pid_count);
+    free(job->commands);
+    job->commands = NULL;
+    for (int i = 0; i < job->pid_count; i++) {
+        job->exit_status[i] = 128 + sig;
+    }
+    mark_job_done(queue, job);
+}
+
+/**
+ * @brief allocates a job for a line and appends it to the fifo of the queue
+ * 
+ * @param queue the queue to add to
+ * @param num_commands number of stages
+ * @param command original command string
+ * @return BackgroundJob* the job, not launched or queued yet
+ */
+static BackgroundJob *new_job(BgJobQueue *queue, int num_commands, const char *command) {
+    BackgroundJob *job = malloc(sizeof(BackgroundJob));
+    if (!job) {
+        perror("malloc");
+        exit(1);
+    }
 
-// global background job queue for signal handler access
-static BgJobQueue bg_queue;
+    job->pid_count = num_commands;
+    job->pids = calloc(num_commands, sizeof(pid_t) + sizeof(int));
+    if (!job->pids) {
+        perror("calloc");
+        exit(1);
+    }
+    job->exit_status = (int *)(job->pids + num_commands);
+    job->command = slab_strdup(&job_slab, command);
+    job->seq = queue->next_seq++;
+    job->remaining = 0;
+    job->foreground = 0;
+    job->commands = NULL;
+    job->wait_next = NULL;
+    job->usage = NULL;
+    job->pgid = 0;
+    job->stopped = 0;
+    if (track_usage && !(job->usage = calloc(num_commands, sizeof(StageUsage)))) {
+        perror("calloc");
+        exit(1);
+    }
+
+    // append to the fifo
+    job->next = NULL;
+    job->prev = queue->tail;
+    if (queue->tail) {
+        queue->tail->next = job;
+    } else {
+        queue->head = job;
+    }
+    queue->tail = job;
+    queue->num_jobs++;
+    return job;
+}
 
 /**
- * @brief initialize the background job queue
+ * @brief turns a stopped foreground pipeline into a stopped background job,
+ *        its processes are moved over in the pid map
  * 
- * @param queue the queue to initialize
+ * @param queue the queue to add to
+ * @param fg the foreground job, its state lives in the line arena
+ * @param command original command string
+ * @return BackgroundJob* the new job
  */
-void init_bg_queue(BgJobQueue *queue) {
-    queue->num_jobs = 0;
-    for (int i = 0; i < MAX_BG_JOBS; i++) {
-        queue->jobs[i].active = 0;
-        queue->jobs[i].command = NULL;
-        queue->jobs[i].pid_count = 0;
+BackgroundJob *adopt_stopped_job(BgJobQueue *queue, BackgroundJob *fg, const char *command) {
+    BackgroundJob *job = new_job(queue, fg->pid_count, command);
+    memcpy(job->pids, fg->pids, fg->pid_count * sizeof(pid_t));
+    memcpy(job->exit_status, fg->exit_status, fg->pid_count * sizeof(int));
+    if (job->usage && fg->usage) {
+        memcpy(job->usage, fg->usage, fg->pid_count * sizeof(StageUsage));
     }
+    job->start_ns = fg->start_ns;
+    job->pgid = fg->pgid;
+    job->remaining = fg->remaining;
+    job->stopped = fg->stopped;
+    job->state = JOB_STOPPED;
+
+    for (size_t i = 0; i < queue->pid_map.cap; i++) {
+        if (queue->pid_map.slots[i].pid && queue->pid_map.slots[i].job == fg) {
+            queue->pid_map.slots[i].job = job;
+        }
+    }
+    return job;
 }
 
 /**
- * @brief add a new background job to the queue
+ * @brief adds a background job to the queue. it is launched right away if
+ *        fewer than queue->limit jobs are running, otherwise it waits in fifo
+ *        order for the reaper to free a slot
  * 
  * @param queue the queue to add to
- * @param pids array of process IDs
- * @param pid_count number of processes
+ * @param commands the parsed pipeline
+ * @param num_commands number of stages
  * @param command original command string
- * @return int 0 on success, -1 if queue is full
+ * @return int 0 on success
  */
-int add_bg_job(BgJobQueue *queue, pid_t pids[], int pid_count, char* command) {
-    if (queue->num_jobs >= MAX_BG_JOBS) {
-        return -1;  // queue full
+int add_bg_job(BgJobQueue *queue, Command *commands, int num_commands, char* command) {
+    BackgroundJob *job = new_job(queue, num_commands, command);
+    if (queue->running < job_limit(queue) && !queue->waiting) {
+        launch_job(queue, job, commands);
+        return 0;
     }
-    
-    int index = queue->num_jobs;
-    queue->jobs[index].pid_count = pid_count;
-    queue->jobs[index].command = strdup(command);
-    queue->jobs[index].active = 1;
-    
-    // copy pids
-    for (int i = 0; i < pid_count; i++) {
-        queue->jobs[index].pids[i] = pids[i];
+
+    // the line arena is reset after this line, so the queued job keeps a copy
+    job->state = JOB_QUEUED;
+    job->commands = copy_commands(commands, num_commands);
+    if (queue->waiting_tail) {
+        queue->waiting_tail->wait_next = job;
+    } else {
+        queue->waiting = job;
     }
-    
-    queue->num_jobs++;
+    queue->waiting_tail = job;
     return 0;
 }
 
 /**
- * @brief check for completed background jobs
+ * @brief opens a listening unix socket at path, replacing a stale socket but
+ *        refusing to remove a file of any other kind
  * 
- * @param queue the queue to check
- * @return int number of jobs that were completed and reported
+ * @return int the socket, -1 on error
  */
-int check_completed_bg_jobs(BgJobQueue *queue) {
-    int completed_count = 0;
-    
-    for (int job_idx = 0; job_idx < queue->num_jobs; job_idx++) {
-        BackgroundJob *job = &queue->jobs[job_idx];
-        
-        if (!job->active) continue;  // skip jobs that are already marked as inactive
-        
-        // check if all processes in this job have completed
-        int all_completed = 1;
-        int exit_status[MAX_COMMANDS] = {0};
-        
-        for (int i = 0; i < job->pid_count; i++) {
-            int status;
-            pid_t result = waitpid(job->pids[i], &status, WNOHANG);
-            
-            if (result == 0) {
-                // process still running
-                all_completed = 0;
-                break;
-            } else if (result > 0) {
-                // process has completed
-                if (WIFEXITED(status)) {
-                    exit_status[i] = WEXITSTATUS(status);
-                }
-            }
-        }
-        
-        if (all_completed) {
-            // report job completion in fifo order
-            fprintf(stderr, "+ completed '%s' ", job->command);
-            for (int i = 0; i < job->pid_count; i++) {
-                fprintf(stderr, "[%d]", exit_status[i]);
-            }
-            fprintf(stderr, "\n");
-            
-            // clean up and mark as inactive
-            free(job->command);
-            job->command = NULL;
-            job->active = 0;
-            completed_count++;
-        }
+static int listen_unix(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
     }
-    
-    // clean up the queue by removing inactive jobs (shifting active ones to the front)
-    if (completed_count > 0) {
-        int new_index = 0;
-        for (int i = 0; i < queue->num_jobs; i++) {
-            if (queue->jobs[i].active) {
-                if (i != new_index) {
-                    queue->jobs[new_index] = queue->jobs[i];
-                }
-                new_index++;
-            }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    // a socket left by an earlier daemon is replaced, anything else is not ours
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            close(fd);
+            errno = EEXIST;
+            return -1;
         }
-        queue->num_jobs = new_index;
+        unlink(path);
     }
-    
-    return completed_count;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
 }
 
 /**
- * @brief pads | < > chars with spaces so that it makes splitting using strtok easier
+ * @brief daemon mode: accepts sessions on a unix socket and forks a session
+ *        for each from the warm daemon, so a session starts without exec,
+ *        environment parsing or queue setup. the daemon only ever blocks in
+ *        accept, sessions are reaped by the kernel
  * 
- * @param line whole line
+ * @param path socket path
+ * @return int the connection, in the forked session. the daemon never returns
  */
-void pad_spaces_if_missing(char *line) {
-    char temp[CMDLINE_MAX];
-    int temp_index = 0;
+int serve_sessions(const char *path) {
+    int listen_fd = listen_unix(path);
+    if (listen_fd < 0) {
+        perror("listen");
+        exit(1);
+    }
+    signal(SIGCHLD, SIG_IGN);
 
-    for (int i = 0; line[i] != '\0'; i++) {
-        // for: | < >
-        if (line[i] == '<' || line[i] == '>' || line[i] == '|') {
-            // add space before if not there
-            if (temp_index > 0 && temp[temp_index - 1] != ' ') {
-                temp[temp_index] = ' ';
-                temp_index++;
+    while (1) {
+        int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE) {
+                continue;
             }
+            perror("accept");
+            exit(1);
+        }
+        STAT_SYSCALL(SYS_FORK);
+        pid_t pid = fork();
+        if (pid == 0) {
+            // each session is a shell of its own: cwd, jobs, pid map and event loop
+            close(listen_fd);
+            signal(SIGCHLD, SIG_DFL);
+            return conn;
+        }
+        close(conn);  // a failed fork drops the session, the client sees EOF
+    }
+}
 
-            temp[temp_index] = line[i];
-            temp_index++;
+/**
+ * @brief on_exit handler of a session: flushes what it wrote to the client's
+ *        stdio, then sends its exit status so attach_session returns it
+ */
+static void session_exit(int status, void *arg) {
+    (void)arg;
+    if (getpid() != session_pid) {
+        return;  // a forked stage that failed to exec
+    }
+    fflush(stdout);
+    fflush(stderr);
+    unsigned char byte = status;
+    if (write(session_conn, &byte, 1) < 0) {
+        // the client is gone, nobody is waiting for the status
+    }
+}
 
-            if (line[i + 1] != '\0' && line[i + 1] != ' ') {
-                temp[temp_index] = ' ';
-                temp_index++;
-            }
-        } else {
-            temp[temp_index] = line[i];
-            temp_index++;
+/**
+ * @brief sets up the stdio of a session. a client that sends its stdin,
+ *        stdout and stderr with SCM_RIGHTS gets them used directly, any other
+ *        client talks over the connection
+ * 
+ * @param conn the connection
+ * @param hello set to the first bytes read, command lines unless fds came with them
+ * @param hello_len set to their length
+ * @return int fd command lines are read from
+ */
+int open_session(int conn, char *hello, size_t *hello_len) {
+    int fds[3];
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { hello, SESSION_HELLO_MAX };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t len;
+    do {
+        len = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    } while (len < 0 && errno == EINTR);
+    *hello_len = len > 0 ? len : 0;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+        && cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+        for (int i = 0; i < 3; i++) {
+            dup2(fds[i], i);
+            close(fds[i]);
         }
+        *hello_len = 0;
+        session_conn = conn;  // stays open until the session ends
+        session_pid = getpid();
+        on_exit(session_exit, NULL);
+        return STDIN_FILENO;
     }
-
-    temp[temp_index] = '\0';
-    strcpy(line, temp);
+    dup2(conn, STDOUT_FILENO);
+    dup2(conn, STDERR_FILENO);
+    return conn;
 }
 
 /**
- * @brief trims leading and trailing spaces
+ * @brief client side of daemon mode: hands stdin, stdout and stderr to a new
+ *        session and waits for it to end
  * 
- * @param str 
+ * @param path socket path of the daemon
+ * @return int exit status of the session, EXIT_FAILURE if it ended without one
  */
-void trim_spaces(char *str) {
-    // leading spaces
-    while (isspace(*str)) {
-        str++;
+int attach_session(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (strlen(path) >= sizeof(addr.sun_path) || fd < 0) {
+        fprintf(stderr, "Error: cannot connect to daemon\n");
+        return EXIT_FAILURE;
     }
-    
-    // trailing spaces
-    char *end = str + strlen(str) - 1;
-    while (end > str && isspace(*end)) {
-        end--;
+    strcpy(addr.sun_path, path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Error: cannot connect to daemon\n");
+        return EXIT_FAILURE;
     }
 
-    *(end + 1) = '\0';
+    int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    char byte = 0;
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != 1) {
+        fprintf(stderr, "Error: cannot connect to daemon\n");
+        return EXIT_FAILURE;
+    }
+
+    // the session sends its exit status as it exits, a session killed before
+    // that just closes its end
+    ssize_t got;
+    while ((got = read(fd, &byte, 1)) < 0 && errno == EINTR) {
+    }
+    return got == 1 ? (unsigned char)byte : EXIT_FAILURE;
 }
 
 /**
- * @brief parses command line and returns number of commands. commands are stored in array of Command structs
+ * @brief runs a pipeline in the foreground and waits for it. a pipeline stopped
+ *        from the terminal carries on as a stopped background job
  * 
- * @param line line to process
- * @param commands commands struct list
- * @return int num commands or -1 if invalid
+ * @param commands its stages, their redirection fds are closed once launched
+ * @param num_commands number of stages
+ * @param command the pipeline as typed, for its reports
+ * @param fg_job filled with the pids and statuses of the stages, in the line arena.
+ *        remaining is left above 0 if it stopped
+ * @return int status of the last stage, 128 + SIGTSTP if it stopped
  */
-int parse_command(char *line, Command commands[]) {
-    char *sub_commands_by_pipe[MAX_COMMANDS];
-    int num_commands = 0;
-    int background = 0;
+int run_pipeline(Command *commands, int num_commands, char *command, BackgroundJob *fg_job) {
+    // n stages are linked by n - 1 pipes, a fan-out adds one for its trunk
+    int num_pipes = stage_pipe_count(commands, num_commands);
+    int fan_out = num_pipes == num_commands;
+    int (*pipe_fds)[2] = arena_alloc(&line_arena, num_pipes * sizeof(*pipe_fds));
+    STAT_START(pipe_start);
+    open_stage_pipes(pipe_fds, num_pipes);
+    STAT_STOP(PHASE_PIPE, pipe_start);
 
-    trim_spaces(line);
-    
-    // check if the command ends with &, indicating a background job
-    int len = strlen(line);
-    if (len > 0 && line[len-1] == '&') {
-        background = 1;
-        line[len-1] = '\0';  // remove the & character
-        trim_spaces(line);   // trim any spaces before the &
-        
-        if (strlen(line) == 0) {
-            fprintf(stderr, "Error: missing command\n");
-            return -1;
+    pid_t *pids = arena_alloc(&line_arena, num_commands * sizeof(pid_t));
+    int *exit_status = arena_alloc(&line_arena, num_commands * sizeof(int));
+    memset(pids, 0, num_commands * sizeof(pid_t));
+    memset(exit_status, 0, num_commands * sizeof(int));
+
+    // native builtins at either end of the pipeline run in the shell
+    // once the other stages are launched. a first stage only does if a real
+    // process reads its output, so a large write can't block forever. the
+    // stages of a fan-out are all real processes
+    const Builtin **native = arena_alloc(&line_arena, num_commands * sizeof(*native));
+    for (int i = num_commands - 1; i >= 0; i--) {
+        native[i] = NULL;
+        if ((i == 0 || i == num_commands - 1) && !(i == 0 && num_commands == 2 && native[1]) && !fan_out) {
+            const Builtin *builtin = find_builtin(commands[i].args[0]);
+            if (builtin && builtin->native) {
+                native[i] = builtin;
+            }
         }
     }
 
-    // check if command has a & that's not in the end
-    char *ampersand = strchr(line, '&');
-    if (ampersand != NULL && ampersand != line + strlen(line) - 1) {
-        fprintf(stderr, "Error: mislocated background sign\n");
-        return -1;
+    // with SSHELL_CAPTURE the last stage writes to a pipe the shell relays to
+    // stdout and the capture file. the shell is busy writing while a native
+    // first stage runs, so that stage is launched for real then
+    int capture_pipe[2] = { -1, -1 };
+    Command *last = &commands[num_commands - 1];
+    if (capture_fd >= 0 && !native[num_commands - 1] && last->output_fd < 0 && !fan_out
+        && pipe2(capture_pipe, O_CLOEXEC) == 0) {
+        STAT_SYSCALL(SYS_PIPE);
+        set_pipe_capacity(capture_pipe[1], RELAY_PIPE_SIZE);
+        last->output_fd = capture_pipe[1];
+        native[0] = NULL;
     }
 
-    if (line[0] == '|' || line[strlen(line) - 1] == '|') {
-        fprintf(stderr, "Error: missing command\n");
-        return -1;
+    if (affinity_policy != AFFINITY_OFF) {
+        place_pipeline(commands, num_commands, 0, &line_arena);
     }
 
-    // split when | symbol
-    char *sub_command = strtok(line, "|");
-    while (sub_command != NULL && num_commands < MAX_COMMANDS) {
-        sub_commands_by_pipe[num_commands] = sub_command;
-        num_commands++;
-        sub_command = strtok(NULL, "|");
-    }
+    unsigned long long start_ns = monotonic_ns();
+    pid_t *helpers = arena_alloc(&line_arena, (num_commands + 1) * sizeof(pid_t));
+    int num_helpers = start_helpers(commands, num_commands, pipe_fds, num_pipes, helpers);
 
-    // parse each command looking for < or > and managing args
+    // loop per command, unknown commands fail here without forking. the
+    // first stage launched leads the group and takes the terminal
+    pid_t pgid = 0;
     for (int i = 0; i < num_commands; i++) {
-        trim_spaces(sub_commands_by_pipe[i]);
-
-        if (sub_commands_by_pipe[i][0] == '\0' || 
-            (sub_commands_by_pipe[i][0] == '>' || sub_commands_by_pipe[i][0] == '<')) {
-            fprintf(stderr, "Error: missing command\n");
-            return -1;
+        commands[i].take_tty = job_tty;
+        if (!native[i]) {
+            launch_stage(&commands[i], i, num_commands, pipe_fds, &pids[i], &exit_status[i], &pgid);
         }
+    }
 
-        Command *cmd = &commands[i];
-        cmd->input_f = NULL;
-        cmd->output_f = NULL;
-        cmd->background = 0;
-        
-        // only the last command can be a background job
-        if (i == num_commands - 1 && background) {
-            cmd->background = 1;
-        }
-
-        int num_args = 0;
-        char *arg_split_space = strtok(sub_commands_by_pipe[i], " ");
-        while (arg_split_space != NULL) {
-            if (strcmp(arg_split_space, "<") == 0) {
-                if (i > 0) {
-                    fprintf(stderr, "Error: mislocated input redirection\n");
-                    return -1;
-                }
-                arg_split_space = strtok(NULL, " ");
-                if (arg_split_space) {
-                    cmd->input_f = strdup(arg_split_space); // modified later so must use copy
-                    int input_fd = open(arg_split_space, O_RDONLY);
-                    if (input_fd == -1) {
-                        fprintf(stderr, "Error: cannot open input file\n");
-                        close(input_fd);
-                        return -1;
-                    }
-                    close(input_fd);
-                } else {
-                    fprintf(stderr, "Error: no input file\n");
-                    return -1;
-                }
-            } else if (strcmp(arg_split_space, ">") == 0) {
-                if (i < num_commands - 1) {
-                    fprintf(stderr, "Error: mislocated output redirection\n");
-                    return -1;
-                }
-                arg_split_space = strtok(NULL, " ");
-                if (arg_split_space) {
-                    cmd->output_f = strdup(arg_split_space);
-                    int output_fd = open(arg_split_space, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                    if (output_fd == -1) {
-                        fprintf(stderr, "Error: cannot open output file\n");
-                        close(output_fd);
-                        return -1;
-                    }
-                    close(output_fd);
-                } else {
-                    fprintf(stderr, "Error: no output file\n");
-                    return -1;
-                }
-            } else { // normal non < or >
-                cmd->args[num_args] = strdup(arg_split_space);
-                num_args++;
-            }
-            arg_split_space = strtok(NULL, " "); // next one
+    // parent process: close all pipes but the one a native first stage writes to
+    int native_out = num_commands > 1 && native[0] ? pipe_fds[0][1] : -1;
+    for (int i = 0; i < num_pipes; i++) {
+        close(pipe_fds[i][0]);
+        if (pipe_fds[i][1] != native_out && pipe_fds[i][1] >= 0) {
+            close(pipe_fds[i][1]);
         }
-        if (num_args > MAX_ARGS_PER_CMD) {
-            fprintf(stderr, "Error: too many process arguments\n");
-            return -1;
+    }
+
+    for (int i = 0; i < num_commands; i++) {
+        if (native[i] && run_native_stage(native[i], &commands[i], i, num_commands,
+                                          native_out, &exit_status[i]) < 0) {
+            // arguments the builtin doesn't handle go to the real program
+            launch_stage(&commands[i], i, num_commands, pipe_fds, &pids[i], &exit_status[i], &pgid);
         }
-        cmd->args[num_args] = NULL; // null terminate
     }
+    join_helpers(helpers, num_helpers, pgid);
+    if (native_out >= 0) {
+        close(native_out);
+    }
+    close_command_fds(commands, num_commands);
 
-    return num_commands;
-}
+    if (capture_pipe[0] >= 0) {
+        if (relay_pump(capture_pipe[0], STDOUT_FILENO, capture_fd) < 0 && errno == EPIPE) {
+            clear_sigpipe();
+        }
+        close(capture_pipe[0]);
+    }
 
-/**
- * @brief debug function to print out command struct list
- * 
- * @param commands commands list
- * @param num_jobs number of commands
- */
-void preview_command_list(Command commands[], int num_jobs) {
-    for (int i = 0; i < num_jobs; i++) {
-        printf("----------------------------\n");
-        printf("Command %d:\n", i + 1);
-        printf("\tArgs: ");
-        for (int j = 0; commands[i].args[j] != NULL; j++) {
-            printf("{%s} ", commands[i].args[j]);
+    // for foreground jobs, track the pids like a job and wait for all of them
+    memset(fg_job, 0, sizeof(*fg_job));
+    fg_job->foreground = 1;
+    fg_job->pids = pids;
+    fg_job->exit_status = exit_status;
+    fg_job->pid_count = num_commands;
+    fg_job->start_ns = start_ns;
+    fg_job->pgid = pgid;
+    if (track_usage) {
+        fg_job->usage = arena_alloc(&line_arena, num_commands * sizeof(StageUsage));
+        memset(fg_job->usage, 0, num_commands * sizeof(StageUsage));
+    }
+    for (int i = 0; i < num_commands; i++) {
+        if (pids[i] != 0) {  // 0 was never launched
+            pid_map_insert(&bg_queue.pid_map, pids[i], fg_job, i);
+            fg_job->remaining++;
         }
-        printf("\n");
-        if (commands[i].input_f)
-            printf("\tInput: %s\n", commands[i].input_f);
-        if (commands[i].output_f)
-            printf("\tOutput: %s\n", commands[i].output_f);
     }
-    printf("----------------------------\n");
+    for (int i = 0; i < num_helpers; i++) {
+        pid_map_insert(&bg_queue.pid_map, helpers[i], fg_job, -1);
+        fg_job->remaining++;
+    }
+
+    // the shell holds no pipe now, workers handed out are replaced while the line runs
+    pool_refill();
+
+    // background jobs finishing meanwhile are reported before the foreground completion
+    STAT_START(wait_start);
+    wait_foreground_job(&bg_queue, fg_job);
+    STAT_STOP(PHASE_WAIT, wait_start);
+    if (job_tty) {
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+    }
+
+    // a stopped pipeline carries on as a background job, reported when it is done
+    if (fg_job->remaining > 0) {
+        BackgroundJob *job = adopt_stopped_job(&bg_queue, fg_job, command);
+        fprintf(stderr, "[%lu]\tstopped\t%s\n", job->seq + 1, job->command);
+        return 128 + SIGTSTP;
+    }
+
+    fg_job->command = command;
+    return exit_status[num_commands - 1];
 }
 
-int main() {
-    char cmd[CMDLINE_MAX];
-    char *eof;
-    Command commands[MAX_COMMANDS];
+// benchmarks and fuzzers include this file with SSHELL_NO_MAIN to reuse the shell internals
+#ifndef SSHELL_NO_MAIN
+int main(int argc, char *argv[]) {
+    char *cmd;
+    Command *commands = NULL;
     int args_index = -1;
+    int input_fd = STDIN_FILENO;
+    LineReader reader;
+
+    // sshell [-b] [-c command] [-d socket | -a socket] [script]: -b runs stdin
+    // as a batch, a script file implies batch mode and so does -c, which runs
+    // its command line and exits with its status. -d serves sessions on a unix
+    // socket and -a runs this terminal's session in such a daemon
+    int opt;
+    char *daemon_path = NULL;
+    char *command_line = NULL;
+    while ((opt = getopt(argc, argv, "bc:d:a:")) != -1) {
+        if (opt == 'b') {
+            batch_mode = 1;
+        } else if (opt == 'c') {
+            command_line = optarg;
+        } else if (opt == 'd') {
+            daemon_path = optarg;
+        } else if (opt == 'a') {
+            return attach_session(optarg);
+        } else {
+            fprintf(stderr, "Usage: sshell [-b] [-c command] [-d socket | -a socket] [script]\n");
+            return EXIT_FAILURE;
+        }
+    }
+    if (command_line && (daemon_path || optind < argc)) {
+        fprintf(stderr, "Usage: sshell [-b] [-c command] [-d socket | -a socket] [script]\n");
+        return EXIT_FAILURE;
+    }
+    if (command_line) {
+        input_fd = -1;  // nothing is read, see the line reader below
+        batch_mode = 1;
+    } else if (optind < argc) {
+        input_fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+        if (input_fd < 0) {
+            fprintf(stderr, "Error: cannot open script file\n");
+            return EXIT_FAILURE;
+        }
+        batch_mode = 1;
+    }
+    if (batch_mode) {
+        enter_batch_mode();
+    }
+
+#ifndef SSHELL_NO_STATS
+    if (getenv("SSHELL_STATS")) {
+        atexit(stats_dump);
+    }
+#endif
+
+    char *launch_env = getenv("SSHELL_LAUNCH");
+    if (launch_env && !strcmp(launch_env, "fork")) {
+        launch_mode = LAUNCH_FORK;
+    }
+
+    char *pipe_env = getenv("SSHELL_PIPE_SIZE");
+    if (pipe_env && set_pipe_size(pipe_env) < 0) {
+        fprintf(stderr, "Error: invalid pipe size\n");
+        return EXIT_FAILURE;
+    }
+    if (getenv("SSHELL_PIPE_PACKET")) {
+        pipe_packet = 1;
+    }
+
+    char *affinity_env = getenv("SSHELL_AFFINITY");
+    if (affinity_env && set_affinity_policy(affinity_env) < 0) {
+        fprintf(stderr, "Error: invalid affinity policy\n");
+        return EXIT_FAILURE;
+    }
+
+    char *capture_env = getenv("SSHELL_CAPTURE");
+    if (capture_env) {
+        // appended to by hand, splice refuses files opened with O_APPEND
+        capture_fd = open(capture_env, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (capture_fd < 0) {
+            fprintf(stderr, "Error: cannot open capture file\n");
+            return EXIT_FAILURE;
+        }
+        lseek(capture_fd, 0, SEEK_END);
+    }
+
+    // history is kept for interactive use or wherever SSHELL_HISTFILE points,
+    // an empty SSHELL_HISTFILE turns it off
+    char *hist_env = getenv("SSHELL_HISTFILE");
+    if (hist_env) {
+        history.path = *hist_env ? strdup(hist_env) : NULL;
+        if (*hist_env && !history.path) {
+            perror("strdup");
+            exit(1);
+        }
+    } else if (!batch_mode && isatty(input_fd) && getenv("HOME")) {
+        const char *home = getenv("HOME");
+        history.path = malloc(strlen(home) + sizeof("/.sshell_history"));
+        if (!history.path) {
+            perror("malloc");
+            exit(1);
+        }
+        strcpy(history.path, home);
+        strcat(history.path, "/.sshell_history");
+    }
+
+    // SSHELL_RUSAGE=stderr prints stage usage there, any other value names a JSON log
+    char *usage_env = getenv("SSHELL_RUSAGE");
+    if (usage_env && !strcmp(usage_env, "stderr")) {
+        usage_log = stderr;
+    } else if (usage_env && *usage_env) {
+        usage_log = fopen(usage_env, "ae");
+        if (!usage_log) {
+            fprintf(stderr, "Error: cannot open usage log\n");
+            return EXIT_FAILURE;
+        }
+        usage_json = 1;
+    }
+    track_usage = usage_log != NULL;
+
+    // SSHELL_OUTPUT_HINT=size and SSHELL_OUTPUT_DIRECT turn on large output mode
+    char *hint_env = getenv("SSHELL_OUTPUT_HINT");
+    if (hint_env && (output_hint = parse_size(hint_env)) < 0) {
+        fprintf(stderr, "Error: invalid output hint\n");
+        return EXIT_FAILURE;
+    }
+    output_direct = getenv("SSHELL_OUTPUT_DIRECT") != NULL;
 
     init_bg_queue(&bg_queue);
 
-    // register the SIGCHLD signal handler
-    struct sigaction sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = sigchld_handler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP; // restart interrupted syscalls and don't catch child stop signals
-    sigaction(SIGCHLD, &sa, NULL);
+    // SSHELL_JOBS overrides the default limit of one background job per core
+    char *jobs_env = getenv("SSHELL_JOBS");
+    if (jobs_env) {
+        char *end;
+        long limit = strtol(jobs_env, &end, 10);
+        if (*end || limit < 1 || limit > INT_MAX) {
+            fprintf(stderr, "Error: invalid job limit\n");
+            return EXIT_FAILURE;
+        }
+        bg_queue.limit = (int)limit;
+    }
+
+    // the daemon is set up like any shell, each session is forked from it. a
+    // session runs like a batch, except that completions go out line by line
+    char hello[SESSION_HELLO_MAX];
+    size_t hello_len = 0;
+    char *telemetry_env = getenv("SSHELL_TELEMETRY");
+    if (daemon_path) {
+        // sessions writing one inherited fd would interleave their records
+        if (telemetry_env && !strncmp(telemetry_env, "fd:", 3)) {
+            fprintf(stderr, "Error: daemon sessions cannot share a telemetry fd\n");
+            return EXIT_FAILURE;
+        }
+        input_fd = open_session(serve_sessions(daemon_path), hello, &hello_len);
+        batch_mode = 1;
+        setvbuf(stderr, status_buf, _IOLBF, sizeof(status_buf));
+    }
+
+    // SSHELL_TELEMETRY streams a fixed-size record per completion, see
+    // TelemetryRecord. a daemon session opens a sink of its own
+    if (telemetry_env) {
+        if (telemetry_open(telemetry_env) < 0) {
+            fprintf(stderr, "Error: cannot open telemetry sink\n");
+            return EXIT_FAILURE;
+        }
+        track_usage = 1;
+        atexit(telemetry_flush);
+    }
+
+    arena_init(&line_arena, LINE_ARENA_SIZE);
+    if (command_line) {
+        // the reader holds just the -c command, it is at end of input already
+        size_t len = strlen(command_line);
+        line_reader_init(&reader, input_fd, len);
+        memcpy(reader.buf, command_line, len);
+        reader.len = len;
+        reader.eof = 1;
+    } else {
+        line_reader_init(&reader, input_fd, batch_mode ? BATCH_READ_BUF : INTERACTIVE_READ_BUF);
+        memcpy(reader.buf, hello, hello_len);  // what a session read before its first line
+        reader.len = hello_len;
+    }
+
+    // SIGCHLD is handled through a signalfd in the event loop instead of a handler
+    init_events(input_fd);
+
+    // job control needs the terminal, which an interactive shell owns between lines
+    if (!batch_mode && input_fd == STDIN_FILENO && isatty(STDIN_FILENO)) {
+        init_job_control();
+    }
+
+    // SSHELL_WORKERS=N keeps N workers forked ahead of the stages they run,
+    // the first ones are forked while the shell is still small
+    char *workers_env = getenv("SSHELL_WORKERS");
+    if (workers_env) {
+        char *end;
+        long size = strtol(workers_env, &end, 10);
+        if (*end || size < 1 || size > WORKERS_MAX) {
+            fprintf(stderr, "Error: invalid worker count\n");
+            return EXIT_FAILURE;
+        }
+        worker_pool.size = (int)size;
+        pool_refill();
+    }
 
     while (1)
     {
         // check for and report any completed background jobs before printing prompt
-        if (sigchld_flag) {
-            check_completed_bg_jobs(&bg_queue);
-            sigchld_flag = 0;
+        if (bg_queue.num_jobs > 0) {
+            poll_sigchld(&bg_queue);
         }
-        char *nl;
 
         /* print prompt */
-        printf("sshell@ucd$ ");
-        fflush(stdout);
+        if (!batch_mode) {
+            printf("sshell@ucd$ ");
+            fflush(stdout);
+        }
 
-        /* get command line */
-        eof = fgets(cmd, CMDLINE_MAX, stdin);
-        if (!eof)
+        /* get command line, waiting in the event loop */
+        cmd = read_command_line(&reader, &bg_queue);
+        if (!cmd) {
+            /* end of input waits for the background jobs instead of spinning on exit,
+               stopped ones are continued so they can finish */
+            for (BackgroundJob *job = bg_queue.head; job; job = job->next) {
+                if (job->stopped > 0) {
+                    continue_job(&bg_queue, job);
+                }
+            }
+            check_completed_bg_jobs(&bg_queue, 0);
+            // a -c command exits with the status of its line, like sh -c
+            if (command_line) {
+                exit(last_status);
+            }
             /* make EOF equate to exit */
-            strncpy(cmd, "exit\n", CMDLINE_MAX);
+            cmd = "exit";
+        }
 
         /* print command line if stdin is not provided by terminal */
-        if (!isatty(STDIN_FILENO))
+        if (!batch_mode && !isatty(STDIN_FILENO))
         {
-            printf("%s", cmd);
+            printf("%s\n", cmd);
             fflush(stdout);
         }
 
-        /* remove trailing newline from command line */
-        nl = strchr(cmd, '\n');
-        if (nl)
-            *nl = '\0';
-
         if (cmd[0] == '\0') { // for empty commands
             continue;
         }
 
-        char* original_command = strdup(cmd);
-
-        pad_spaces_if_missing(cmd); 
+        // every token of this line lives in the line arena until the next line
+        arena_reset(&line_arena);
+        char* original_command = arena_strdup(&line_arena, cmd);
 
-        args_index = parse_command(cmd, commands);
+        STAT_START(parse_start);
+        args_index = parse_cached(cmd, &commands, &line_arena);
+        STAT_STOP(PHASE_PARSE, parse_start);
         
-        // if there are too many args, then we skip execution
-        if (args_index < 0) {
-            free(original_command);
+        // skip execution for blank or invalid lines
+        if (args_index <= 0) {
             continue;
         }
         
-        // check for exit when background jobs are active
-        if (!strcmp(commands->args[0], "exit") && bg_queue.num_jobs > 0) {
-            fprintf(stderr, "Error: active job still running\n");
-
-            // check if any background jobs have completed
-            if (sigchld_flag) {
-                check_completed_bg_jobs(&bg_queue);
-                sigchld_flag = 0;
+        // the pipelines of a list run back to back in this turn of the loop, one
+        // skipped by its && or || leaves the status of the previous one as it is
+        BackgroundJob *runs = arena_alloc(&line_arena, args_index * sizeof(BackgroundJob));
+        int num_runs = 0;
+        int exit_shell = 0;
+        for (int start = 0; start < args_index && !exit_shell; ) {
+            Command *pipeline = &commands[start];
+            int n = pipeline_length(pipeline, args_index - start);
+            start += n;
+            if ((pipeline->list_op == LIST_AND && last_status != 0)
+                || (pipeline->list_op == LIST_OR && last_status == 0)) {
+                continue;
             }
-
-            // print exit
-            fprintf(stderr, "+ completed 'exit' [1]\n");
-            free(original_command);
-            continue;
-        }
-        
-        if (!strcmp(commands->args[0], "exit"))
-        {
-            fprintf(stderr, "Bye...\n");
-            fprintf(stderr, "+ completed 'exit' [0]\n");
-            free(original_command);
-            exit(0);
-        }
-
-        if (!strcmp(commands->args[0], "pwd"))
-        {
-            char cwd[CMDLINE_MAX];
-            if (getcwd(cwd, sizeof(cwd)) != NULL) {
-                fprintf(stdout, "%s\n", cwd);
-                fprintf(stderr, "+ completed '%s' [0]\n", original_command);
+            char *text = n == args_index ? original_command
+                                         : arena_strndup(&line_arena, cmd + pipeline->text_start, pipeline->text_len);
+            if (pipeline != commands && strpbrk(text, "$*?[")) {
+                // its expansions must see what the pipelines before it did, so it is parsed again
+                n = parse_command(text, &pipeline, &line_arena);
+                if (n <= 0) {
+                    last_status = n < 0 ? 1 : 0;
+                    continue;
+                }
+            } else if (pipeline != commands && open_command_files(pipeline, n) < 0) {
+                last_status = 1;
+                continue;
             }
-            free(original_command);
-            continue;
-        }
-        
-        if (!strcmp(commands->args[0], "cd"))
-        {
-            // can assume only one arg
-            int chdir_status = chdir(commands->args[1]);
-            if (chdir_status != 0) {
-                fprintf(stderr, "Error: cannot cd into directory\n");
-                fprintf(stderr, "+ completed '%s' [1]\n", original_command);
-            } else {
-                fprintf(stderr, "+ completed '%s' [0]\n", original_command);
+
+            // builtins of the shell itself run here whatever pipeline they are in,
+            // they are recorded as a run without pids
+            const Builtin *builtin = find_builtin(pipeline->args[0]);
+            if (builtin && builtin->shell) {
+                BackgroundJob *run = &runs[num_runs++];
+                memset(run, 0, sizeof(*run));
+                run->start_ns = monotonic_ns();
+                run->command = text;
+                run->pid_count = 1;
+                run->exit_status = arena_alloc(&line_arena, sizeof(int));
+                run->exit_status[0] = builtin->shell(pipeline);
+                close_command_fds(pipeline, n);  // builtins don't redirect
+                last_status = run->exit_status[0];
+                exit_shell = builtin->shell == builtin_exit && last_status == 0;
+                continue;
             }
-            free(original_command);
-            continue;
-        }
 
-        // check if this is a background job
-        int is_background = commands[args_index-1].background;
-        int pipe_fds[3][2];
+            // background jobs go to the scheduler, which launches or queues them
+            if (pipeline[n - 1].background) {
+                add_bg_job(&bg_queue, pipeline, n, text);
+                pool_refill();
+                last_status = 0;
+                continue;
+            }
 
-        for (int i = 0; i < args_index; i++) {
-            if (pipe(pipe_fds[i]) == -1) {
-                perror("pipe");
-                exit(1);
+            last_status = run_pipeline(pipeline, n, text, &runs[num_runs]);
+            if (runs[num_runs].remaining == 0) {
+                num_runs++;  // a stopped one is reported as a job
+            }
+            // ^C stops the whole list like it stops a single pipeline
+            if (job_tty && last_status == 128 + SIGINT) {
+                break;
             }
         }
 
-        pid_t pids[MAX_COMMANDS] = {0};
-        int exit_status[MAX_COMMANDS] = {0};
-
-        // loop per command
-        for (int i = 0; i < args_index; i++) {
-            pid_t pid;
-            pid = fork();
-
-            if (pid == 0) {  // child
-                // input redirection
-                if (commands[i].input_f) {
-                    int input_fd = open(commands[i].input_f, O_RDONLY);
-                    dup2(input_fd, STDIN_FILENO);
-                    close(input_fd);
-                } else if (i > 0) {
-                    // not the first command, read from prev pipe
-                    dup2(pipe_fds[i - 1][0], STDIN_FILENO);
+        // one completion line for the line, with the stage statuses of each pipeline that ran
+        if (num_runs > 0) {
+            STAT_START(report_start);
+            int ran_pipeline = 0;
+            fprintf(stderr, "+ completed '%s' ", original_command);
+            for (int r = 0; r < num_runs; r++) {
+                if (r) {
+                    fputc(' ', stderr);
                 }
-
-                // output redirection
-                if (commands[i].output_f) {
-                    int output_fd = open(commands[i].output_f, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                    dup2(output_fd, STDOUT_FILENO);
-                    close(output_fd);
-                } else if (i < args_index - 1) {
-                    // not last command, write next pipe
-                    dup2(pipe_fds[i][1], STDOUT_FILENO);
+                for (int i = 0; i < runs[r].pid_count; i++) {
+                    fprintf(stderr, "[%d]", runs[r].exit_status[i]);
                 }
-
-                // close all fds from piping
-                for (int j = 0; j < args_index; j++) {
-                    close(pipe_fds[j][0]);
-                    close(pipe_fds[j][1]);
+                ran_pipeline |= runs[r].pids != NULL;
+            }
+            fprintf(stderr, "\n");
+            if (capture_fd >= 0 && ran_pipeline) {
+                dprintf(capture_fd, "+ completed '%s' ", original_command);
+                for (int r = 0; r < num_runs; r++) {
+                    if (r) {
+                        dprintf(capture_fd, " ");
+                    }
+                    for (int i = 0; i < runs[r].pid_count; i++) {
+                        dprintf(capture_fd, "[%d]", runs[r].exit_status[i]);
+                    }
                 }
-
-                execvp(commands[i].args[0], commands[i].args);
-                fprintf(stderr, "Error: command not found\n");
-                exit(1);
+                dprintf(capture_fd, "\n");
             }
-            else if (pid < 0) {
-                perror("fork");
-                exit(1);
-            } else { // parent
-                pids[i] = pid;
+            for (int r = 0; r < num_runs; r++) {
+                BackgroundJob *run = &runs[r];
+                if (usage_log && run->pids) {
+                    report_usage(run, run->command);
+                }
+                if (telemetry.kind) {
+                    pid_t no_pid = 0;
+                    telemetry_emit(run->command, run->pids ? run->pids : &no_pid, run->exit_status, run->usage,
+                                   run->pid_count, run->start_ns, 0);
+                }
             }
+            history_add(original_command, last_status);
+            STAT_STOP(PHASE_REPORT, report_start);
         }
-
-        // parent process: close all pipes
-        for (int i = 0; i < args_index; i++) {
-            close(pipe_fds[i][0]);
-            close(pipe_fds[i][1]);
+        if (exit_shell) {
+            exit(0);
         }
 
-        // for background jobs, don't wait and save info
-        if (is_background) {
-            // Store PIDs and command info for background job
-            add_bg_job(&bg_queue, pids, args_index, original_command);
-        } else {
-            // for foreground jobs, wait as before
-            for (int i = 0; i < args_index; i++) {
-                int status;
-                waitpid(pids[i], &status, 0);
-
-                // exit status of the last command
-                if (WIFEXITED(status)) {
-                    exit_status[i] = WEXITSTATUS(status);
-                }
-            }
-
-            // before reporting foreground completion, check and report any background jobs that have finished
-            if (sigchld_flag) {
-                check_completed_bg_jobs(&bg_queue);
-                sigchld_flag = 0;
-            }
-
-            // completion status for foreground job
-            fprintf(stderr, "+ completed '%s' ", original_command);
-            for (int i = 0; i < args_index; i++) {
-                fprintf(stderr, "[%d]", exit_status[i]);
-            }
-            fprintf(stderr, "\n");
-            free(original_command);
-        }
     }
 
     // free any remaining resources
-    if (bg_queue.num_jobs > 0) {
-        for (int i = 0; i < bg_queue.num_jobs; i++) {
-            if (bg_queue.jobs[i].active) {
-                free(bg_queue.jobs[i].command);
-            }
-        }
+    while (bg_queue.head) {
+        BackgroundJob *job = bg_queue.head;
+        bg_queue.head = job->next;
+        slab_free(&job_slab, job->command);
+        free(job->commands);
+        free(job->pids);
+        free(job->usage);
+        free(job);
     }
 
     return EXIT_SUCCESS;
 }
+#endif  // SSHELL_NO_MAIN
@@ -364,6 +364,24 @@ pipe() {
 }
 TEST_CASES+=("pipe")
 
+## Pipelines are not limited to four commands
+pipe_long() {
+    log "--- Running test case: ${FUNCNAME} ---"
+    run_test_case "echo hello | cat | cat | cat | cat | cat | cat | tr h j\nexit\n"
+
+    local line_array=()
+    line_array+=("$(select_line "${STDOUT}" "2")")
+    line_array+=("$(select_line "${STDERR}" "1")")
+    local corr_array=()
+    corr_array+=("jello")
+    corr_array+=("+ completed 'echo hello | cat | cat | cat | cat | cat | cat | tr h j' [0][0][0][0][0][0][0][0]")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "${score}"
+}
+TEST_CASES+=("pipe_long")
+
 ## Extra feature #1: input redirection
 in_redir() {
     log "--- Running ${FUNCNAME} ---"
@@ -405,6 +423,522 @@ background() {
 }
 TEST_CASES+=("background")
 
+## Command hash remembers resolved commands
+builtin_hash() {
+    log "--- Running test case: ${FUNCNAME} ---"
+    run_test_case "sleep 0\nhash\nexit\n"
+
+    local line_array=()
+    line_array+=("$(select_line "${STDOUT}" "3")")
+    line_array+=("$(select_line "${STDERR}" "2")")
+    local corr_array=()
+    corr_array+=("$(printf 'hits\tcommand')")
+    corr_array+=("+ completed 'hash' [0]")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "${score}"
+}
+TEST_CASES+=("builtin_hash")
+
+## Stats builtin: phase and syscall counters
+builtin_stats() {
+    log "--- Running test case: ${FUNCNAME} ---"
+    run_test_case "echo hi\nstats\nexit\n"
+
+    local line_array=()
+    line_array+=("$(select_line "${STDOUT}" "4")")
+    line_array+=("$(select_line "${STDERR}" "2")")
+    local corr_array=()
+    corr_array+=("$(printf 'phase\tcalls\ttotal_us\tavg_us')")
+    corr_array+=("+ completed 'stats' [0]")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "${score}"
+}
+TEST_CASES+=("builtin_stats")
+
+## Parse cache: a repeated line is a hit, its redirections are opened again
+parse_cache() {
+    log "--- Running ${FUNCNAME} ---"
+    run_test_case "echo x > t\ncat < t\necho y > t\ncat < t\nstats\nexit\n"
+    rm -f t
+
+    local line_array=()
+    line_array+=("$(select_line "${STDOUT}" "6")")
+    line_array+=("$(select_line "${STDOUT}" "25")")
+    local corr_array=()
+    corr_array+=("y")
+    corr_array+=("$(printf 'parse\t1\t4')")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "${score}"
+}
+TEST_CASES+=("parse_cache")
+
+## Pipe sizing: pipesize sets the capacity of pipes between stages
+builtin_pipesize() {
+    log "--- Running ${FUNCNAME} ---"
+    run_test_case "pipesize 256k\npipesize\nseq 3 | tail -1\nexit\n"
+
+    local line_array=()
+    line_array+=("$(select_line "${STDOUT}" "4")")
+    line_array+=("$(select_line "${STDOUT}" "6")")
+    local corr_array=()
+    corr_array+=("$(printf '262144\t%s\tstream' "$(cat /proc/sys/fs/pipe-max-size)")")
+    corr_array+=("3")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "${score}"
+}
+TEST_CASES+=("builtin_pipesize")
+
+## Placement policy: affinity sets and reports it
+builtin_affinity() {
+    log "--- Running ${FUNCNAME} ---"
+    run_test_case "affinity node\naffinity\ncat /dev/null\nexit\n"
+
+    local line_array=()
+    line_array+=("$(select_line "${STDOUT}" "3")")
+    line_array+=("$(select_line "${STDERR}" "3")")
+    local corr_array=()
+    corr_array+=("$(printf 'policy\tnode')")
+    corr_array+=("+ completed 'cat /dev/null' [0]")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "${score}"
+}
+TEST_CASES+=("builtin_affinity")
+
+## Job scheduler: jobs over the limit are queued, wait blocks on all of them
+job_limit() {
+    log "--- Running ${FUNCNAME} ---"
+    run_test_case "jobs -l 1\nsleep 0.2 &\nsleep 0.2 &\njobs\nwait\nexit\n"
+
+    local line_array=()
+    line_array+=("$(select_line "${STDOUT}" "5")")
+    line_array+=("$(select_line "${STDOUT}" "6")")
+    line_array+=("$(select_line "${STDERR}" "5")")
+    local corr_array=()
+    corr_array+=("$(printf '[1]\trunning\tsleep 0.2 &')")
+    corr_array+=("$(printf '[2]\tqueued\tsleep 0.2 &')")
+    corr_array+=("+ completed 'wait' [0]")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "${score}"
+}
+TEST_CASES+=("job_limit")
+
+## Native builtins: echo honors redirection and pipes without forking
+native_echo() {
+    log "--- Running ${FUNCNAME} ---"
+    run_test_case "echo hi > t\ncat t\necho piped | cat\nexit\n"
+    rm -f t
+
+    local line_array=()
+    line_array+=("$(select_line "${STDOUT}" "3")")
+    line_array+=("$(select_line "${STDOUT}" "5")")
+    line_array+=("$(select_line "${STDERR}" "3")")
+    local corr_array=()
+    corr_array+=("hi")
+    corr_array+=("piped")
+    corr_array+=("+ completed 'echo piped | cat' [0][0]")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "${score}"
+}
+TEST_CASES+=("native_echo")
+
+## Native builtins: test and [ exit statuses
+native_test() {
+    log "--- Running ${FUNCNAME} ---"
+    run_test_case "test 1 -lt 2\n[ a = b ]\nexit\n"
+
+    local line_array=()
+    line_array+=("$(select_line "${STDERR}" "1")")
+    line_array+=("$(select_line "${STDERR}" "2")")
+    local corr_array=()
+    corr_array+=("+ completed 'test 1 -lt 2' [0]")
+    corr_array+=("+ completed '[ a = b ]' [1]")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "${score}"
+}
+TEST_CASES+=("native_test")
+
+## Output capture: foreground output and completion lines relayed to a file
+capture() {
+    log "--- Running ${FUNCNAME} ---"
+    local sshell_exec="${SSHELL_EXEC}"
+    SSHELL_EXEC="SSHELL_CAPTURE=cap ${sshell_exec}"
+    run_test_case "echo hi | cat\nexit\n"
+    SSHELL_EXEC="${sshell_exec}"
+    local captured="$(cat cap)"
+    rm -f cap
+
+    local line_array=()
+    line_array+=("$(select_line "${STDOUT}" "2")")
+    line_array+=("$(select_line "${captured}" "1")")
+    line_array+=("$(select_line "${captured}" "2")")
+    local corr_array=()
+    corr_array+=("hi")
+    corr_array+=("hi")
+    corr_array+=("+ completed 'echo hi | cat' [0][0]")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "${score}"
+}
+TEST_CASES+=("capture")
+
+## History: completed lines and their status are kept in SSHELL_HISTFILE
+history_file() {
+    log "--- Running ${FUNCNAME} ---"
+    local sshell_exec="${SSHELL_EXEC}"
+    SSHELL_EXEC="SSHELL_HISTFILE=hist ${sshell_exec}"
+    run_test_case "echo a\nfalse\nhistory\nexit\n"
+    SSHELL_EXEC="${sshell_exec}"
+    rm -f hist hist.idx
+
+    local line_array=()
+    line_array+=("$(select_line "${STDOUT}" "5")")
+    line_array+=("$(select_line "${STDOUT}" "6")")
+    local corr_array=()
+    corr_array+=("$(printf '    1\t0\techo a')")
+    corr_array+=("$(printf '    2\t1\tfalse')")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "${score}"
+}
+TEST_CASES+=("history_file")
+
+## Resource use: signal deaths are 128+signal, SSHELL_RUSAGE adds a line per stage
+rusage_report() {
+    log "--- Running ${FUNCNAME} ---"
+    local sshell_exec="${SSHELL_EXEC}"
+    SSHELL_EXEC="SSHELL_RUSAGE=stderr ${sshell_exec}"
+    run_test_case "yes | head -1\nexit\n"
+    SSHELL_EXEC="${sshell_exec}"
+
+    local usage_line="$(select_line "${STDERR}" "3")"
+    local line_array=()
+    line_array+=("$(select_line "${STDERR}" "1")")
+    line_array+=("${usage_line%% wall*}")
+    local corr_array=()
+    corr_array+=("+ completed 'yes | head -1' [141][0]")
+    corr_array+=("+ usage 'yes | head -1' stage 2 [0]")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "${score}"
+}
+TEST_CASES+=("rusage_report")
+
+## Telemetry: one 1 KiB record per completion, here written to fd 3
+telemetry_fd() {
+    log "--- Running ${FUNCNAME} ---"
+    local sshell_exec="${SSHELL_EXEC}"
+    SSHELL_EXEC="SSHELL_TELEMETRY=fd:3 ${sshell_exec} 3>tel"
+    run_test_case "true\nfalse\nexit\n"
+    SSHELL_EXEC="${sshell_exec}"
+    local size="$(stat -c %s tel)"
+    local status="$(od -An -t d4 -j 1076 -N 4 tel | tr -d ' ')"
+    local command="$(dd if=tel bs=1 skip=1456 count=5 2>/dev/null)"
+    rm -f tel
+
+    local line_array=()
+    line_array+=("${size}")
+    line_array+=("${status}")
+    line_array+=("${command}")
+    local corr_array=()
+    corr_array+=("3072")
+    corr_array+=("1")
+    corr_array+=("false")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "${score}"
+}
+TEST_CASES+=("telemetry_fd")
+
+## Fan-out: one producer feeds every branch, each stage has its own status
+fan_out() {
+    log "--- Running ${FUNCNAME} ---"
+    run_test_case "seq 5 | { wc -l > a , tail -1 > b }\ncat a b\nexit\n"
+    rm -f a b
+
+    local line_array=()
+    line_array+=("$(select_line "${STDOUT}" "3")")
+    line_array+=("$(select_line "${STDOUT}" "4")")
+    line_array+=("$(select_line "${STDERR}" "1")")
+    local corr_array=()
+    corr_array+=("5")
+    corr_array+=("5")
+    corr_array+=("+ completed 'seq 5 | { wc -l > a , tail -1 > b }' [0][0][0]")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "${score}"
+}
+TEST_CASES+=("fan_out")
+
+## Append: >> adds to the output file instead of truncating it
+output_append() {
+    log "--- Running ${FUNCNAME} ---"
+    run_test_case "echo a > t\necho b >> t\ncat t\nexit\n"
+    rm -f t
+
+    local line_array=()
+    line_array+=("$(select_line "${STDOUT}" "4")")
+    line_array+=("$(select_line "${STDOUT}" "5")")
+    local corr_array=()
+    corr_array+=("a")
+    corr_array+=("b")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "${score}"
+}
+TEST_CASES+=("output_append")
+
+## Job control: kill signals the process group of a job, a queued job is dropped
+job_kill() {
+    log "--- Running ${FUNCNAME} ---"
+    local sshell_exec="${SSHELL_EXEC}"
+    SSHELL_EXEC="SSHELL_JOBS=1 ${sshell_exec}"
+    run_test_case "sleep 5 &\nsleep 5 &\nkill %2\njobs\nkill %1\nwait\nexit\n"
+    SSHELL_EXEC="${sshell_exec}"
+
+    local line_array=()
+    line_array+=("$(select_line "${STDERR}" "2")")
+    line_array+=("$(select_line "${STDOUT}" "5")")
+    line_array+=("$(select_line "${STDERR}" "5")")
+    local corr_array=()
+    corr_array+=("+ completed 'sleep 5 &' [143]")
+    corr_array+=("$(printf '[1]\trunning\tsleep 5 &')")
+    corr_array+=("+ completed 'sleep 5 &' [143]")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "${score}"
+}
+TEST_CASES+=("job_kill")
+
+## Worker pool: stages run in pre-forked workers, natives without exec
+worker_pool() {
+    log "--- Running ${FUNCNAME} ---"
+    local sshell_exec="${SSHELL_EXEC}"
+    SSHELL_EXEC="SSHELL_WORKERS=2 ${sshell_exec}"
+    run_test_case "true | echo b | cat\necho abc | tr a x\nexit\n"
+    SSHELL_EXEC="${sshell_exec}"
+
+    local line_array=()
+    line_array+=("$(select_line "${STDOUT}" "2")")
+    line_array+=("$(select_line "${STDOUT}" "4")")
+    line_array+=("$(select_line "${STDERR}" "1")")
+    local corr_array=()
+    corr_array+=("b")
+    corr_array+=("xbc")
+    corr_array+=("+ completed 'true | echo b | cat' [0][0][0]")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "${score}"
+}
+TEST_CASES+=("worker_pool")
+
+## A cached path that went away is dropped by fork and worker launches too
+hash_stale_fork() {
+    log "--- Running ${FUNCNAME} ---"
+    mkdir -p a b
+    printf '#!/bin/sh\necho hi\n' > a/hi
+    cp a/hi b/hi
+    chmod +x a/hi b/hi
+    local sshell_exec="${SSHELL_EXEC}"
+    SSHELL_EXEC="PATH=${PWD}/a:${PWD}/b:${PATH} SSHELL_LAUNCH=fork ${sshell_exec}"
+    run_test_case "hi\nrm a/hi\nhi\nhash\nexit\n"
+    SSHELL_EXEC="${sshell_exec}"
+
+    local line_array=()
+    line_array+=("$(select_line "${STDOUT}" "5")")
+    line_array+=("$(echo "${STDOUT}" | grep $'^ *[0-9]*\t.*/hi$')")
+    local corr_array=()
+    corr_array+=("hi")
+    corr_array+=("$(printf '   1\t%s' "${PWD}/b/hi")")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "${score}"
+}
+TEST_CASES+=("hash_stale_fork")
+
+## Workers forked before a cd run their stages in the new directory
+worker_pool_cd() {
+    log "--- Running ${FUNCNAME} ---"
+    local sshell_exec="${SSHELL_EXEC}"
+    SSHELL_EXEC="SSHELL_WORKERS=2 ${sshell_exec}"
+    run_test_case "mkdir sub\ncd sub\n/bin/pwd | xargs basename\nexit\n"
+    SSHELL_EXEC="${sshell_exec}"
+
+    local line_array=()
+    line_array+=("$(select_line "${STDOUT}" "4")")
+    local corr_array=()
+    corr_array+=("sub")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "${score}"
+}
+TEST_CASES+=("worker_pool_cd")
+
+## Daemon mode: sessions forked by one daemon, each with its own cwd
+daemon_sessions() {
+    log "--- Running ${FUNCNAME} ---"
+    local sshell_exec="${SSHELL_EXEC}"
+    rm -f sd.sock
+    ${sshell_exec} -d sd.sock &
+    local daemon_pid=$!
+    while [[ ! -S sd.sock ]]; do sleep 0.05; done
+    SSHELL_EXEC="${sshell_exec} -a sd.sock"
+    run_test_case "cd /\npwd\nexit\n"
+    local other="$(echo pwd | ${SSHELL_EXEC} 2>/dev/null)"
+    SSHELL_EXEC="${sshell_exec}"
+    kill ${daemon_pid}
+    wait ${daemon_pid} 2>/dev/null
+    rm -f sd.sock
+
+    local line_array=()
+    line_array+=("$(select_line "${STDOUT}" "1")")
+    line_array+=("$(select_line "${STDERR}" "2")")
+    line_array+=("${other}")
+    line_array+=("${RET}")
+    local corr_array=()
+    corr_array+=("/")
+    corr_array+=("+ completed 'pwd' [0]")
+    corr_array+=("${PWD}")
+    corr_array+=("0")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "${score}"
+}
+TEST_CASES+=("daemon_sessions")
+
+## Variables: $NAME expands from the environment, export and unset change it
+variables() {
+    log "--- Running ${FUNCNAME} ---"
+    run_test_case "export FOO=bar\necho x\\\$FOO\nprintenv FOO\nunset FOO\necho x\\\$FOO\nexit\n"
+
+    local line_array=()
+    line_array+=("$(select_line "${STDOUT}" "3")")
+    line_array+=("$(select_line "${STDOUT}" "5")")
+    line_array+=("$(select_line "${STDOUT}" "8")")
+    local corr_array=()
+    corr_array+=("xbar")
+    corr_array+=("bar")
+    corr_array+=("x")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "${score}"
+}
+TEST_CASES+=("variables")
+
+## Globs: *, ? and [] expand to sorted paths, a pattern matching nothing stays
+globs() {
+    log "--- Running ${FUNCNAME} ---"
+    run_test_case "echo x > gl_b\necho x > gl_a\necho gl_*\necho x > gl_c\necho gl_[bc] gl_?z\nexit\n"
+    rm -f gl_a gl_b gl_c
+
+    local line_array=()
+    line_array+=("$(select_line "${STDOUT}" "4")")
+    line_array+=("$(select_line "${STDOUT}" "7")")
+    local corr_array=()
+    corr_array+=("gl_a gl_b")
+    corr_array+=("gl_b gl_c gl_?z")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "${score}"
+}
+TEST_CASES+=("globs")
+
+## Lists: ; && and || run pipelines back to back under one completion line
+lists() {
+    log "--- Running ${FUNCNAME} ---"
+    run_test_case "false && echo no || echo yes ; echo done\nexit\n"
+
+    local line_array=()
+    line_array+=("$(select_line "${STDOUT}" "2")")
+    line_array+=("$(select_line "${STDOUT}" "3")")
+    line_array+=("$(select_line "${STDERR}" "1")")
+    local corr_array=()
+    corr_array+=("yes")
+    corr_array+=("done")
+    corr_array+=("+ completed 'false && echo no || echo yes ; echo done' [1] [0] [0]")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "${score}"
+}
+TEST_CASES+=("lists")
+
+## -c runs its line without reading stdin and exits with the line's status
+command_mode() {
+    log "--- Running ${FUNCNAME} ---"
+    local sshell_exec="${SSHELL_EXEC}"
+    SSHELL_EXEC="${sshell_exec} -c 'echo one; false'"
+    run_test_case "echo stdin\nexit\n"
+    SSHELL_EXEC="${sshell_exec}"
+
+    local line_array=()
+    line_array+=("$(select_line "${STDOUT}" "1")")
+    line_array+=("$(select_line "${STDOUT}" "2")")
+    line_array+=("$(select_line "${STDERR}" "1")")
+    line_array+=("$(select_line "${STDERR}" "2")")
+    line_array+=("${RET}")
+    local corr_array=()
+    corr_array+=("one")
+    corr_array+=("")
+    corr_array+=("+ completed 'echo one; false' [0] [1]")
+    corr_array+=("")
+    corr_array+=("1")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "${score}"
+}
+TEST_CASES+=("command_mode")
+
+## Batch mode: no prompt or echo, completion lines still reported
+batch_mode() {
+    log "--- Running ${FUNCNAME} ---"
+    local sshell_exec="${SSHELL_EXEC}"
+    SSHELL_EXEC="${sshell_exec} -b"
+    run_test_case "echo hello\nexit\n"
+    SSHELL_EXEC="${sshell_exec}"
+
+    local line_array=()
+    line_array+=("$(select_line "${STDOUT}" "1")")
+    line_array+=("$(select_line "${STDERR}" "1")")
+    local corr_array=()
+    corr_array+=("hello")
+    corr_array+=("+ completed 'echo hello' [0]")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "${score}"
+}
+TEST_CASES+=("batch_mode")
+
 #
 # Main functions
 #